@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "alarm.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "ctx.h"
+#include "../hw/misc.h"
+
+/*
+ * Alarms are broadcast as soon as they are raised or cleared, outside the heartbeat.
+ * The origin sends AG_ALARM_TX_CNT copies, every other MC relays the first copy once
+ * unless it hears enough copies from the others first. All the MCs keep the table,
+ * any of them can be elected master.
+ */
+
+#if defined(ESP_PLATFORM)
+#define P_ALARM_LOCK(ctx)   taskENTER_CRITICAL(&(ctx)->alarm.mux)
+#define P_ALARM_UNLOCK(ctx) taskEXIT_CRITICAL(&(ctx)->alarm.mux)
+#elif defined(__linux__)
+#define P_ALARM_LOCK(ctx)   pthread_mutex_lock(&(ctx)->alarm.mux)
+#define P_ALARM_UNLOCK(ctx) pthread_mutex_unlock(&(ctx)->alarm.mux)
+#endif
+
+void ag_alarm_init(AG_CTX_t *ctx) {
+    ag_lock_init(&ctx->alarm.mux);
+}
+
+/**
+ * @brief announce a local alarm, AG_ERR_NONE when it is cleared
+ *
+ * Can be called from any task, the copies are sent by task_rf.
+ */
+void ag_alarm_raise(AG_CTX_t *ctx, uint8_t err) {
+    P_ALARM_LOCK(ctx);
+    if (ctx->alarm.id == 0) {
+        // random start so a restarted MC is not taken for a repeated alarm
+        ctx->alarm.id = (uint8_t) get_rand_u32();
+    }
+    ctx->alarm.id ++;
+    ctx->alarm.err = err;
+    ctx->alarm.tx_left = AG_ALARM_TX_CNT;
+    ctx->alarm.ts_raise_us = get_ts_us();
+    ctx->alarm.ts_next = get_ts_ms();
+    ctx->alarm.stats.tx ++;
+    P_ALARM_UNLOCK(ctx);
+
+    ag_comm_wake(ctx);
+}
+
+static void p_alarm_pkt(uint8_t *buff, HW_MAC_t mac, uint8_t id, uint8_t err, uint32_t age) {
+    buff[0] = AG_PROTO_VER1;
+    buff[1] = AG_PKT_TYPE_ALARM;
+    hw_mac_to_bytes(mac, &buff[2]);
+    buff[8] = id;
+    buff[9] = err;
+    buff[10] = (uint8_t) (age & 0xFF);
+    buff[11] = (uint8_t) ((age >> 8) & 0xFF);
+    buff[12] = (uint8_t) ((age >> 16) & 0xFF);
+    buff[13] = (uint8_t) (age >> 24);
+}
+
+/**
+ * @brief send the local alarm copies and the relays that are due, called from task_rf
+ *
+ * @return time in ms until the next copy or relay
+ */
+uint32_t ag_alarm_main(AG_CTX_t *ctx) {
+    while (1) {
+        uint8_t buff[AG_PKT_ALARM_NB];
+        uint32_t wait_ms = UINT32_MAX;
+        uint32_t ts_now = get_ts_ms();
+        int due = 0;
+
+        P_ALARM_LOCK(ctx);
+        if (ctx->alarm.tx_left != 0) {
+            int32_t tmp = (int32_t) (ctx->alarm.ts_next - ts_now);
+            if (tmp <= 0) {
+                p_alarm_pkt(buff, ctx->hw_id, ctx->alarm.id, ctx->alarm.err, get_ts_us() - ctx->alarm.ts_raise_us);
+                ctx->alarm.tx_left --;
+                ctx->alarm.ts_next = ts_now + AG_ALARM_TX_GAP_MS;
+                ctx->alarm.stats.tx_copy ++;
+                due = 1;
+            } else {
+                wait_ms = (uint32_t) tmp;
+            }
+        }
+        for (int i = 0; (i < AG_ALARM_TBL_LEN) && (due == 0); i++) {
+            AG_ALARM_t *alarm = &ctx->alarm.tbl[i];
+            if (alarm->relay == 0) {
+                continue;
+            }
+            int32_t tmp = (int32_t) (alarm->ts_relay - ts_now);
+            if (tmp > 0) {
+                if ((uint32_t) tmp < wait_ms) {
+                    wait_ms = (uint32_t) tmp;
+                }
+                continue;
+            }
+            alarm->relay = 0;
+            if (alarm->heard >= AG_ALARM_RELAY_SUPPRESS) {
+                ctx->alarm.stats.relay_skip ++;
+                continue;
+            }
+            p_alarm_pkt(buff, alarm->mac, alarm->id, alarm->err,
+                        alarm->age + (get_ts_us() - alarm->ts_rx_us));
+            ctx->alarm.stats.relay ++;
+            due = 1;
+        }
+        P_ALARM_UNLOCK(ctx);
+
+        if (due == 0) {
+            return wait_ms;
+        }
+
+        AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_SAFETY);
+        if (frame == NULL) {
+            // this copy is lost, try the next ones as soon as the pool drains
+            return 1;
+        }
+        frame->dst_mac = HW_MAC_BCAST;
+        memcpy(frame->data, buff, AG_PKT_ALARM_NB);
+        frame->nb = AG_PKT_ALARM_NB;
+        ag_comm_tx(ctx, frame);
+    }
+}
+
+/**
+ * @return table entry of the origin, a free or the oldest one if it has none
+ */
+static AG_ALARM_t *p_alarm_entry(AG_CTX_t *ctx, HW_MAC_t mac) {
+    AG_ALARM_t *oldest = &ctx->alarm.tbl[0];
+    AG_ALARM_t *free_entry = NULL;
+    uint32_t ts_now = get_ts_ms();
+
+    for (int i = 0; i < AG_ALARM_TBL_LEN; i++) {
+        AG_ALARM_t *alarm = &ctx->alarm.tbl[i];
+        if (alarm->mac == mac) {
+            return alarm;
+        }
+        if (alarm->mac == HW_MAC_NONE) {
+            if (free_entry == NULL) {
+                free_entry = alarm;
+            }
+        } else if ((ts_now - alarm->ts_rx) > (ts_now - oldest->ts_rx)) {
+            oldest = alarm;
+        }
+    }
+    AG_ALARM_t *alarm = (free_entry != NULL) ? free_entry : oldest;
+    memset(alarm, 0, sizeof (AG_ALARM_t));
+    return alarm;
+}
+
+/**
+ * @brief record an alarm of another MC and schedule its relay
+ */
+void ag_alarm_rx(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    if (frame->nb < AG_PKT_ALARM_NB) {
+        return;
+    }
+
+    HW_MAC_t mac = hw_mac_from_bytes(&frame->data[2]);
+    if (mac == ctx->hw_id) {
+        // one of ours relayed back
+        return;
+    }
+    uint8_t id = frame->data[8];
+    uint8_t err = frame->data[9];
+    uint32_t age = (uint32_t) frame->data[10] | ((uint32_t) frame->data[11] << 8)
+                   | ((uint32_t) frame->data[12] << 16) | ((uint32_t) frame->data[13] << 24);
+    uint32_t ts_now = get_ts_ms();
+    uint32_t latency = 0;
+
+    P_ALARM_LOCK(ctx);
+    AG_ALARM_t *alarm = p_alarm_entry(ctx, mac);
+    if ((alarm->mac == mac) && ((int8_t) (id - alarm->id) <= 0)
+            && ((ts_now - alarm->ts_rx) < AG_ALARM_FORGET_MS)) {
+        if (id == alarm->id) {
+            alarm->heard ++;
+        }
+        ctx->alarm.stats.rx_dup ++;
+        P_ALARM_UNLOCK(ctx);
+        return;
+    }
+    latency = age + (get_ts_us() - frame->ts);
+    alarm->mac = mac;
+    alarm->id = id;
+    alarm->err = err;
+    alarm->relay = 1;
+    alarm->heard = 0;
+    alarm->ts_rx = ts_now;
+    alarm->ts_rx_us = frame->ts;
+    alarm->ts_relay = ts_now + (get_rand_u32() % (AG_ALARM_RELAY_MS + 1));
+    alarm->age = age;
+    alarm->latency = latency;
+    alarm->cnt ++;
+    ctx->alarm.stats.rx ++;
+    if (latency > ctx->alarm.stats.latency_max) {
+        ctx->alarm.stats.latency_max = latency;
+    }
+    P_ALARM_UNLOCK(ctx);
+
+    int idx = ag_find_remote_mod(ctx, mac);
+    if (idx >= 0) {
+        ctx->remote_mods[idx].last_err = err;
+    }
+    if ((ctx->mod_state.caps_sw & AG_CAP_SW_TMC) != 0) {
+        printf("ALARM " HW_MAC_FMT " error %d (%u us)\n", HW_MAC_ARG(mac), err, (unsigned int) latency);
+    }
+}
+
+/**
+ * @return 0 if the table entry idx is used
+ */
+int ag_alarm_get(AG_CTX_t *ctx, int idx, AG_ALARM_t *alarm) {
+    int ret = -1;
+
+    if ((idx < 0) || (idx >= AG_ALARM_TBL_LEN)) {
+        return -1;
+    }
+    P_ALARM_LOCK(ctx);
+    if (ctx->alarm.tbl[idx].mac != HW_MAC_NONE) {
+        *alarm = ctx->alarm.tbl[idx];
+        ret = 0;
+    }
+    P_ALARM_UNLOCK(ctx);
+    return ret;
+}
+
+void ag_alarm_get_stats(AG_CTX_t *ctx, AG_ALARM_STATS_t *stats) {
+    P_ALARM_LOCK(ctx);
+    *stats = ctx->alarm.stats;
+    P_ALARM_UNLOCK(ctx);
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AGATHIS_ALARM_R8KD2WQ6FM4YZJ3N
+#define AGATHIS_ALARM_R8KD2WQ6FM4YZJ3N
+/** @file */
+
+#include <stdint.h>
+
+#include "base.h"
+#include "comm.h"
+#include "defs.h"
+
+#define AG_ALARM_TX_CNT         3       /**< copies of an alarm sent by the MC that raised it */
+#define AG_ALARM_TX_GAP_MS      15      /**< between the copies */
+#define AG_ALARM_RELAY_MS       10      /**< max random delay before relaying an alarm */
+#define AG_ALARM_RELAY_SUPPRESS 2       /**< relay cancelled after hearing this many more copies */
+#define AG_ALARM_FORGET_MS      10000   /**< any alarm id is new after this, the origin may have restarted */
+#define AG_ALARM_TBL_LEN        AG_MC_MAX_CNT
+
+/**
+ * @brief last alarm raised or cleared by another MC
+ */
+typedef struct {
+    HW_MAC_t mac;           /**< origin, HW_MAC_NONE if the entry is free */
+    uint8_t id;             /**< alarm id of the origin */
+    uint8_t err;            /**< AG_ERR_*, AG_ERR_NONE when cleared */
+    uint8_t relay;          /**< relay pending */
+    uint8_t heard;          /**< copies heard since the first one */
+    uint32_t ts_rx;         /**< first copy received in ms */
+    uint32_t ts_rx_us;      /**< first copy received in us */
+    uint32_t ts_relay;      /**< relay due in ms */
+    uint32_t age;           /**< time since raised at the origin when the first copy was sent, in us */
+    uint32_t latency;       /**< raised at the origin to processed here in us */
+    uint32_t cnt;           /**< alarms received from this origin */
+} AG_ALARM_t;
+
+typedef struct {
+    uint32_t tx;            /**< alarms raised or cleared locally */
+    uint32_t tx_copy;       /**< copies of the local alarms sent */
+    uint32_t rx;            /**< alarms received */
+    uint32_t rx_dup;        /**< copies already known */
+    uint32_t relay;         /**< alarms relayed */
+    uint32_t relay_skip;    /**< relays cancelled, enough copies heard */
+    uint32_t latency_max;   /**< worst latency in us */
+} AG_ALARM_STATS_t;
+
+typedef struct {
+    uint8_t id;             /**< of the last local alarm */
+    uint8_t err;
+    uint8_t tx_left;        /**< copies left to send */
+    uint32_t ts_raise_us;
+    uint32_t ts_next;       /**< next copy in ms */
+    AG_ALARM_t tbl[AG_ALARM_TBL_LEN];
+    AG_ALARM_STATS_t stats;
+    AG_LOCK_t mux;
+} AG_ALARM_STATE_t;
+
+void ag_alarm_init(AG_CTX_t *ctx);
+
+void ag_alarm_raise(AG_CTX_t *ctx, uint8_t err);
+
+uint32_t ag_alarm_main(AG_CTX_t *ctx);
+
+void ag_alarm_rx(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+int ag_alarm_get(AG_CTX_t *ctx, int idx, AG_ALARM_t *alarm);
+
+void ag_alarm_get_stats(AG_CTX_t *ctx, AG_ALARM_STATS_t *stats);
+
+#endif /* AGATHIS_ALARM_R8KD2WQ6FM4YZJ3N */
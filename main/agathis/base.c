@@ -3,10 +3,13 @@
 #include "base.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #if defined(__AVR__)
 #include <avr/wdt.h>
 #elif defined(ESP_PLATFORM)
+#include "esp_mac.h"
+
 #include "../hw/platform_esp/base.h"
 #include "../hw/platform_esp/espnow.h"
 #elif defined(__linux__)
@@ -15,68 +18,119 @@
 #include "../hw/platform_sim/base.h"
 #endif
 
+#include "alarm.h"
+#include "comm.h"
 #include "config.h"
+#include "ctx.h"
+#include "frag.h"
+#include "ping.h"
+#include "rcmd.h"
+#include "../hw/misc.h"
 #include "../hw/storage.h"
 
-AG_MC_STATE_t MOD_STATE = {.ver = 1, .caps_hw_ext = 0, .caps_hw_int = 0, .caps_sw = 0,
-                           .last_err = 0, .type = 0, .tbd = 0xFF,
-                           .mfr_name = "", .mfr_pn = "", .mfr_sn = "",
-                           .i5_nom = 0.1f,  .i5_cutoff = 0.12f, .i3_nom = 1.0f, .i3_cutoff = 1.5f,
-                           .crc = 0xdeadbeef,
-                          };
-
-AG_RMT_MC_STATE_t REMOTE_MODS[AG_MC_MAX_CNT] = {
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-    {.mac = {0, 0}, .caps = 0, .last_err = 0, .last_seen = -1},
-};
-
-static uint8_t cnt_id_led = 0;
-
-void ag_init(void) {
+#define P_MOD_HASH_EMPTY 0xFFFF
+
+#define P_TW_SPAN       (1UL << (AG_TW_BITS * AG_TW_LEVELS))    /**< max time ahead in ms */
+#define P_TW_NONE       0xFFFF
+
+/**
+ * @brief read the HW ID, before any task of the MC runs
+ */
+static void p_init_hw_id(AG_CTX_t *ctx) {
+#if defined(ESP_PLATFORM)
+    uint8_t buff[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    ESP_ERROR_CHECK(esp_efuse_mac_get_default(buff));
+    ctx->hw_id = hw_mac_from_bytes(buff);
+#elif defined(__linux__)
+    // the sim keeps the MAC with the last byte on air first
+    uint8_t buff[HW_MAC_LEN];
+    for (int i = 0; i < HW_MAC_LEN; i++) {
+        buff[i] = ctx->sim->mac[HW_MAC_LEN - 1 - i];
+    }
+    ctx->hw_id = hw_mac_from_bytes(buff);
+#endif
+}
+
+/**
+ * @brief initialize an MC, ctx is cleared but for the sim state
+ */
+void ag_init(AG_CTX_t *ctx) {
+#if defined(__linux__)
+    SIM_STATE_t *sim = (ctx->sim != NULL) ? ctx->sim : &SIM_STATE;
+#endif
+    memset(ctx, 0, sizeof (AG_CTX_t));
+#if defined(__linux__)
+    ctx->sim = sim;
+#endif
+    p_init_hw_id(ctx);
+
+    ctx->mod_state.ver = AG_MC_STATE_VER;
+    ctx->mod_state.i5_nom = 0.1f;
+    ctx->mod_state.i5_cutoff = 0.12f;
+    ctx->mod_state.i3_nom = 1.0f;
+    ctx->mod_state.i3_cutoff = 1.5f;
+    ctx->mod_state.crc = 0xdeadbeef;
+
 #if MOD_HAS_STORAGE
-    MOD_STATE.caps_hw_int = AG_CAP_INT_STORAGE;
+    ctx->mod_state.caps_hw_int = AG_CAP_INT_STORAGE;
 #endif
 
 #if MOD_HAS_PWR
-    MOD_STATE.caps_hw_ext |= AG_CAP_EXT_PWR;
+    ctx->mod_state.caps_hw_ext |= AG_CAP_EXT_PWR;
 #endif
 #if MOD_HAS_CLK
-    MOD_STATE.caps_hw_ext |= AG_CAP_EXT_CLK;
+    ctx->mod_state.caps_hw_ext |= AG_CAP_EXT_CLK;
 #endif
 #if MOD_HAS_1PPS
-    MOD_STATE.caps_hw_ext |= AG_CAP_EXT_1PPS;
+    ctx->mod_state.caps_hw_ext |= AG_CAP_EXT_1PPS;
 #endif
 #if MOD_HAS_JTAG
-    MOD_STATE.caps_hw_ext |= AG_CAP_EXT_JTAG;
+    ctx->mod_state.caps_hw_ext |= AG_CAP_EXT_JTAG;
 #endif
 #if MOD_HAS_USB
-    MOD_STATE.caps_hw_ext |= AG_CAP_EXT_USB;
+    ctx->mod_state.caps_hw_ext |= AG_CAP_EXT_USB;
 #endif
 #if MOD_HAS_PCIE
-    MOD_STATE.caps_hw_ext |= AG_CAP_EXT_PCIE;
+    ctx->mod_state.caps_hw_ext |= AG_CAP_EXT_PCIE;
 #endif
 
 #if MOD_HAS_STORAGE
-    stor_restore_state();
+    stor_restore_state(ctx);
 #endif
-    MOD_STATE.last_err = AG_ERR_NONE;
+    ctx->mod_state.last_err = AG_ERR_NONE;
+
+    for (int i = 0; i < AG_MOD_HASH_LEN; i++) {
+        ctx->base.mod_hash[i] = P_MOD_HASH_EMPTY;
+    }
+    // lowest index on top, the entries fill up in order
+    for (int i = 0; i < AG_MC_MAX_CNT; i++) {
+        ctx->remote_mods[i].used = 0;
+        ctx->base.mod_free[i] = (uint16_t) (AG_MC_MAX_CNT - 1 - i);
+        ctx->base.tw.level[i] = AG_TW_LEVELS;
+    }
+    ctx->base.mod_free_cnt = AG_MC_MAX_CNT;
+
+    for (int i = 0; i < AG_TW_LEVELS; i++) {
+        for (int j = 0; j < AG_TW_SLOTS; j++) {
+            ctx->base.tw.head[i][j] = P_TW_NONE;
+        }
+        ctx->base.tw.busy[i] = 0;
+    }
+    ctx->base.tw.cur = get_ts_ms();
+
+    ctx->base.tmc.ts_start = get_ts_ms();
+    ctx->base.tmc.dirty = 1;
+    ctx->base.tmc.ts_dirty = ctx->base.tmc.ts_start;
+
+    ag_comm_init(ctx);
+    ag_rcmd_init(ctx);
+    ag_frag_init(ctx);
+    ag_ping_init(ctx);
+    ag_alarm_init(ctx);
 }
 
-void ag_reset(void) {
+void ag_reset(AG_CTX_t *ctx) {
+    ag_comm_leave(ctx);
 #if defined(__AVR__)
     printf("reset\n");
     wdt_enable(WDTO_15MS);
@@ -85,117 +139,695 @@ void ag_reset(void) {
 #endif
 }
 
-void ag_add_remote_mod(const uint32_t *mac, uint8_t caps) {
-    int idx_free = -1;
-    for (int i = 0 ; i < AG_MC_MAX_CNT; i ++) {
-        if ((REMOTE_MODS[i].last_seen == -1) && (idx_free == -1)) {
-            idx_free = i;
+static uint32_t p_tw_slot(uint8_t level, uint32_t expire) {
+    return (expire >> (AG_TW_BITS * level)) & (AG_TW_SLOTS - 1);
+}
+
+static void p_tw_add(AG_CTX_t *ctx, int idx, uint32_t expire) {
+    if ((int32_t) (expire - ctx->base.tw.cur) < 0) {
+        expire = ctx->base.tw.cur;
+    } else if ((expire - ctx->base.tw.cur) >= P_TW_SPAN) {
+        // checked again when it comes up
+        expire = ctx->base.tw.cur + P_TW_SPAN - 1;
+    }
+
+    uint32_t delta = expire - ctx->base.tw.cur;
+    uint8_t level = 0;
+    while ((level < (AG_TW_LEVELS - 1)) && (delta >= (1UL << (AG_TW_BITS * (level + 1))))) {
+        level ++;
+    }
+    uint32_t slot = p_tw_slot(level, expire);
+
+    ctx->base.tw.expire[idx] = expire;
+    ctx->base.tw.level[idx] = level;
+    ctx->base.tw.prev[idx] = P_TW_NONE;
+    ctx->base.tw.next[idx] = ctx->base.tw.head[level][slot];
+    if (ctx->base.tw.next[idx] != P_TW_NONE) {
+        ctx->base.tw.prev[ctx->base.tw.next[idx]] = (uint16_t) idx;
+    }
+    ctx->base.tw.head[level][slot] = (uint16_t) idx;
+    ctx->base.tw.busy[level] |= 1ULL << slot;
+}
+
+static void p_tw_del(AG_CTX_t *ctx, int idx) {
+    uint8_t level = ctx->base.tw.level[idx];
+    if (level == AG_TW_LEVELS) {
+        return;
+    }
+
+    uint32_t slot = p_tw_slot(level, ctx->base.tw.expire[idx]);
+    if (ctx->base.tw.prev[idx] != P_TW_NONE) {
+        ctx->base.tw.next[ctx->base.tw.prev[idx]] = ctx->base.tw.next[idx];
+    } else {
+        ctx->base.tw.head[level][slot] = ctx->base.tw.next[idx];
+    }
+    if (ctx->base.tw.next[idx] != P_TW_NONE) {
+        ctx->base.tw.prev[ctx->base.tw.next[idx]] = ctx->base.tw.prev[idx];
+    }
+    if (ctx->base.tw.head[level][slot] == P_TW_NONE) {
+        ctx->base.tw.busy[level] &= ~(1ULL << slot);
+    }
+    ctx->base.tw.level[idx] = AG_TW_LEVELS;
+}
+
+/**
+ * @return first ms from tw.cur on at which a slot needs processing, cur - 1 if the wheel is empty
+ */
+static uint32_t p_tw_next(AG_CTX_t *ctx) {
+    uint32_t next = ctx->base.tw.cur - 1;
+    uint32_t dist_min = UINT32_MAX;
+
+    for (uint8_t level = 0; level < AG_TW_LEVELS; level++) {
+        if (ctx->base.tw.busy[level] == 0) {
+            continue;
         }
-        if ((REMOTE_MODS[i].mac[0] == mac[0]) && (REMOTE_MODS[i].mac[1] == mac[1])) {
-            REMOTE_MODS[i].caps = caps;
-            REMOTE_MODS[i].last_seen = 0;
-            return;
+
+        // slots of the upper levels are processed at their start
+        uint32_t width = 1UL << (AG_TW_BITS * level);
+        uint32_t start = (ctx->base.tw.cur + width - 1) & ~(width - 1);
+        uint32_t pos = p_tw_slot(level, start);
+        uint64_t busy = (pos == 0) ? ctx->base.tw.busy[level] :
+                        ((ctx->base.tw.busy[level] >> pos) | (ctx->base.tw.busy[level] << (AG_TW_SLOTS - pos)));
+        uint32_t dist = (start - ctx->base.tw.cur) + ((uint32_t) __builtin_ctzll(busy) << (AG_TW_BITS * level));
+        if (dist < dist_min) {
+            dist_min = dist;
+            next = ctx->base.tw.cur + dist;
         }
     }
+    return next;
+}
+
+/**
+ * @brief move the entries of a slot one level down, or to the right level if they were capped
+ */
+static void p_tw_cascade(AG_CTX_t *ctx, uint8_t level) {
+    uint32_t slot = p_tw_slot(level, ctx->base.tw.cur);
+
+    while (ctx->base.tw.head[level][slot] != P_TW_NONE) {
+        int idx = ctx->base.tw.head[level][slot];
+        p_tw_del(ctx, idx);
+        p_tw_add(ctx, idx, ctx->base.tw.expire[idx]);
+    }
+}
+
+/**
+ * @brief add (dir = 1) or remove (dir = -1) an MC from the capability counters
+ */
+static void p_cap_cnt_upd(AG_CTX_t *ctx, uint8_t caps, int dir) {
+    while (caps != 0) {
+        int bit = __builtin_ctz(caps);
+        ctx->base.cap_cnt[bit] = (uint16_t) (ctx->base.cap_cnt[bit] + dir);
+        caps &= (uint8_t) (caps - 1);
+    }
+}
 
-    if (idx_free >= 0) {
-        REMOTE_MODS[idx_free].mac[1] = mac[1];
-        REMOTE_MODS[idx_free].mac[0] = mac[0];
-        REMOTE_MODS[idx_free].caps = caps;
-        REMOTE_MODS[idx_free].last_seen = 0;
+static uint32_t p_mod_hash_pos(HW_MAC_t mac) {
+    return hw_mac_hash(mac) & (AG_MOD_HASH_LEN - 1);
+}
+
+/**
+ * @return position of the MC in mod_hash or -1
+ */
+static int p_mod_hash_find(AG_CTX_t *ctx, HW_MAC_t mac) {
+    uint32_t pos = p_mod_hash_pos(mac);
+
+    while (ctx->base.mod_hash[pos] != P_MOD_HASH_EMPTY) {
+        if (ctx->remote_mods[ctx->base.mod_hash[pos]].mac == mac) {
+            return (int) pos;
+        }
+        pos = (pos + 1) & (AG_MOD_HASH_LEN - 1);
+    }
+    return -1;
+}
+
+/**
+ * @brief remove the entry at pos, move up the entries after it (no tombstones)
+ */
+static void p_mod_hash_remove(AG_CTX_t *ctx, uint32_t pos) {
+    uint32_t next = pos;
+
+    ctx->base.mod_hash[pos] = P_MOD_HASH_EMPTY;
+    while (1) {
+        next = (next + 1) & (AG_MOD_HASH_LEN - 1);
+        if (ctx->base.mod_hash[next] == P_MOD_HASH_EMPTY) {
+            break;
+        }
+
+        // an entry can move into the hole only if its home is not between the hole and itself
+        uint32_t home = p_mod_hash_pos(ctx->remote_mods[ctx->base.mod_hash[next]].mac);
+        int stay = (next > pos) ? ((home > pos) && (home <= next)) : ((home > pos) || (home <= next));
+        if (!stay) {
+            ctx->base.mod_hash[pos] = ctx->base.mod_hash[next];
+            ctx->base.mod_hash[next] = P_MOD_HASH_EMPTY;
+            pos = next;
+        }
+    }
+}
+
+/**
+ * @return index in remote_mods or -1 if the MC is not known
+ */
+int ag_find_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac) {
+    int pos = p_mod_hash_find(ctx, mac);
+
+    return (pos < 0) ? -1 : ctx->base.mod_hash[pos];
+}
+
+/**
+ * @brief add an MC or update it with the full status record it sent
+ */
+void ag_add_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac, const AG_MC_STATUS_t *sts) {
+    int idx = ag_find_remote_mod(ctx, mac);
+    if (idx >= 0) {
+        AG_RMT_MC_STATE_t *mod = &ctx->remote_mods[idx];
+        if ((mod->caps != sts->caps) || (mod->caps_hw != sts->caps_hw)
+                || (mod->groups != sts->groups) || (mod->tmc_prio != sts->tmc_prio)) {
+            p_cap_cnt_upd(ctx, (uint8_t) (mod->caps_hw | mod->caps), -1);
+            p_cap_cnt_upd(ctx, (uint8_t) (sts->caps_hw | sts->caps), 1);
+            if (mod->tmc_prio != sts->tmc_prio) {
+                ag_tmc_elect(ctx);
+            }
+            mod->caps = sts->caps;
+            mod->caps_hw = sts->caps_hw;
+            mod->groups = sts->groups;
+            mod->tmc_prio = sts->tmc_prio;
+            ag_upd_alarm(ctx);
+            ag_comm_hb_reset(ctx);
+        }
+        mod->last_err = sts->last_err;
+        mod->type = sts->type;
+        mod->gen = sts->gen;
+        // the expiry timer finds out about it when it comes up
+        mod->ts_seen = get_ts_ms();
+        return;
+    }
+
+    if (ctx->base.mod_free_cnt == 0) {
+        printf("CANNOT add MC - too many\n");
+        return;
+    }
+
+    ctx->base.mod_free_cnt --;
+    idx = ctx->base.mod_free[ctx->base.mod_free_cnt];
+    ctx->remote_mods[idx].mac = mac;
+    ctx->remote_mods[idx].caps = sts->caps;
+    ctx->remote_mods[idx].caps_hw = sts->caps_hw;
+    ctx->remote_mods[idx].groups = sts->groups;
+    ctx->remote_mods[idx].tmc_prio = sts->tmc_prio;
+    ctx->remote_mods[idx].last_err = sts->last_err;
+    ctx->remote_mods[idx].type = sts->type;
+    ctx->remote_mods[idx].gen = sts->gen;
+    ctx->remote_mods[idx].used = 1;
+    ctx->remote_mods[idx].ts_seen = get_ts_ms();
+    memset(&ctx->remote_mods[idx].link, 0, sizeof (AG_LINK_STATS_t));
+    ctx->remote_mods[idx].link.tx_ratio = 1000;
+    p_tw_add(ctx, idx, ctx->remote_mods[idx].ts_seen + AG_MC_MAX_AGE_MS);
+
+    uint32_t pos = p_mod_hash_pos(mac);
+    while (ctx->base.mod_hash[pos] != P_MOD_HASH_EMPTY) {
+        pos = (pos + 1) & (AG_MOD_HASH_LEN - 1);
+    }
+    ctx->base.mod_hash[pos] = (uint16_t) idx;
 #if defined(ESP_PLATFORM)
-        espnow_add_peer(REMOTE_MODS[idx_free].mac[1], REMOTE_MODS[idx_free].mac[0]);
+    espnow_add_peer(mac);
 #endif
-    } else {
-        printf("CANNOT add MC - too many\n");
+    p_cap_cnt_upd(ctx, (uint8_t) (sts->caps_hw | sts->caps), 1);
+    if (sts->tmc_prio != 0) {
+        ag_tmc_elect(ctx);
     }
+    ag_upd_alarm(ctx);
+    ag_comm_hb_reset(ctx);
 }
 
-void ag_upd_remote_mods(void) {
-    for (int i = 0 ; i < AG_MC_MAX_CNT; i ++) {
-        if (REMOTE_MODS[i].last_seen == -1) {
-            continue;
+static int p_grp_match(uint8_t caps, uint8_t groups, uint8_t grp_type, uint8_t grp_arg) {
+    switch (grp_type) {
+        case AG_GRP_ALL: {
+            return 1;
+        }
+        case AG_GRP_CAP: {
+            return ((caps & grp_arg) != 0);
         }
-        if (REMOTE_MODS[i].last_seen > AG_MC_MAX_AGE) {
+        case AG_GRP_ID: {
+            return ((grp_arg < AG_GRP_ID_CNT) && ((groups & (1U << grp_arg)) != 0));
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @return 1 if the local MC is a target of a group command
+ */
+int ag_grp_match(AG_CTX_t *ctx, uint8_t grp_type, uint8_t grp_arg) {
+    return p_grp_match((uint8_t) (ctx->mod_state.caps_hw_ext | ctx->mod_state.caps_sw), ctx->mod_state.groups,
+                       grp_type, grp_arg);
+}
+
+/**
+ * @return 1 if remote_mods[idx] advertised that it is a target of a group command
+ */
+int ag_grp_match_remote(AG_CTX_t *ctx, int idx, uint8_t grp_type, uint8_t grp_arg) {
+    if (ctx->remote_mods[idx].used == 0) {
+        return 0;
+    }
+    return p_grp_match((uint8_t) (ctx->remote_mods[idx].caps_hw | ctx->remote_mods[idx].caps),
+                       ctx->remote_mods[idx].groups, grp_type, grp_arg);
+}
+
+static void p_del_remote_mod(AG_CTX_t *ctx, int idx) {
+    int pos = p_mod_hash_find(ctx, ctx->remote_mods[idx].mac);
+    if (pos >= 0) {
+        p_mod_hash_remove(ctx, (uint32_t) pos);
+    }
+    ctx->base.mod_free[ctx->base.mod_free_cnt] = (uint16_t) idx;
+    ctx->base.mod_free_cnt ++;
+    p_tw_del(ctx, idx);
 #if defined(ESP_PLATFORM)
-            espnow_del_peer(REMOTE_MODS[i].mac[1], REMOTE_MODS[i].mac[0]);
+    espnow_del_peer(ctx->remote_mods[idx].mac);
 #endif
-            REMOTE_MODS[i].mac[1] = 0;
-            REMOTE_MODS[i].mac[0] = 0;
-            REMOTE_MODS[i].caps = 0;
-            REMOTE_MODS[i].last_err = AG_ERR_NONE;
-            REMOTE_MODS[i].last_seen = -1;
-        } else {
-            REMOTE_MODS[i].last_seen += 1;
-        }
+    p_cap_cnt_upd(ctx, (uint8_t) (ctx->remote_mods[idx].caps_hw | ctx->remote_mods[idx].caps), -1);
+    if (ctx->remote_mods[idx].tmc_prio != 0) {
+        ag_tmc_elect(ctx);
+    }
+    ctx->remote_mods[idx].mac = HW_MAC_NONE;
+    ctx->remote_mods[idx].caps = 0;
+    ctx->remote_mods[idx].caps_hw = 0;
+    ctx->remote_mods[idx].groups = 0;
+    ctx->remote_mods[idx].tmc_prio = 0;
+    ctx->remote_mods[idx].last_err = AG_ERR_NONE;
+    ctx->remote_mods[idx].used = 0;
+    ag_upd_alarm(ctx);
+    ag_comm_hb_reset(ctx);
+}
+
+/**
+ * @brief forget an MC that announced it is leaving
+ */
+void ag_del_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac) {
+    int idx = ag_find_remote_mod(ctx, mac);
+    if (idx >= 0) {
+        p_del_remote_mod(ctx, idx);
+    }
+}
+
+/**
+ * @return seconds since the last frame from remote_mods[idx], -1 if the entry is free
+ */
+int ag_remote_mod_age(AG_CTX_t *ctx, int idx) {
+    if (ctx->remote_mods[idx].used == 0) {
+        return -1;
     }
+    return (int) ((get_ts_ms() - ctx->remote_mods[idx].ts_seen) / 1000);
 }
 
-void ag_upd_alarm(void) {
-    int nm = 0;
-    for (int i = 0 ; i < AG_MC_MAX_CNT; i ++) {
-        if ((REMOTE_MODS[i].caps & AG_CAP_SW_TMC) != 0) {
-            nm += 1;
+/**
+ * @brief note that a frame was received from an MC
+ * @param rssi in dBm, 0 if not known
+ */
+void ag_seen_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac, int8_t rssi) {
+    int idx = ag_find_remote_mod(ctx, mac);
+    if (idx >= 0) {
+        AG_LINK_STATS_t *link = &ctx->remote_mods[idx].link;
+        link->rx_cnt ++;
+        if (rssi != 0) {
+            link->rssi_avg = (link->rssi == 0) ? rssi : (int8_t) (link->rssi_avg + ((rssi - link->rssi_avg) / 8));
+            link->rssi = rssi;
+        }
+
+        uint32_t ts_now = get_ts_ms();
+        if ((ctx->remote_mods[idx].tmc_prio != 0)
+                && ((ts_now - ctx->remote_mods[idx].ts_seen) >= AG_TMC_TIMEOUT_MS)) {
+            // a candidate that was passed over is back
+            ag_tmc_elect(ctx);
         }
+        ctx->remote_mods[idx].ts_seen = ts_now;
     }
-    if ((MOD_STATE.caps_sw & AG_CAP_SW_TMC) != 0) {
-        nm += 1;
+}
+
+/**
+ * @brief account the outcome of a unicast transmission to an MC
+ */
+void ag_link_tx(AG_CTX_t *ctx, HW_MAC_t mac, int ok) {
+    int idx = ag_find_remote_mod(ctx, mac);
+    if (idx < 0) {
+        return;
     }
-    if (nm > 1) {
-        MOD_STATE.last_err = AG_ERR_MULTI_MASTER;
+
+    AG_LINK_STATS_t *link = &ctx->remote_mods[idx].link;
+    int sample = (ok != 0) ? 1000 : 0;
+    link->tx_cnt ++;
+    link->tx_ratio = (uint16_t) (link->tx_ratio + ((sample - link->tx_ratio) / 16));
+    if (ok != 0) {
+        link->tx_ok ++;
+        link->loss_run = 0;
         return;
     }
-    MOD_STATE.last_err = AG_ERR_NONE;
+    if (link->loss_run < UINT8_MAX) {
+        link->loss_run ++;
+    }
+    if (link->loss_run > link->loss_run_max) {
+        link->loss_run_max = link->loss_run;
+    }
+    if (link->loss_run == AG_LINK_BURST_LEN) {
+        link->loss_bursts ++;
+    }
 }
 
-void ag_upd_hw(void) {
-    uint32_t led_code = 0;
+/**
+ * @brief account a command RTT sample of an MC, only unambiguous ones (Karn)
+ */
+void ag_link_rtt(AG_CTX_t *ctx, HW_MAC_t mac, uint32_t rtt_us) {
+    int idx = ag_find_remote_mod(ctx, mac);
+    if (idx < 0) {
+        return;
+    }
 
-    if (MOD_STATE.last_err != 0) {
-        led_code |= 0x00FF0000U;
+    AG_LINK_STATS_t *link = &ctx->remote_mods[idx].link;
+    if (link->rtt_avg == 0) {
+        link->rtt_avg = rtt_us;
     } else {
-        led_code &= ~0x00FF0000U;
+        link->rtt_avg = (uint32_t) ((int32_t) link->rtt_avg + (((int32_t) rtt_us - (int32_t) link->rtt_avg) / 8));
     }
+    link->rtt = rtt_us;
+}
 
-    if (cnt_id_led > 0) {
-        led_code |= 0x000000FFU;
-        cnt_id_led --;
+/**
+ * @brief drop the MCs not heard from in AG_MC_MAX_AGE_MS, called from task_rf
+ *
+ * Only the entries whose timer comes up are touched, the ones heard from
+ * since are put back in the wheel.
+ * @return time in ms until a timer comes up, UINT32_MAX if none
+ */
+uint32_t ag_upd_remote_mods(AG_CTX_t *ctx) {
+    uint32_t ts_now = get_ts_ms();
+
+    while (1) {
+        uint32_t next = p_tw_next(ctx);
+        if ((next == (ctx->base.tw.cur - 1)) || ((int32_t) (next - ts_now) > 0)) {
+            break;
+        }
+
+        ctx->base.tw.cur = next;
+        for (uint8_t level = (AG_TW_LEVELS - 1); level > 0; level--) {
+            if ((ctx->base.tw.cur & ((1UL << (AG_TW_BITS * level)) - 1)) == 0) {
+                p_tw_cascade(ctx, level);
+            }
+        }
+
+        uint32_t slot = p_tw_slot(0, ctx->base.tw.cur);
+        while (ctx->base.tw.head[0][slot] != P_TW_NONE) {
+            int idx = ctx->base.tw.head[0][slot];
+            p_tw_del(ctx, idx);
+            if ((ts_now - ctx->remote_mods[idx].ts_seen) >= AG_MC_MAX_AGE_MS) {
+                p_del_remote_mod(ctx, idx);
+            } else {
+                p_tw_add(ctx, idx, ctx->remote_mods[idx].ts_seen + AG_MC_MAX_AGE_MS);
+            }
+        }
+        ctx->base.tw.cur ++;
+    }
+    if ((int32_t) (ts_now - ctx->base.tw.cur) >= 0) {
+        ctx->base.tw.cur = ts_now + 1;
+    }
+
+    uint32_t next = p_tw_next(ctx);
+    return (next == (ctx->base.tw.cur - 1)) ? UINT32_MAX : (next - ts_now);
+}
+
+/**
+ * @brief run the master election again on the next ag_upd_tmc()
+ */
+void ag_tmc_elect(AG_CTX_t *ctx) {
+    if (ctx->base.tmc.dirty == 0) {
+        ctx->base.tmc.dirty = 1;
+        ctx->base.tmc.ts_dirty = get_ts_ms();
+    }
+}
+
+/**
+ * @brief set the master by hand, from any task
+ *
+ * @return 0 on success, -1 if the master is elected
+ */
+int ag_set_master(AG_CTX_t *ctx, int on) {
+    unsigned int prio = ctx->mod_state.tmc_prio;
+    if ((atomic_load(&ctx->base.set.pending) & AG_SET_PRIO) != 0) {
+        prio = atomic_load(&ctx->base.set.prio);
+    }
+    if (prio != 0) {
+        return -1;
+    }
+
+    atomic_store(&ctx->base.set.master, (on != 0) ? 1U : 0U);
+    atomic_fetch_or(&ctx->base.set.pending, AG_SET_MASTER);
+    ag_comm_wake(ctx);
+    return 0;
+}
+
+/**
+ * @brief change the master election priority, from any task
+ */
+void ag_set_tmc_prio(AG_CTX_t *ctx, uint8_t prio) {
+    unsigned int flags = AG_SET_PRIO;
+
+    atomic_store(&ctx->base.set.prio, prio);
+    if (prio == 0) {
+        // back to setting the master by hand
+        atomic_store(&ctx->base.set.master, 0U);
+        flags |= AG_SET_MASTER;
+    }
+    atomic_fetch_or(&ctx->base.set.pending, flags);
+    ag_comm_wake(ctx);
+}
+
+/**
+ * @brief join or leave a group, from any task
+ */
+void ag_set_group(AG_CTX_t *ctx, uint8_t grp_id, int on) {
+    unsigned int mask = 1U << grp_id;
+
+    if (on != 0) {
+        atomic_fetch_and(&ctx->base.set.grp_off, ~mask);
+        atomic_fetch_or(&ctx->base.set.grp_on, mask);
     } else {
-        led_code &= ~0x000000FFU;
+        atomic_fetch_and(&ctx->base.set.grp_on, ~mask);
+        atomic_fetch_or(&ctx->base.set.grp_off, mask);
+    }
+    atomic_fetch_or(&ctx->base.set.pending, AG_SET_GROUPS);
+    ag_comm_wake(ctx);
+}
+
+/**
+ * @brief apply the settings posted from the other tasks, called from task_rf
+ */
+void ag_upd_set(AG_CTX_t *ctx) {
+    unsigned int pending = atomic_exchange(&ctx->base.set.pending, 0U);
+
+    if ((pending & AG_SET_GROUPS) != 0) {
+        unsigned int on = atomic_exchange(&ctx->base.set.grp_on, 0U);
+        unsigned int off = atomic_exchange(&ctx->base.set.grp_off, 0U);
+        ctx->mod_state.groups = (uint8_t) ((ctx->mod_state.groups | on) & ~off);
     }
 
+    if ((pending & AG_SET_PRIO) != 0) {
+        ctx->mod_state.tmc_prio = (uint8_t) atomic_load(&ctx->base.set.prio);
+        ag_tmc_elect(ctx);
+    }
+    if (((pending & AG_SET_MASTER) != 0) && (ctx->mod_state.tmc_prio == 0)) {
+        if (atomic_load(&ctx->base.set.master) != 0) {
+            ctx->mod_state.caps_sw |= AG_CAP_SW_TMC;
+        } else {
+            ctx->mod_state.caps_sw &= (uint8_t) (~AG_CAP_SW_TMC);
+        }
+        ag_upd_alarm(ctx);
+    }
+}
+
+/**
+ * @return 1 if candidate a wins over candidate b
+ */
+static int p_tmc_better(uint8_t prio_a, HW_MAC_t mac_a, uint8_t prio_b, HW_MAC_t mac_b) {
+    if (prio_a != prio_b) {
+        return (prio_a > prio_b);
+    }
+    return (mac_a < mac_b);
+}
+
+/**
+ * @brief elect the master when the candidates change or one times out, called from task_rf
+ *
+ * A change is advertised by the next heartbeat, which comes within
+ * AG_HB_PERIOD_MIN_MS, so all the MCs agree after one heartbeat round.
+ * @return time in ms until a candidate times out, UINT32_MAX if none
+ */
+uint32_t ag_upd_tmc(AG_CTX_t *ctx) {
+    uint32_t ts_now = get_ts_ms();
+
+    if ((ts_now - ctx->base.tmc.ts_start) < AG_TMC_HOLDOFF_MS) {
+        return AG_TMC_HOLDOFF_MS - (ts_now - ctx->base.tmc.ts_start);
+    }
+    if ((ctx->base.tmc.dirty == 0) && (ctx->base.tmc.check == 0)) {
+        return UINT32_MAX;
+    }
+    if ((ctx->base.tmc.dirty == 0) && ((int32_t) (ctx->base.tmc.ts_check - ts_now) > 0)) {
+        return ctx->base.tmc.ts_check - ts_now;
+    }
+    if (ctx->base.tmc.dirty == 0) {
+        ctx->base.tmc.ts_dirty = ts_now;
+    }
+
+    HW_MAC_t best_mac = HW_MAC_NONE;
+    uint8_t best_prio = 0;
+    if (ctx->mod_state.tmc_prio != 0) {
+        best_mac = ctx->hw_id;
+        best_prio = ctx->mod_state.tmc_prio;
+    }
+    uint32_t wait = UINT32_MAX;
+    for (int i = 0; i < AG_MC_MAX_CNT; i++) {
+        if ((ctx->remote_mods[i].used == 0) || (ctx->remote_mods[i].tmc_prio == 0)) {
+            continue;
+        }
+        uint32_t age = ts_now - ctx->remote_mods[i].ts_seen;
+        if (age >= AG_TMC_TIMEOUT_MS) {
+            continue;
+        }
+        if ((AG_TMC_TIMEOUT_MS - age) < wait) {
+            wait = AG_TMC_TIMEOUT_MS - age;
+        }
+        if ((best_prio == 0)
+                || p_tmc_better(ctx->remote_mods[i].tmc_prio, ctx->remote_mods[i].mac, best_prio, best_mac)) {
+            best_mac = ctx->remote_mods[i].mac;
+            best_prio = ctx->remote_mods[i].tmc_prio;
+        }
+    }
+    ctx->base.tmc.check = (wait != UINT32_MAX);
+    ctx->base.tmc.ts_check = ts_now + wait;
+
+    if (best_mac != ctx->base.tmc.mac) {
+        // measure from the last frame of the old master if it went silent
+        uint32_t ts_lost = ctx->base.tmc.ts_dirty;
+        int idx = ag_find_remote_mod(ctx, ctx->base.tmc.mac);
+        if ((idx >= 0) && ((int32_t) (ctx->remote_mods[idx].ts_seen - ts_lost) < 0)) {
+            ts_lost = ctx->remote_mods[idx].ts_seen;
+        }
+        ctx->base.tmc.elect_last = ts_now - ts_lost;
+        if (ctx->base.tmc.elect_last > ctx->base.tmc.elect_max) {
+            ctx->base.tmc.elect_max = ctx->base.tmc.elect_last;
+        }
+        ctx->base.tmc.mac = best_mac;
+        ctx->base.tmc.cnt_change ++;
+        printf("TMC " HW_MAC_FMT " elected in %u ms\n", HW_MAC_ARG(best_mac),
+               (unsigned int) ctx->base.tmc.elect_last);
+    }
+    ctx->base.tmc.dirty = 0;
+
+    if (ctx->mod_state.tmc_prio != 0) {
+        uint8_t caps_sw = ctx->mod_state.caps_sw;
+        if (best_mac == ctx->hw_id) {
+            caps_sw |= AG_CAP_SW_TMC;
+        } else {
+            caps_sw &= (uint8_t) (~AG_CAP_SW_TMC);
+        }
+        if (caps_sw != ctx->mod_state.caps_sw) {
+            // the heartbeat picks up the change
+            ctx->mod_state.caps_sw = caps_sw;
+            ctx->base.tmc.cnt_flap ++;
+            ag_upd_alarm(ctx);
+        }
+    }
+    return wait;
+}
+
+void ag_get_tmc_stats(AG_CTX_t *ctx, AG_TMC_STATS_t *stats) {
+    stats->mac = ctx->base.tmc.mac;
+    stats->changes = ctx->base.tmc.cnt_change;
+    stats->flaps = ctx->base.tmc.cnt_flap;
+    stats->elect_last = ctx->base.tmc.elect_last;
+    stats->elect_max = ctx->base.tmc.elect_max;
+}
+
+/**
+ * @return number of MCs in the chain, including the local one, with the AG_CAP_* bit
+ */
+int ag_get_cap_cnt(AG_CTX_t *ctx, uint8_t cap) {
+    if (cap == 0) {
+        return 0;
+    }
+
+    int bit = __builtin_ctz(cap);
+    int cnt = ctx->base.cap_cnt[bit];
+    if (((ctx->mod_state.caps_hw_ext | ctx->mod_state.caps_sw) & (1U << bit)) != 0) {
+        cnt += 1;
+    }
+    return cnt;
+}
+
+static void p_upd_led(AG_CTX_t *ctx) {
+    uint32_t led_code = 0;
+
+    if (ctx->mod_state.last_err != 0) {
+        led_code |= 0x00FF0000U;
+    }
+    if (ctx->base.cnt_id_led > 0) {
+        led_code |= 0x000000FFU;
+    }
     gpio_RGB_send(led_code);
 }
 
-void ag_id_external(void) {
+/**
+ * @brief raise/clear the alarms, call when the MCs in the chain or their caps change
+ */
+void ag_upd_alarm(AG_CTX_t *ctx) {
+    uint8_t err = AG_ERR_NONE;
+
+    if (ag_get_cap_cnt(ctx, AG_CAP_SW_TMC) > 1) {
+        err = AG_ERR_MULTI_MASTER;
+    }
+    if (err != ctx->mod_state.last_err) {
+        ctx->mod_state.last_err = err;
+        p_upd_led(ctx);
+        // the heartbeat carries it too, but only at its next period
+        ag_alarm_raise(ctx, err);
+    }
+}
+
+void ag_upd_hw(AG_CTX_t *ctx) {
+    p_upd_led(ctx);
+    if (ctx->base.cnt_id_led > 0) {
+        ctx->base.cnt_id_led --;
+    }
+}
+
+void ag_id_external(AG_CTX_t *ctx) {
     printf("ID LED\n");
-    cnt_id_led = 5;
+    ctx->base.cnt_id_led = 5;
 }
 
-void ag_brd_pwr_off(void) {
+void ag_brd_pwr_off(AG_CTX_t *ctx) {
     printf("board POWER OFF\n");
 }
 
-void ag_brd_pwr_on(void) {
+void ag_brd_pwr_on(AG_CTX_t *ctx) {
     printf("board POWER ON\n");
 }
 
-float ag_get_I5_NOM(void) {
+float ag_get_I5_NOM(AG_CTX_t *ctx) {
 #if defined(__AVR__)
     return 0.0f;
 #elif defined(ESP_PLATFORM)
     return 0.0f;
 #elif defined(__linux__)
-    return getValue_random((MOD_STATE.i5_nom * 0.7f), 5);
+    return getValue_random((ctx->mod_state.i5_nom * 0.7f), 5);
 #endif
 }
 
-float ag_get_I3_NOM(void) {
+float ag_get_I3_NOM(AG_CTX_t *ctx) {
 #if defined(__AVR__)
     return 0.0f;
 #elif defined(ESP_PLATFORM)
     return 0.0f;
 #elif defined(__linux__)
-    return getValue_random((MOD_STATE.i3_nom * 0.5f), 5);
+    return getValue_random((ctx->mod_state.i3_nom * 0.5f), 5);
 #endif
 }
@@ -4,9 +4,15 @@
 #define AGATHIS_6PLS6RVRFVYEP7NX
 /** @file */
 
+#include <stdatomic.h>
 #include <stdint.h>
 
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#endif
+
 #include "defs.h"
+#include "../hw/misc.h"
 
 #define I2C_OFFSET  0x20
 
@@ -19,7 +25,8 @@ typedef struct {
     uint8_t caps_hw_int;    /**< HW capabilities that should NOT be advertised */
     uint8_t caps_sw;        /**< SW capabilities set by user */
     uint8_t last_err;
-    uint8_t tbd;
+    uint8_t groups;         /**< bitmap of the user-defined groups the MC is in */
+    uint8_t tmc_prio;       /**< master election priority, 0 = master set by hand */
     uint16_t type;
     char mfr_name[16];
     char mfr_pn[16];
@@ -31,43 +38,225 @@ typedef struct {
     uint32_t crc;
 } AG_MC_STATE_t;
 
-extern AG_MC_STATE_t MOD_STATE;
+#define AG_MC_STATE_VER 3
+
+/**
+ * @brief status record advertised by an MC, see AG_PKT_TYPE_STATUS
+ */
+typedef struct {
+    uint8_t gen;        /**< incremented on every change of the record */
+    uint8_t caps;       /**< SW capabilities */
+    uint8_t caps_hw;    /**< advertised HW capabilities */
+    uint8_t groups;
+    uint8_t tmc_prio;
+    uint8_t last_err;
+    uint16_t type;
+} AG_MC_STATUS_t;
+
+#define AG_LINK_BURST_LEN   3   /**< consecutive TX failures counted as a loss burst */
+
+/**
+ * @brief quality of the link to another MC, the averages are EWMA
+ */
+typedef struct {
+    uint32_t tx_cnt;        /**< unicast transmissions */
+    uint32_t tx_ok;         /**< unicast transmissions confirmed by the radio */
+    uint32_t rx_cnt;        /**< frames received */
+    uint16_t tx_ratio;      /**< average delivery ratio in per mille */
+    uint8_t loss_run;       /**< current consecutive TX failures */
+    uint8_t loss_run_max;   /**< worst consecutive TX failures */
+    uint32_t loss_bursts;   /**< runs of AG_LINK_BURST_LEN or more TX failures */
+    int8_t rssi;            /**< last RSSI in dBm, 0 if the radio does not report it */
+    int8_t rssi_avg;
+    uint32_t rtt;           /**< last command RTT in us, 0 until the first sample */
+    uint32_t rtt_avg;
+} AG_LINK_STATS_t;
 
 /**
  * @brief info about the other MCs (Management Controllers)
  */
 typedef struct {
-    uint32_t mac[2];
+    HW_MAC_t mac;
     uint8_t caps;
-    uint8_t last_err;
-    int8_t last_seen;
+    uint8_t caps_hw;    /**< advertised HW capabilities */
+    uint8_t groups;     /**< advertised user-defined groups */
+    uint8_t tmc_prio;   /**< advertised master election priority */
+    uint8_t last_err;   /**< advertised error */
+    uint8_t gen;        /**< generation of the status record */
+    uint16_t type;      /**< advertised module type */
+    uint8_t used;       /**< 0 if the entry is free */
+    uint32_t ts_seen;   /**< last frame received in ms */
+    AG_LINK_STATS_t link;
 } AG_RMT_MC_STATE_t;
 
-#define AG_MC_MAX_CNT 16 /** max number of MCs in the chain, including the local one */
-#define AG_MC_MAX_AGE 30
+#if defined(CONFIG_AG_MC_MAX_CNT)
+#define AG_MC_MAX_CNT CONFIG_AG_MC_MAX_CNT /**< max number of MCs in the chain, including the local one */
+#else
+#define AG_MC_MAX_CNT 16
+#endif
+#define AG_MC_MAX_AGE 30   /**< seconds without a frame before an MC is dropped */
+#define AG_MC_MAX_AGE_MS (AG_MC_MAX_AGE * 1000)
+
+#if defined(CONFIG_AG_TMC_TIMEOUT_MS)
+#define AG_TMC_TIMEOUT_MS CONFIG_AG_TMC_TIMEOUT_MS /**< silence after which a master candidate is passed over */
+#else
+#define AG_TMC_TIMEOUT_MS 3000
+#endif
+#define AG_TMC_HB_PERIOD_MS (AG_TMC_TIMEOUT_MS / 3)    /**< max heartbeat period of the master candidates */
+#define AG_TMC_HOLDOFF_MS 200   /**< no election after start until the join probes are answered */
+
+/**
+ * @brief master (TMC) election counters
+ */
+typedef struct {
+    HW_MAC_t mac;           /**< elected master, HW_MAC_NONE if none */
+    uint32_t changes;       /**< elected master changed */
+    uint32_t flaps;         /**< local MC became or stopped being the master */
+    uint32_t elect_last;    /**< last master loss to new master in ms */
+    uint32_t elect_max;     /**< worst master loss to new master in ms */
+} AG_TMC_STATS_t;
+
+/* open-addressed hash of the MACs of the remote MCs, at most half full */
+#if (AG_MC_MAX_CNT <= 16)
+#define AG_MOD_HASH_LEN 32
+#elif (AG_MC_MAX_CNT <= 32)
+#define AG_MOD_HASH_LEN 64
+#elif (AG_MC_MAX_CNT <= 64)
+#define AG_MOD_HASH_LEN 128
+#elif (AG_MC_MAX_CNT <= 128)
+#define AG_MOD_HASH_LEN 256
+#elif (AG_MC_MAX_CNT <= 256)
+#define AG_MOD_HASH_LEN 512
+#elif (AG_MC_MAX_CNT <= 512)
+#define AG_MOD_HASH_LEN 1024
+#elif (AG_MC_MAX_CNT <= 1024)
+#define AG_MOD_HASH_LEN 2048
+#else
+#error "AG_MC_MAX_CNT TOO BIG"
+#endif
+
+/*
+ * hierarchical timer wheel of the remote MC expiry, 1 ms resolution
+ *
+ * Level 0 has one slot per ms for the next 64 ms, level 1 one slot per 64 ms
+ * and level 2 one slot per 4.096 s. An entry is moved down a level when its
+ * slot comes up, and it is only touched again when it may expire.
+ */
+#define AG_TW_BITS      6
+#define AG_TW_SLOTS     (1 << AG_TW_BITS)
+#define AG_TW_LEVELS    3
+
+typedef struct {
+    uint16_t head[AG_TW_LEVELS][AG_TW_SLOTS];
+    uint64_t busy[AG_TW_LEVELS];        /**< bitmap of the slots that are not empty */
+    uint16_t next[AG_MC_MAX_CNT];
+    uint16_t prev[AG_MC_MAX_CNT];
+    uint32_t expire[AG_MC_MAX_CNT];     /**< in ms */
+    uint8_t level[AG_MC_MAX_CNT];       /**< AG_TW_LEVELS if not in the wheel */
+    uint32_t cur;                       /**< next ms to process */
+} AG_TIMER_WHEEL_t;
+
+/*
+ * master (TMC) election, only used by task_rf
+ *
+ * Every MC picks the same master from the advertised priorities: the highest
+ * priority wins, then the lowest MAC. The candidates heartbeat at least every
+ * AG_TMC_HB_PERIOD_MS and are passed over after AG_TMC_TIMEOUT_MS of silence.
+ */
+typedef struct {
+    HW_MAC_t mac;           /**< elected master, HW_MAC_NONE if none */
+    uint8_t dirty;          /**< candidates changed, elect again */
+    uint32_t ts_dirty;      /**< first change since the last election in ms */
+    uint32_t ts_start;
+    uint32_t ts_check;      /**< next candidate timeout in ms */
+    uint8_t check;          /**< ts_check is valid */
+    uint32_t cnt_change;
+    uint32_t cnt_flap;
+    uint32_t elect_last;
+    uint32_t elect_max;
+} AG_TMC_t;
+
+/*
+ * settings changed from the CLI, applied by task_rf on its next pass
+ */
+#define AG_SET_GROUPS   0x01    /**< join or leave groups */
+#define AG_SET_MASTER   0x02    /**< set or clear AG_CAP_SW_TMC */
+#define AG_SET_PRIO     0x04    /**< change the master election priority */
+
+typedef struct {
+    atomic_uint pending;    /**< AG_SET_*, set after the value */
+    atomic_uint master;
+    atomic_uint prio;
+    atomic_uint grp_on;     /**< groups to join */
+    atomic_uint grp_off;    /**< groups to leave */
+} AG_SET_t;
+
+/**
+ * @brief bookkeeping of the remote MCs
+ */
+typedef struct {
+    uint16_t mod_hash[AG_MOD_HASH_LEN];     /**< index of the remote MC or 0xFFFF */
+    uint16_t mod_free[AG_MC_MAX_CNT];       /**< stack of the free remote MC entries */
+    uint16_t mod_free_cnt;
+    AG_TIMER_WHEEL_t tw;
+    uint16_t cap_cnt[8];    /**< number of remote MCs advertising each AG_CAP_* bit (caps_hw | caps) */
+    AG_TMC_t tmc;
+    AG_SET_t set;
+    uint8_t cnt_id_led;
+} AG_BASE_STATE_t;
+
+void ag_init(AG_CTX_t *ctx);
+
+void ag_reset(AG_CTX_t *ctx);
+
+int ag_find_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac);
+
+void ag_add_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac, const AG_MC_STATUS_t *sts);
+
+int ag_grp_match(AG_CTX_t *ctx, uint8_t grp_type, uint8_t grp_arg);
+
+int ag_grp_match_remote(AG_CTX_t *ctx, int idx, uint8_t grp_type, uint8_t grp_arg);
+
+void ag_del_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac);
+
+int ag_remote_mod_age(AG_CTX_t *ctx, int idx);
+
+void ag_seen_remote_mod(AG_CTX_t *ctx, HW_MAC_t mac, int8_t rssi);
+
+void ag_link_tx(AG_CTX_t *ctx, HW_MAC_t mac, int ok);
+
+void ag_link_rtt(AG_CTX_t *ctx, HW_MAC_t mac, uint32_t rtt_us);
+
+uint32_t ag_upd_remote_mods(AG_CTX_t *ctx);
+
+void ag_tmc_elect(AG_CTX_t *ctx);
+
+uint32_t ag_upd_tmc(AG_CTX_t *ctx);
+
+void ag_get_tmc_stats(AG_CTX_t *ctx, AG_TMC_STATS_t *stats);
 
-extern AG_RMT_MC_STATE_t REMOTE_MODS[AG_MC_MAX_CNT];
+int ag_set_master(AG_CTX_t *ctx, int on);
 
-void ag_init(void);
+void ag_set_tmc_prio(AG_CTX_t *ctx, uint8_t prio);
 
-void ag_reset(void);
+void ag_set_group(AG_CTX_t *ctx, uint8_t grp_id, int on);
 
-void ag_add_remote_mod(const uint32_t *mac, uint8_t caps);
+void ag_upd_set(AG_CTX_t *ctx);
 
-void ag_upd_remote_mods(void);
+int ag_get_cap_cnt(AG_CTX_t *ctx, uint8_t cap);
 
-void ag_upd_alarm(void);
+void ag_upd_alarm(AG_CTX_t *ctx);
 
-void ag_upd_hw(void);
+void ag_upd_hw(AG_CTX_t *ctx);
 
-void ag_id_external(void);
+void ag_id_external(AG_CTX_t *ctx);
 
-void ag_brd_pwr_off(void);
+void ag_brd_pwr_off(AG_CTX_t *ctx);
 
-void ag_brd_pwr_on(void);
+void ag_brd_pwr_on(AG_CTX_t *ctx);
 
-float ag_get_I5_NOM(void);
+float ag_get_I5_NOM(AG_CTX_t *ctx);
 
-float ag_get_I3_NOM(void);
+float ag_get_I3_NOM(AG_CTX_t *ctx);
 
 #endif /* AGATHIS_6PLS6RVRFVYEP7NX */
@@ -2,6 +2,7 @@
 
 #include "comm.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,320 +17,1300 @@
 
 #include "../hw/platform_esp/espnow.h"
 #elif defined(__linux__)
-#include <dirent.h>
-#include <fcntl.h>
-#include <mqueue.h>
-#include <signal.h>
-#include <unistd.h>
+#include <pthread.h>
 
-#include "../sim/state.h"
+#include "../hw/platform_sim/simnet.h"
 #endif
 
+#include "alarm.h"
 #include "base.h"
+#include "ctx.h"
+#include "frag.h"
+#include "ping.h"
+#include "rcmd.h"
 #include "../hw/misc.h"
 
-static AG_FRAME_L0 p_tx_frame = {{0, 0}, {0, 0}, 0, AG_FRAME_LEN, NULL};
-static AG_FRAME_L0 p_rx_frame = {{0, 0}, {0, 0}, 0, AG_FRAME_LEN, NULL};
+#if defined(ESP_PLATFORM)
+#define P_TX_LOCK(ctx)      taskENTER_CRITICAL(&(ctx)->comm.tx_mux)
+#define P_TX_UNLOCK(ctx)    taskEXIT_CRITICAL(&(ctx)->comm.tx_mux)
+#elif defined(__linux__)
+#define P_TX_LOCK(ctx)      pthread_mutex_lock(&(ctx)->comm.tx_mux)
+#define P_TX_UNLOCK(ctx)    pthread_mutex_unlock(&(ctx)->comm.tx_mux)
+#endif
 
-int ag_comm_is_frame_master(AG_FRAME_L0 *frame) {
-    for (int i = 0; i < AG_MC_MAX_CNT; i++) {
-        if ((REMOTE_MODS[i].mac[1] == frame->src_mac[1])
-                && (REMOTE_MODS[i].mac[0] == frame->src_mac[0])) {
-            if ((REMOTE_MODS[i].caps & AG_CAP_SW_TMC) != 0) {
-                return 1;
-            }
-        }
+/**
+ * @brief copy a received frame into the RX ring, called by the producer only
+ *
+ * @return 0 if the frame was queued
+ */
+static int p_rx_enqueue(AG_CTX_t *ctx, HW_MAC_t dst_mac, HW_MAC_t src_mac,
+                        const uint8_t *data, int len, int8_t rssi) {
+    if ((len <= 0) || (len > AG_FRAME_MAX_LEN)) {
+        ctx->comm.rx_ring.cnt_drop ++;
+        return -1;
+    }
+
+    unsigned int head = atomic_load_explicit(&ctx->comm.rx_ring.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ctx->comm.rx_ring.tail, memory_order_acquire);
+    if ((head - tail) >= AG_RX_RING_LEN) {
+        ctx->comm.rx_ring.cnt_overflow ++;
+        return -1;
+    }
+
+    AG_FRAME_L0 *frame = &ctx->comm.rx_ring.frame[head & (AG_RX_RING_LEN - 1)];
+    frame->dst_mac = dst_mac;
+    frame->src_mac = src_mac;
+    frame->nb = (uint8_t) len;
+    frame->ts = get_ts_us();
+    frame->rssi = rssi;
+    memcpy(frame->data, data, (size_t) len * sizeof (uint8_t));
+    if (len < AG_FRAME_LEN) {
+        // short packets read as zero padded
+        memset(&frame->data[len], 0, (size_t) (AG_FRAME_LEN - len) * sizeof (uint8_t));
+    }
+    frame->flags = AG_FRAME_FLAG_VALID;
+
+    atomic_store_explicit(&ctx->comm.rx_ring.head, (head + 1), memory_order_release);
+    ctx->comm.rx_ring.cnt_rx ++;
+    if ((head + 1 - tail) > ctx->comm.rx_ring.hwm) {
+        ctx->comm.rx_ring.hwm = head + 1 - tail;
     }
     return 0;
 }
 
+#if defined(__linux__)
+/**
+ * @return 1 if the next p_rx_enqueue() would overflow, called by the producer only
+ */
+static int p_rx_full(AG_CTX_t *ctx) {
+    unsigned int head = atomic_load_explicit(&ctx->comm.rx_ring.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ctx->comm.rx_ring.tail, memory_order_acquire);
+
+    return ((head - tail) >= AG_RX_RING_LEN) ? 1 : 0;
+}
+#endif
+
+/**
+ * @return oldest frame in the RX ring or NULL if empty, called by the consumer only
+ */
+static AG_FRAME_L0 *p_rx_peek(AG_CTX_t *ctx) {
+    unsigned int tail = atomic_load_explicit(&ctx->comm.rx_ring.tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ctx->comm.rx_ring.head, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ctx->comm.rx_ring.frame[tail & (AG_RX_RING_LEN - 1)];
+}
+
+/**
+ * @brief release the frame returned by p_rx_peek(), called by the consumer only
+ */
+static void p_rx_pop(AG_CTX_t *ctx) {
+    unsigned int tail = atomic_load_explicit(&ctx->comm.rx_ring.tail, memory_order_relaxed);
+    atomic_store_explicit(&ctx->comm.rx_ring.tail, (tail + 1), memory_order_release);
+}
+
+int ag_comm_is_frame_master(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    int idx = ag_find_remote_mod(ctx, frame->src_mac);
+
+    return (idx >= 0) && ((ctx->remote_mods[idx].caps & AG_CAP_SW_TMC) != 0);
+}
+
 #if defined(ESP_PLATFORM)
+static AG_CTX_t *p_esp_ctx;     /**< the ESP-NOW callbacks have no argument, one MC per chip */
+
+static void p_tx_complete(AG_CTX_t *ctx, AG_TX_DESC_t *desc, AG_TX_STS_t sts);
+
 static void p_espnow_tx_cbk(const uint8_t *mac_addr,
                             esp_now_send_status_t status) {
-    //char *appName = pcTaskGetName(NULL);
-    //ESP_LOGI(appName, "TX to "MACSTR" status %d", MAC2STR(mac_addr), status);
+    AG_CTX_t *ctx = p_esp_ctx;
+    AG_TX_DESC_t *desc = NULL;
+
+    // ESP-NOW reports the sends in order, so this is the oldest in-flight frame
+    P_TX_LOCK(ctx);
+    if (ctx->comm.tx_pool.inflight_cnt > 0) {
+        desc = &ctx->comm.tx_pool.desc[ctx->comm.tx_pool.inflight[ctx->comm.tx_pool.inflight_head]];
+        ctx->comm.tx_pool.inflight_head = (uint8_t) ((ctx->comm.tx_pool.inflight_head + 1) % AG_TX_POOL_LEN);
+        ctx->comm.tx_pool.inflight_cnt --;
+    }
+    P_TX_UNLOCK(ctx);
+
+    if (desc != NULL) {
+        p_tx_complete(ctx, desc, (status == ESP_NOW_SEND_SUCCESS) ? AG_TX_STS_OK : AG_TX_STS_FAIL);
+        ag_comm_wake(ctx);
+    }
 }
 
 static void p_espnow_rx_cbk(const uint8_t *mac_addr, const uint8_t *data,
-                            int len) {
-    //char *appName = pcTaskGetName(NULL);
-    //ESP_LOGI(appName, "RX from "MACSTR" %d B", MAC2STR(mac_addr), len);
-    if (len > p_rx_frame.nb) {
-        printf("%s - frame TOO BIG\n", __func__);
-        return;
-    }
+                            int len, int8_t rssi) {
+    AG_CTX_t *ctx = p_esp_ctx;
+    HW_MAC_t dst_mac = HW_MAC_NONE;
+    HW_MAC_t src_mac = hw_mac_from_bytes(mac_addr);
 
-    memset(p_rx_frame.data, 0, p_rx_frame.nb * sizeof (uint8_t));
-    memcpy(p_rx_frame.data, data, len * sizeof (uint8_t));
-    p_rx_frame.src_mac[1] = (mac_addr[0] << 16) | (mac_addr[1] << 8) | mac_addr[2];
-    p_rx_frame.src_mac[0] = (mac_addr[3] << 16) | (mac_addr[4] << 8) | mac_addr[5];
-    p_rx_frame.flags |= AG_FRAME_FLAG_VALID;
+    if ((len > AG_PKT_UCAST_HDR_NB) && (data[0] == AG_PROTO_VER1) && (data[1] == AG_PKT_TYPE_UCAST)) {
+        // unicast to a peer without a radio slot, everybody gets it
+        dst_mac = hw_mac_from_bytes(&data[2]);
+        if (dst_mac != ctx->hw_id) {
+            return;
+        }
+        data += AG_PKT_UCAST_HDR_NB;
+        len -= AG_PKT_UCAST_HDR_NB;
+    }
+    if (p_rx_enqueue(ctx, dst_mac, src_mac, data, len, rssi) == 0) {
+        ag_comm_wake(ctx);
+    }
 }
 #elif defined(__linux__)
-static void p_mq_notify(void);
+static int p_sim_rx(void *arg, HW_MAC_t dst_mac, HW_MAC_t src_mac, const uint8_t *data, int len) {
+    return p_rx_enqueue((AG_CTX_t *) arg, dst_mac, src_mac, data, len, 0);
+}
 
-static void p_mq_rx(union sigval sv) {
-    mqd_t mq_des = *((mqd_t *) sv.sival_ptr);
-    struct mq_attr attr;
+static int p_sim_rx_full(void *arg) {
+    return p_rx_full((AG_CTX_t *) arg);
+}
 
-    /* Determine max. msg size; allocate buffer to receive msg */
-    if (mq_getattr(mq_des, &attr) == -1) {
-        perror("CANNOT get mq attr");
-        return;
+static void p_sim_rx_wake(void *arg) {
+    ag_comm_wake((AG_CTX_t *) arg);
+}
+#endif
+
+/**
+ * @brief execute a command received from the master
+ *
+ * @return AG_MC_CMD_STATUS_t
+ */
+static uint8_t p_cmd_exec(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    switch (frame->data[2]) {
+        case AG_CMD_ID: {
+            ag_id_external(ctx);
+            break;
+        }
+        case AG_CMD_RESET: {
+            // done by p_rx_cmd() once the ACK is out
+            break;
+        }
+        case AG_CMD_POWER_OFF: {
+            ag_brd_pwr_off(ctx);
+            uint32_t lat = get_ts_us() - frame->ts;
+            ctx->comm.lat_pwr_off.cnt ++;
+            ctx->comm.lat_pwr_off.last = lat;
+            ctx->comm.lat_pwr_off.sum += lat;
+            if (lat > ctx->comm.lat_pwr_off.max) {
+                ctx->comm.lat_pwr_off.max = lat;
+            }
+            break;
+        }
+        case AG_CMD_POWER_ON: {
+            ag_brd_pwr_on(ctx);
+            break;
+        }
+        default: {
+            return MC_CMD_FAIL;
+        }
     }
+    return MC_CMD_OK;
+}
 
-    uint8_t *buff;
+/**
+ * @brief move the next heartbeat to a random time within max_ms
+ */
+static void p_hb_soon(AG_CTX_t *ctx, uint32_t max_ms) {
+    uint32_t ts_next = get_ts_ms() + (get_rand_u32() % max_ms);
 
-    buff = (uint8_t *) malloc((size_t) attr.mq_msgsize);
-    if (buff == NULL) {
-        printf("CANNOT allocate RX buffer\n");
-        return;
+    if ((int32_t) (ts_next - ctx->comm.hb.ts_next) < 0) {
+        ctx->comm.hb.ts_next = ts_next;
     }
+}
 
-    ssize_t nb_rx = mq_receive(mq_des, (char *) buff, (size_t) attr.mq_msgsize,
-                               NULL);
-    if (nb_rx == -1) {
-        perror("RX failure");
-        free(buff);
-        return;
-    }
-    //printf("DBG RX@%d %zd bytes\n", SIM_STATE.id, nb_rx);
-    //printf("DBG RX@%d dst: %02x:%02x:%02x:%02x:%02x:%02x\n", SIM_STATE.id, buff[5], buff[4], buff[3], buff[2], buff[1], buff[0]);
-    //printf("DBG RX@%d src: %02x:%02x:%02x:%02x:%02x:%02x\n", SIM_STATE.id, buff[11], buff[10], buff[9], buff[8], buff[7], buff[6]);
-    if ((nb_rx - 12) != AG_FRAME_LEN) {
-        printf("INCORRECT number of bytes RX\n");
-        free(buff);
-        p_mq_notify();
+static void p_status_decode(const AG_FRAME_L0 *frame, AG_MC_STATUS_t *sts) {
+    sts->groups = frame->data[2];
+    sts->caps_hw = frame->data[3];
+    sts->caps = frame->data[4];
+    sts->tmc_prio = frame->data[5];
+    sts->gen = frame->data[6];
+    sts->last_err = frame->data[7];
+    sts->type = (uint16_t) (frame->data[8] | (frame->data[9] << 8));
+}
+
+/**
+ * @brief ask an MC for its full status
+ */
+static void p_sync_tx(AG_CTX_t *ctx, HW_MAC_t mac) {
+    AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_BG);
+    if (frame == NULL) {
+        // asked again on its next keepalive
         return;
     }
 
-    p_rx_frame.dst_mac[1] = ((uint32_t) buff[5] << 16) | ((uint32_t) buff[4] << 8) |
-                            buff[3];
-    p_rx_frame.dst_mac[0] = ((uint32_t) buff[2] << 16) | ((uint32_t) buff[1] << 8) |
-                            buff[0];
-    p_rx_frame.src_mac[1] = ((uint32_t) buff[11] << 16) | ((
-                                uint32_t) buff[10] << 8) | buff[9];
-    p_rx_frame.src_mac[0] = ((uint32_t) buff[8] << 16) | ((uint32_t) buff[7] << 8) |
-                            buff[6];
+    frame->dst_mac = mac;
+    frame->data[0] = AG_PROTO_VER1;
+    frame->data[1] = AG_PKT_TYPE_SYNC;
+    frame->nb = AG_PKT_SYNC_NB;
+    ag_comm_tx(ctx, frame);
+    ctx->comm.hb.cnt_sync_tx ++;
+}
 
-    memset(p_rx_frame.data, 0, p_rx_frame.nb * sizeof (uint8_t));
-    memcpy(p_rx_frame.data, &buff[12],
-           (unsigned long) (nb_rx - 12) * sizeof (uint8_t));
-//    for (int i = 0; i < p_rx_frame.nb; i++) {
-//        p_rx_frame.data[i] = buff[i + 12];
-//    }
-    p_rx_frame.flags |= AG_FRAME_FLAG_VALID;
+static void p_rx_cmd(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    uint8_t res = MC_CMD_FAIL;
+    int reset = 0;
 
-    free(buff);
-    p_mq_notify();
+    if (ag_rcmd_rx_dup(ctx, frame, &res) == 0) {
+        if (ag_comm_is_frame_master(ctx, frame)) {
+            res = p_cmd_exec(ctx, frame);
+            reset = (frame->data[2] == AG_CMD_RESET);
+        }
+    }
+    int hndl = ag_rcmd_tx_ack(ctx, frame, res, reset);
+    if (reset != 0) {
+        // the master forgets us on the leave, the ACK has to be on the air before
+        ag_comm_tx_flush(ctx, hndl, AG_TX_FLUSH_MS);
+        ag_reset(ctx);
+    }
 }
 
-static void p_mq_notify(void) {
-    struct sigevent sev;
+static void p_rx_packet(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    if (frame->data[0] != AG_PROTO_VER1) {
+        return;
+    }
 
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = p_mq_rx;
-    sev.sigev_notify_attributes = NULL;
-    sev.sigev_value.sival_ptr = &(SIM_STATE.msg_queue);
-    if (mq_notify(SIM_STATE.msg_queue, &sev) == -1) {
-        perror("mq_notify");
-        exit(EXIT_FAILURE);
+    switch (frame->data[1]) {
+        case AG_PKT_TYPE_STATUS: {
+            AG_MC_STATUS_t sts;
+            p_status_decode(frame, &sts);
+            ag_add_remote_mod(ctx, frame->src_mac, &sts);
+            break;
+        }
+        case AG_PKT_TYPE_ALIVE: {
+            int idx = ag_find_remote_mod(ctx, frame->src_mac);
+            if ((idx < 0) || (ctx->remote_mods[idx].gen != frame->data[2])) {
+                p_sync_tx(ctx, frame->src_mac);
+            }
+            break;
+        }
+        case AG_PKT_TYPE_SYNC: {
+            // one full status answers all the MCs that asked
+            ctx->comm.hb.full = 1;
+            p_hb_soon(ctx, AG_JOIN_REPLY_MS);
+            ctx->comm.hb.cnt_sync_rx ++;
+            break;
+        }
+        case AG_PKT_TYPE_JOIN: {
+            // restarted, forget the commands it sent before
+            ag_rcmd_rx_forget(ctx, frame->src_mac);
+            AG_MC_STATUS_t sts;
+            p_status_decode(frame, &sts);
+            ag_add_remote_mod(ctx, frame->src_mac, &sts);
+            ctx->comm.hb.full = 1;
+            p_hb_soon(ctx, AG_JOIN_REPLY_MS);
+            ctx->comm.hb.cnt_join ++;
+            break;
+        }
+        case AG_PKT_TYPE_LEAVE: {
+            ag_rcmd_rx_leave(ctx, frame->src_mac);
+            ag_del_remote_mod(ctx, frame->src_mac);
+            ctx->comm.hb.cnt_leave ++;
+            break;
+        }
+        case AG_PKT_TYPE_CMD: {
+            p_rx_cmd(ctx, frame);
+            break;
+        }
+        case AG_PKT_TYPE_GCMD: {
+            // broadcast, only the MCs in the group execute and ACK it
+            if ((frame->nb >= AG_PKT_GCMD_NB) && ag_grp_match(ctx, frame->data[5], frame->data[6])) {
+                p_rx_cmd(ctx, frame);
+            }
+            break;
+        }
+        case AG_PKT_TYPE_ACK: {
+            ag_rcmd_rx_ack(ctx, frame);
+            break;
+        }
+        case AG_PKT_TYPE_FRAG: {
+            ag_frag_rx(ctx, frame);
+            break;
+        }
+        case AG_PKT_TYPE_FRAG_ACK: {
+            ag_frag_rx_ack(ctx, frame);
+            break;
+        }
+        case AG_PKT_TYPE_ALARM: {
+            ag_alarm_rx(ctx, frame);
+            break;
+        }
+        case AG_PKT_TYPE_ECHO: {
+            ag_ping_rx(ctx, frame);
+            break;
+        }
+        case AG_PKT_TYPE_ECHO_REPLY: {
+            ag_ping_rx_reply(ctx, frame);
+            break;
+        }
+        default: {
+            break;
+        }
     }
 }
-#endif
 
-static void ag_comm_rx_process(AG_FRAME_L0 *frame) {
-//    printf("DBG %s: %d B from %06x:%06x\n", __func__, frame->nb,
-//           (unsigned int) frame->src_mac[1], (unsigned int) frame->src_mac[0]);
-    if (frame->data[1] == AG_PKT_TYPE_STATUS) {
-        ag_add_remote_mod(frame->src_mac, frame->data[4]);
-    }
-
-    if (ag_comm_is_frame_master(frame)) {
-        //printf("DBG RX@%d msg from master\n", SIM_STATE.id);
-        if ((frame->data[0] == AG_PROTO_VER1) && (frame->data[1] == AG_PKT_TYPE_CMD)) {
-            //printf("DBG RX@%d cmd from master %d\n", SIM_STATE.id, frame->data[2]);
-            switch (frame->data[2]) {
-                case AG_CMD_ID: {
-                    ag_id_external();
-                    break;
-                }
-                case AG_CMD_RESET: {
-                    ag_reset();
-                    break;
-                }
-                case AG_CMD_POWER_OFF: {
-                    ag_brd_pwr_off();
-                    break;
-                }
-                case AG_CMD_POWER_ON: {
-                    ag_brd_pwr_on();
-                    break;
-                }
-                default: {
-                    break;
-                }
-            }
+/**
+ * @brief split an aggregated frame into packets
+ */
+static void p_rx_aggr(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    uint8_t buff[AG_FRAME_LEN];
+    AG_FRAME_L0 pkt = *frame;
+    int pos = AG_PKT_AGGR_HDR_NB;
+
+    pkt.data = buff;
+    for (int i = 0; i < frame->data[2]; i++) {
+        if (pos >= frame->nb) {
+            break;
+        }
+        int len = frame->data[pos];
+        if ((len < 2) || (len > AG_FRAME_LEN) || ((pos + 1 + len) > frame->nb)) {
+            ctx->comm.rx_ring.cnt_drop ++;
+            break;
+        }
+
+        memset(buff, 0, AG_FRAME_LEN * sizeof (uint8_t));
+        memcpy(buff, &frame->data[pos + 1], (size_t) len * sizeof (uint8_t));
+        pkt.nb = (uint8_t) len;
+        if (buff[1] != AG_PKT_TYPE_AGGR) {
+            p_rx_packet(ctx, &pkt);
         }
+        pos += 1 + len;
+    }
+}
+
+static void ag_comm_rx_process(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    ag_seen_remote_mod(ctx, frame->src_mac, frame->rssi);
+    if ((frame->data[0] == AG_PROTO_VER1) && (frame->data[1] == AG_PKT_TYPE_AGGR)) {
+        p_rx_aggr(ctx, frame);
+    } else {
+        p_rx_packet(ctx, frame);
     }
     frame->flags &= (uint8_t) ~AG_FRAME_FLAG_VALID;
 }
 
-int ag_comm_tx(AG_FRAME_L0 *frame) {
-    if ((frame->flags & AG_FRAME_FLAG_VALID) == 0) {
-        //printf("%s - INVALID frame\n", __func__);
+/**
+ * @brief put the frame on the air
+ *
+ * @return 0 if the frame was accepted by the radio
+ */
+static int p_tx_raw(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    int ret = 0;
+
+    if (frame->nb > AG_FRAME_MAX_LEN) {
         return -1;
     }
 
 #if defined(ESP_PLATFORM)
-    if (frame->nb > ESP_NOW_MAX_DATA_LEN) {
-        //printf("%s - frame TOO BIG\n", __func__);
+    if (espnow_use_peer(frame->dst_mac) == ESP_OK) {
+        if (espnow_tx(frame->dst_mac, frame->data, frame->nb) != ESP_OK) {
+            ret = -1;
+        }
+    } else {
+        // no radio slot, broadcast with the destination in the frame
+        uint8_t buff[AG_FRAME_AIR_LEN];
+
+        buff[0] = AG_PROTO_VER1;
+        buff[1] = AG_PKT_TYPE_UCAST;
+        hw_mac_to_bytes(frame->dst_mac, &buff[2]);
+        memcpy(&buff[AG_PKT_UCAST_HDR_NB], frame->data, frame->nb);
+        if (espnow_tx(HW_MAC_BCAST, buff, (size_t) (AG_PKT_UCAST_HDR_NB + frame->nb)) != ESP_OK) {
+            ret = -1;
+        }
+    }
+#elif defined(__linux__)
+    if (simnet_tx(ctx->comm.sim, frame->dst_mac, frame->src_mac, frame->data, frame->nb) != 0) {
+        ret = -1;
+    }
+#endif
+    return ret;
+}
+
+/**
+ * @return descriptor of a frame returned by ag_comm_get_tx_frame() or NULL
+ */
+static AG_TX_DESC_t *p_tx_desc(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    for (int i = 0; i < AG_TX_POOL_LEN; i++) {
+        if (&ctx->comm.tx_pool.desc[i].frame == frame) {
+            return &ctx->comm.tx_pool.desc[i];
+        }
+    }
+    return NULL;
+}
+
+static void p_tx_free(AG_CTX_t *ctx, AG_TX_DESC_t *desc) {
+    desc->state = AG_TX_DESC_FREE;
+    desc->frame.flags &= (uint8_t) ~AG_FRAME_FLAG_VALID;
+    desc->gen ++;
+    ctx->comm.tx_pool.used --;
+}
+
+/**
+ * @brief record the TX status, free the descriptors nobody waits for
+ */
+static void p_tx_complete(AG_CTX_t *ctx, AG_TX_DESC_t *desc, AG_TX_STS_t sts) {
+    uint32_t wake = 0;
+
+    P_TX_LOCK(ctx);
+    if ((desc->frame.dst_mac != HW_MAC_BCAST) && (ctx->comm.tx_pool.report_cnt < AG_TX_POOL_LEN)) {
+        uint8_t i = (uint8_t) ((ctx->comm.tx_pool.report_head + ctx->comm.tx_pool.report_cnt) % AG_TX_POOL_LEN);
+        ctx->comm.tx_pool.report_mac[i] = desc->frame.dst_mac;
+        ctx->comm.tx_pool.report_ok[i] = (sts == AG_TX_STS_OK);
+        ctx->comm.tx_pool.report_cnt ++;
+    }
+    // all the frames aggregated in one transmission share the status
+    while (desc != NULL) {
+        AG_TX_DESC_t *next = (desc->next == AG_TX_DESC_NONE) ? NULL : &ctx->comm.tx_pool.desc[desc->next];
+        if (sts == AG_TX_STS_OK) {
+            ctx->comm.tx_pool.cnt_ok ++;
+        } else {
+            ctx->comm.tx_pool.cnt_fail ++;
+        }
+        desc->sts = (uint8_t) sts;
+        desc->next = AG_TX_DESC_NONE;
+        if (desc->auto_free != 0) {
+            p_tx_free(ctx, desc);
+        } else {
+            desc->state = AG_TX_DESC_DONE;
+            wake |= 1UL << (desc - ctx->comm.tx_pool.desc);
+        }
+        desc = next;
+    }
+    P_TX_UNLOCK(ctx);
+
+    for (int i = 0; wake != 0; i++, wake >>= 1) {
+        if ((wake & 1) != 0) {
+            ag_waiter_wake(&ctx->comm.tx_pool.desc[i].waiter);
+        }
+    }
+}
+
+/**
+ * @brief queue the frame for task_rf
+ *
+ * @return handle for ag_comm_tx_wait() or -1
+ */
+static int p_tx_queue(AG_CTX_t *ctx, AG_FRAME_L0 *frame, uint8_t auto_free) {
+    AG_TX_DESC_t *desc = p_tx_desc(ctx, frame);
+    int hndl = -1;
+
+    if (desc == NULL) {
+        printf("%s - UNKNOWN frame\n", __func__);
         return -1;
     }
 
-    uint8_t dst_mac[6] = {(uint8_t) (frame->dst_mac[1] >> 16), (uint8_t) (frame->dst_mac[1] >> 8), (uint8_t) (frame->dst_mac[1]),
-                          (uint8_t) (frame->dst_mac[0] >> 16), (uint8_t) (frame->dst_mac[0] >> 8), (uint8_t) (frame->dst_mac[0])
-                         };
-    espnow_tx(dst_mac, frame->data, frame->nb);
-#elif defined(__linux__)
-    char mq_name[SIM_PATH_LEN] = "";
-    char dst_name[SIM_PATH_LEN] = "";
-    char *send_data = (char *) malloc((AG_FRAME_LEN + 12) * sizeof(char));
+    P_TX_LOCK(ctx);
+    if ((desc->state == AG_TX_DESC_ALLOC) && ((frame->flags & AG_FRAME_FLAG_VALID) != 0)) {
+        int idx = (int) (desc - ctx->comm.tx_pool.desc);
+        if (frame->prio >= AG_TX_PRIO_CNT) {
+            frame->prio = AG_TX_PRIO_BG;
+        }
+        AG_TX_FIFO_t *fifo = &ctx->comm.tx_pool.queue[frame->prio];
+        desc->state = AG_TX_DESC_QUEUED;
+        desc->sts = AG_TX_STS_PENDING;
+        desc->auto_free = auto_free;
+        desc->next = AG_TX_DESC_NONE;
+        frame->ts = get_ts_us();
+        fifo->idx[(fifo->head + fifo->cnt) % AG_TX_POOL_LEN] = (uint8_t) idx;
+        fifo->cnt ++;
+        if (fifo->cnt > fifo->cnt_max) {
+            fifo->cnt_max = fifo->cnt;
+        }
+        ctx->comm.tx_pool.cnt_tx ++;
+        hndl = (desc->gen << 8) | idx;
+    }
+    P_TX_UNLOCK(ctx);
 
-    if (send_data == NULL) {
-        printf("%s - CANNOT malloc\n", __func__);
-        exit(EXIT_FAILURE);
+    if (hndl >= 0) {
+        ag_comm_wake(ctx);
     }
+    return hndl;
+}
+
+/**
+ * @brief submit a frame without waiting, the frame is released after TX
+ *
+ * @return 0 if queued
+ */
+int ag_comm_tx(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    return (p_tx_queue(ctx, frame, 1) >= 0) ? 0 : -1;
+}
+
+/**
+ * @brief submit a frame and keep track of its TX status
+ *
+ * @return handle that MUST be passed to ag_comm_tx_wait() or ag_comm_tx_flush(), or -1
+ */
+int ag_comm_tx_submit(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    return p_tx_queue(ctx, frame, 0);
+}
 
-    snprintf(mq_name, SIM_PATH_LEN, "%s%03d", SIM_MQ_PREFIX, SIM_STATE.id);
+/**
+ * @return number of TX descriptors kept back from the frames of class prio
+ */
+static int p_tx_reserve(uint8_t prio) {
+    int cnt = 0;
 
-    DIR *d = opendir("/dev/mqueue");
-    if (d == NULL) {
-        printf("%s\n", "CANNOT open folder");
-        exit(EXIT_FAILURE);
+    if (prio > AG_TX_PRIO_SAFETY) {
+        cnt += AG_TX_RESERVE_SAFETY;
+    }
+    if (prio > AG_TX_PRIO_CMD) {
+        cnt += AG_TX_RESERVE_CMD;
+    }
+    if (prio > AG_TX_PRIO_BG) {
+        cnt += AG_TX_RESERVE_BG;
     }
+    return cnt;
+}
 
-    struct dirent *dir;
-    while ((dir = readdir(d)) != NULL) {
-        size_t tmp_len = strlen(SIM_MQ_PREFIX);
-        if (strncmp(SIM_MQ_PREFIX, dir->d_name, tmp_len) != 0) {
-            continue;
+/**
+ * @return number of TX descriptors a frame of class prio can still get
+ */
+int ag_comm_tx_free_cnt(AG_CTX_t *ctx, uint8_t prio) {
+    P_TX_LOCK(ctx);
+    int cnt = AG_TX_POOL_LEN - ctx->comm.tx_pool.used - p_tx_reserve(prio);
+    P_TX_UNLOCK(ctx);
+    return (cnt > 0) ? cnt : 0;
+}
+
+/**
+ * @brief wait for the TX status of a frame submitted with ag_comm_tx_submit()
+ *
+ * Do not call from task_rf, it is the one doing the transmission.
+ * The handle is released unless AG_TX_STS_TIMEOUT is returned.
+ */
+AG_TX_STS_t ag_comm_tx_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms) {
+    if ((hndl < 0) || ((hndl & 0xFF) >= AG_TX_POOL_LEN)) {
+        return AG_TX_STS_FAIL;
+    }
+
+    AG_TX_DESC_t *desc = &ctx->comm.tx_pool.desc[hndl & 0xFF];
+    AG_TX_STS_t sts = AG_TX_STS_PENDING;
+    uint32_t ts_start = get_ts_ms();
+
+    P_TX_LOCK(ctx);
+    while (sts == AG_TX_STS_PENDING) {
+        uint32_t elapsed = get_ts_ms() - ts_start;
+
+        if ((desc->gen != (uint8_t) (hndl >> 8)) || (desc->auto_free != 0)) {
+            sts = AG_TX_STS_FAIL;
+        } else if (desc->state == AG_TX_DESC_DONE) {
+            sts = (AG_TX_STS_t) desc->sts;
+            p_tx_free(ctx, desc);
+        } else if (elapsed >= timeout_ms) {
+            // nobody waits for it anymore
+            desc->auto_free = 1;
+            sts = AG_TX_STS_TIMEOUT;
+        } else {
+            // woken up by p_tx_complete()
+            ag_waiter_wait(&desc->waiter, &ctx->comm.tx_mux, timeout_ms - elapsed);
         }
-        if (strncmp(mq_name, dir->d_name, SIM_PATH_LEN) == 0) {
-            continue;
+    }
+    P_TX_UNLOCK(ctx);
+    return sts;
+}
+
+/**
+ * @return 1 if the TX status of hndl is available or the handle is not valid
+ */
+static int p_tx_done(AG_CTX_t *ctx, int hndl) {
+    if ((hndl < 0) || ((hndl & 0xFF) >= AG_TX_POOL_LEN)) {
+        return 1;
+    }
+
+    AG_TX_DESC_t *desc = &ctx->comm.tx_pool.desc[hndl & 0xFF];
+    P_TX_LOCK(ctx);
+    int done = (desc->gen != (uint8_t) (hndl >> 8)) || (desc->auto_free != 0) || (desc->state == AG_TX_DESC_DONE);
+    P_TX_UNLOCK(ctx);
+    return done;
+}
+
+/**
+ * @brief transmit until a frame submitted with ag_comm_tx_submit() is out, from task_rf only
+ *
+ * Same as ag_comm_tx_wait() for task_rf, which has to do the transmission itself.
+ */
+AG_TX_STS_t ag_comm_tx_flush(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms) {
+    uint32_t ts_start = get_ts_ms();
+
+    while (1) {
+        uint32_t wait_ms = ag_comm_tx_main(ctx);
+        uint32_t elapsed = get_ts_ms() - ts_start;
+        if (p_tx_done(ctx, hndl) || (elapsed >= timeout_ms)) {
+            break;
+        }
+        // woken up by the TX callback
+        ag_comm_wait(ctx, (wait_ms < (timeout_ms - elapsed)) ? wait_ms : (timeout_ms - elapsed));
+    }
+    // the wake ups taken here may have been for RX
+    ag_comm_wake(ctx);
+    return ag_comm_tx_wait(ctx, hndl, 0);
+}
+
+static int p_tx_same_dst(const AG_FRAME_L0 *f1, const AG_FRAME_L0 *f2) {
+    return (f1->dst_mac == f2->dst_mac);
+}
+
+/**
+ * @brief remove the entry at position pos (counted from head) from the FIFO
+ * @return descriptor index
+ */
+static uint8_t p_tx_fifo_remove(AG_CTX_t *ctx, AG_TX_FIFO_t *fifo, uint8_t pos) {
+    uint8_t idx = fifo->idx[(fifo->head + pos) % AG_TX_POOL_LEN];
+
+    for (uint8_t i = pos; (i + 1) < fifo->cnt; i++) {
+        fifo->idx[(fifo->head + i) % AG_TX_POOL_LEN] = fifo->idx[(fifo->head + i + 1) % AG_TX_POOL_LEN];
+    }
+    fifo->cnt --;
+
+    uint32_t delay = get_ts_us() - ctx->comm.tx_pool.desc[idx].frame.ts;
+    if (delay > fifo->delay_max) {
+        fifo->delay_max = delay;
+    }
+    return idx;
+}
+
+/**
+ * @return number of queued frames with the same destination as frame, frame included
+ */
+static int p_tx_cnt_dst(AG_CTX_t *ctx, const AG_FRAME_L0 *frame) {
+    int cnt = 0;
+
+    for (int prio = 0; prio < AG_TX_PRIO_CNT; prio++) {
+        AG_TX_FIFO_t *fifo = &ctx->comm.tx_pool.queue[prio];
+        for (uint8_t i = 0; i < fifo->cnt; i++) {
+            if (p_tx_same_dst(&ctx->comm.tx_pool.desc[fifo->idx[(fifo->head + i) % AG_TX_POOL_LEN]].frame, frame)) {
+                cnt ++;
+            }
         }
+    }
+    return cnt;
+}
 
-        dst_name[0] = '/';
-        dst_name[1] = '\0';
-        strcat(dst_name, dir->d_name);
-        mqd_t queue = mq_open(dst_name, O_WRONLY);
-        if (queue == -1) {
-            perror("CANNOT create mq");
+/**
+ * @brief pick the next frame, the highest class first, background frames within the rate cap
+ *
+ * Must be called with the TX lock held.
+ * @param wait_ms set to the time until a background frame can go if it is held back
+ */
+static AG_TX_DESC_t *p_tx_sched(AG_CTX_t *ctx, uint32_t *wait_ms) {
+    for (int prio = 0; prio < AG_TX_PRIO_CNT; prio++) {
+        AG_TX_FIFO_t *fifo = &ctx->comm.tx_pool.queue[prio];
+        if (fifo->cnt == 0) {
             continue;
         }
 
-        //printf("DBG TX@%d to %s\n", SIM_STATE.id, dst_name);
-        send_data[0] = (char) (frame->dst_mac[0] & 0xFF);
-        send_data[1] = (char) (frame->dst_mac[0] >> 8);
-        send_data[2] = (char) (frame->dst_mac[0] >> 16);
-        send_data[3] = (char) (frame->dst_mac[1] & 0xFF);
-        send_data[4] = (char) (frame->dst_mac[1] >> 8);
-        send_data[5] = (char) (frame->dst_mac[1] >> 16);
+        if (prio == AG_TX_PRIO_BG) {
+            // give other frames to the same destination a chance to share the transmission
+            AG_FRAME_L0 *frame = &ctx->comm.tx_pool.desc[fifo->idx[fifo->head]].frame;
+            uint32_t age = (get_ts_us() - frame->ts) / 1000;
+            if ((age < AG_TX_COALESCE_MS) && (p_tx_cnt_dst(ctx, frame) == 1)) {
+                *wait_ms = AG_TX_COALESCE_MS - age;
+                continue;
+            }
 
-        send_data[6] = (char) (frame->src_mac[0] & 0xFF);
-        send_data[7] = (char) (frame->src_mac[0] >> 8);
-        send_data[8] = (char) (frame->src_mac[0] >> 16);
-        send_data[9] = (char) (frame->src_mac[1] & 0xFF);
-        send_data[10] = (char) (frame->src_mac[1] >> 8);
-        send_data[11] = (char) (frame->src_mac[1] >> 16);
+            uint32_t ts_now = get_ts_ms();
+            uint32_t dt = ts_now - ctx->comm.tx_pool.bg_ts;
+            if (dt > (AG_TX_BG_BURST * 1000)) {
+                dt = AG_TX_BG_BURST * 1000;
+            }
+            ctx->comm.tx_pool.bg_tokens += dt * AG_TX_BG_RATE;
+            if (ctx->comm.tx_pool.bg_tokens > (AG_TX_BG_BURST * 1000)) {
+                ctx->comm.tx_pool.bg_tokens = AG_TX_BG_BURST * 1000;
+            }
+            ctx->comm.tx_pool.bg_ts = ts_now;
+            if (ctx->comm.tx_pool.bg_tokens < 1000) {
+                *wait_ms = ((1000 - ctx->comm.tx_pool.bg_tokens) + AG_TX_BG_RATE - 1) / AG_TX_BG_RATE;
+                ctx->comm.tx_pool.cnt_bg_deferred ++;
+                continue;
+            }
+            ctx->comm.tx_pool.bg_tokens -= 1000;
+        }
+
+        return &ctx->comm.tx_pool.desc[p_tx_fifo_remove(ctx, fifo, 0)];
+    }
+    return NULL;
+}
 
-        for (int i = 0; i < frame->nb; i++) {
-            send_data[i + 12] = (char) frame->data[i];
+/**
+ * @brief chain the queued frames with the same destination as head, highest class first
+ *
+ * Must be called with the TX lock held.
+ * @return number of bytes of the aggregated frame
+ */
+static int p_tx_gather(AG_CTX_t *ctx, AG_TX_DESC_t *head) {
+    AG_TX_DESC_t *tail = head;
+    int len = AG_PKT_AGGR_HDR_NB + 1 + head->frame.nb;
+
+    // only short packets are aggregated, fragments fill a frame on their own
+    if (head->frame.nb > AG_FRAME_LEN) {
+        return head->frame.nb;
+    }
+    for (int prio = 0; prio < AG_TX_PRIO_CNT; prio++) {
+        AG_TX_FIFO_t *fifo = &ctx->comm.tx_pool.queue[prio];
+        uint8_t i = 0;
+        while (i < fifo->cnt) {
+            AG_TX_DESC_t *desc = &ctx->comm.tx_pool.desc[fifo->idx[(fifo->head + i) % AG_TX_POOL_LEN]];
+            if (!p_tx_same_dst(&desc->frame, &head->frame) || (desc->frame.nb > AG_FRAME_LEN)
+                    || ((len + 1 + desc->frame.nb) > AG_FRAME_MAX_LEN)) {
+                i ++;
+                continue;
+            }
+
+            uint8_t idx = p_tx_fifo_remove(ctx, fifo, i);
+            desc->state = AG_TX_DESC_INFLIGHT;
+            tail->next = idx;
+            tail = desc;
+            len += 1 + desc->frame.nb;
         }
-        if (mq_send(queue, (const char *) send_data, (AG_FRAME_LEN + 12), 0) == -1) {
-            perror("CANNOT send msg");
-            continue;
+    }
+    return len;
+}
+
+/**
+ * @brief build the frame to put on the air for a chain of descriptors
+ */
+static void p_tx_build(AG_CTX_t *ctx, AG_TX_DESC_t *head, AG_FRAME_L0 *frame) {
+    if (head->next == AG_TX_DESC_NONE) {
+        *frame = head->frame;
+        return;
+    }
+
+    uint8_t *buff = ctx->comm.tx_pool.aggr;
+    int pos = AG_PKT_AGGR_HDR_NB;
+    uint8_t cnt = 0;
+    AG_TX_DESC_t *desc = head;
+    while (1) {
+        buff[pos] = desc->frame.nb;
+        memcpy(&buff[pos + 1], desc->frame.data, desc->frame.nb * sizeof (uint8_t));
+        pos += 1 + desc->frame.nb;
+        cnt ++;
+        if (desc->next == AG_TX_DESC_NONE) {
+            break;
+        }
+        desc = &ctx->comm.tx_pool.desc[desc->next];
+    }
+    buff[0] = AG_PROTO_VER1;
+    buff[1] = AG_PKT_TYPE_AGGR;
+    buff[2] = cnt;
+
+    *frame = head->frame;
+    frame->data = buff;
+    frame->nb = (uint8_t) pos;
+    ctx->comm.tx_pool.cnt_aggr ++;
+}
+
+/**
+ * @brief transmit the queued frames, called from task_rf
+ *
+ * @return time in ms after which it needs to be called again, UINT32_MAX if not needed
+ */
+uint32_t ag_comm_tx_main(AG_CTX_t *ctx) {
+    uint32_t wait_ms = UINT32_MAX;
+
+    // remote_mods belongs to task_rf, the TX callback only leaves the outcomes
+    while (1) {
+        HW_MAC_t mac;
+        uint8_t ok;
+
+        P_TX_LOCK(ctx);
+        uint8_t cnt = ctx->comm.tx_pool.report_cnt;
+        if (cnt != 0) {
+            mac = ctx->comm.tx_pool.report_mac[ctx->comm.tx_pool.report_head];
+            ok = ctx->comm.tx_pool.report_ok[ctx->comm.tx_pool.report_head];
+            ctx->comm.tx_pool.report_head = (uint8_t) ((ctx->comm.tx_pool.report_head + 1) % AG_TX_POOL_LEN);
+            ctx->comm.tx_pool.report_cnt --;
         }
+        P_TX_UNLOCK(ctx);
 
-        mq_close(queue);
+        if (cnt == 0) {
+            break;
+        }
+        ag_link_tx(ctx, mac, ok);
     }
-    closedir(d);
-    free(send_data);
+
+    while (1) {
+        AG_TX_DESC_t *desc = NULL;
+        AG_FRAME_L0 frame;
+
+        P_TX_LOCK(ctx);
+        if (ctx->comm.tx_pool.inflight_cnt < AG_TX_INFLIGHT_MAX) {
+            desc = p_tx_sched(ctx, &wait_ms);
+        }
+        if (desc != NULL) {
+            desc->state = AG_TX_DESC_INFLIGHT;
+            p_tx_gather(ctx, desc);
+            p_tx_build(ctx, desc, &frame);
+            ctx->comm.tx_pool.cnt_xmit ++;
+#if defined(ESP_PLATFORM)
+            ctx->comm.tx_pool.inflight[(ctx->comm.tx_pool.inflight_head + ctx->comm.tx_pool.inflight_cnt) % AG_TX_POOL_LEN] =
+                (uint8_t) (desc - ctx->comm.tx_pool.desc);
+            ctx->comm.tx_pool.inflight_cnt ++;
 #endif
-    frame->flags &= (uint8_t) ~AG_FRAME_FLAG_VALID;
-    return 0;
-}
+        }
+        P_TX_UNLOCK(ctx);
 
-AG_FRAME_L0 *ag_comm_get_tx_frame(void) {
-    uint32_t my_mac[2];
+        if (desc == NULL) {
+            break;
+        }
 
-    // if the frame is being transmitted, wait
-    while ((p_tx_frame.flags & AG_FRAME_FLAG_VALID) != 0) {
+        int ret = p_tx_raw(ctx, &frame);
 #if defined(ESP_PLATFORM)
-        vTaskDelay(1 / portTICK_PERIOD_MS);
+        if (ret != 0) {
+            // the TX callback will not come, drop the in-flight slot (it is the newest)
+            P_TX_LOCK(ctx);
+            ctx->comm.tx_pool.inflight_cnt --;
+            P_TX_UNLOCK(ctx);
+            p_tx_complete(ctx, desc, AG_TX_STS_FAIL);
+        }
 #elif defined(__linux__)
-        usleep(1000);
+        // mq_send() is synchronous
+        p_tx_complete(ctx, desc, (ret == 0) ? AG_TX_STS_OK : AG_TX_STS_FAIL);
+        // same as the ESP-NOW TX callback, somebody may be waiting for a free descriptor
+        ag_comm_wake(ctx);
 #endif
     }
+    return wait_ms;
+}
+
+/**
+ * @brief get a frame of class prio from the TX pool, does not block
+ *
+ * The last descriptors are kept for the higher classes, so the BG and BULK
+ * frames waiting for their turn cannot starve a power off or an alarm.
+ * @return frame or NULL if all the frames open to the class are in use
+ */
+AG_FRAME_L0 *ag_comm_get_tx_frame(AG_CTX_t *ctx, uint8_t prio) {
+    AG_TX_DESC_t *desc = NULL;
+
+    if (prio >= AG_TX_PRIO_CNT) {
+        prio = AG_TX_PRIO_BG;
+    }
+    P_TX_LOCK(ctx);
+    for (int i = 0; i < AG_TX_POOL_LEN; i++) {
+        if (ctx->comm.tx_pool.used >= (AG_TX_POOL_LEN - p_tx_reserve(prio))) {
+            break;
+        }
+        if (ctx->comm.tx_pool.desc[i].state == AG_TX_DESC_FREE) {
+            desc = &ctx->comm.tx_pool.desc[i];
+            desc->state = AG_TX_DESC_ALLOC;
+            ctx->comm.tx_pool.used ++;
+            if (ctx->comm.tx_pool.used > ctx->comm.tx_pool.hwm) {
+                ctx->comm.tx_pool.hwm = ctx->comm.tx_pool.used;
+            }
+            break;
+        }
+    }
+    if (desc == NULL) {
+        ctx->comm.tx_pool.cnt_full ++;
+    }
+    P_TX_UNLOCK(ctx);
 
-    get_HW_ID_compact(my_mac);
-    p_tx_frame.src_mac[0] = my_mac[0];
-    p_tx_frame.src_mac[1] = my_mac[1];
-    memset(p_tx_frame.data, 0, p_tx_frame.nb * sizeof (uint8_t));
-    p_tx_frame.flags |= AG_FRAME_FLAG_VALID;
-    return &p_tx_frame;
+    if (desc == NULL) {
+        return NULL;
+    }
+
+    desc->frame.dst_mac = HW_MAC_NONE;
+    desc->frame.src_mac = ctx->hw_id;
+    desc->frame.nb = AG_FRAME_LEN;
+    desc->frame.prio = prio;
+    memset(desc->frame.data, 0, AG_FRAME_MAX_LEN * sizeof (uint8_t));
+    desc->frame.flags = AG_FRAME_FLAG_VALID;
+    return &desc->frame;
 }
 
-void ag_comm_init(void) {
-    p_tx_frame.data = (uint8_t *) malloc((size_t) p_tx_frame.nb);
-    if (p_tx_frame.data == NULL) {
-        printf("CANNOT allocate TX buffer\n");
-        return;
+void ag_comm_init(AG_CTX_t *ctx) {
+    for (int i = 0; i < AG_TX_POOL_LEN; i++) {
+        ctx->comm.tx_pool.desc[i].frame.data = ctx->comm.tx_pool.desc[i].buff;
+        ctx->comm.tx_pool.desc[i].frame.nb = AG_FRAME_LEN;
+        ctx->comm.tx_pool.desc[i].state = AG_TX_DESC_FREE;
+        ctx->comm.tx_pool.desc[i].next = AG_TX_DESC_NONE;
+        ag_waiter_init(&ctx->comm.tx_pool.desc[i].waiter);
     }
+    ctx->comm.tx_pool.bg_tokens = AG_TX_BG_BURST * 1000;
+    ctx->comm.tx_pool.bg_ts = get_ts_ms();
 
-    p_rx_frame.data = (uint8_t *) malloc((size_t) p_rx_frame.nb);
-    if (p_rx_frame.data == NULL) {
-        printf("CANNOT allocate RX buffer\n");
-        return;
+    for (int i = 0; i < AG_RX_RING_LEN; i++) {
+        ctx->comm.rx_ring.frame[i].data = ctx->comm.rx_ring.buff[i];
+        ctx->comm.rx_ring.frame[i].nb = AG_FRAME_MAX_LEN;
     }
+    atomic_init(&ctx->comm.rx_ring.head, 0);
+    atomic_init(&ctx->comm.rx_ring.tail, 0);
+
+    // fast beats with the full status until the others know us
+    ctx->comm.hb.period = AG_HB_PERIOD_MIN_MS;
+    ctx->comm.hb.period_cur = AG_HB_PERIOD_MIN_MS;
+    ctx->comm.hb.full = 1;
+    // random phase so the MCs powered up together do not broadcast together
+    ctx->comm.hb.ts_next = get_ts_ms() + (get_rand_u32() % AG_HB_PERIOD_MIN_MS);
+    ctx->comm.hb.ts_join = get_ts_ms();
+    // a restarted MC does not continue the old sequence, the join probe tells them anyway
+    ctx->comm.hb.sts.gen = (uint8_t) get_rand_u32();
+
+    ag_lock_init(&ctx->comm.tx_mux);
+#if defined(__linux__)
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&ctx->comm.rf_lock, NULL);
+    pthread_cond_init(&ctx->comm.rf_cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
 
+/**
+ * @brief bring the radio up, called from task_rf
+ */
+void ag_comm_start(AG_CTX_t *ctx) {
 #if defined(ESP_PLATFORM)
+    ctx->comm.rf_task = xTaskGetCurrentTaskHandle();
+    p_esp_ctx = ctx;
     espnow_init();
     espnow_set_tx_callback(p_espnow_tx_cbk);
     espnow_set_rx_callback(p_espnow_rx_cbk);
-#elif defined(__linux)
-    p_mq_notify();
+#elif defined(__linux__)
+    const SIMNET_RX_t rx = {
+        .arg = ctx,
+        .rx = p_sim_rx,
+        .full = p_sim_rx_full,
+        .wake = p_sim_rx_wake,
+        .batch = AG_RX_RING_LEN / 2,
+    };
+    ctx->comm.sim = simnet_start(ctx->sim->id, ctx->hw_id, ctx->sim->msg_queue, &rx);
+#endif
+}
+
+/**
+ * @return delay in ms until the next heartbeat, period with a random jitter
+ */
+static uint32_t p_hb_delay(uint32_t period) {
+    uint32_t jitter = period / AG_HB_JITTER_DIV;
+
+    return period - (jitter / 2) + (get_rand_u32() % (jitter + 1));
+}
+
+/**
+ * @brief send the next heartbeat soon, called on membership changes
+ *
+ * The period starts again from AG_HB_PERIOD_MIN_MS so the other MCs converge fast.
+ */
+void ag_comm_hb_reset(AG_CTX_t *ctx) {
+    if (ctx->comm.hb.period == AG_HB_PERIOD_MIN_MS) {
+        return;
+    }
+
+    ctx->comm.hb.period = AG_HB_PERIOD_MIN_MS;
+    ctx->comm.hb.period_cur = AG_HB_PERIOD_MIN_MS;
+    p_hb_soon(ctx, AG_HB_PERIOD_MIN_MS);
+    ctx->comm.hb.cnt_reset ++;
+}
+
+/**
+ * @brief bump the generation if mod_state changed since the last status record
+ *
+ * @return 1 if it changed
+ */
+static int p_hb_status_upd(AG_CTX_t *ctx) {
+    AG_MC_STATUS_t *sts = &ctx->comm.hb.sts;
+
+    if ((sts->groups == ctx->mod_state.groups) && (sts->caps_hw == ctx->mod_state.caps_hw_ext)
+            && (sts->caps == ctx->mod_state.caps_sw) && (sts->tmc_prio == ctx->mod_state.tmc_prio)
+            && (sts->last_err == ctx->mod_state.last_err) && (sts->type == ctx->mod_state.type)) {
+        return 0;
+    }
+
+    sts->groups = ctx->mod_state.groups;
+    sts->caps_hw = ctx->mod_state.caps_hw_ext;
+    sts->caps = ctx->mod_state.caps_sw;
+    sts->tmc_prio = ctx->mod_state.tmc_prio;
+    sts->last_err = ctx->mod_state.last_err;
+    sts->type = ctx->mod_state.type;
+    sts->gen ++;
+    return 1;
+}
+
+/**
+ * @brief broadcast our status as a join probe or as a heartbeat
+ *
+ * The full record is only sent after a change or when asked for, otherwise
+ * a keepalive with the generation of the record.
+ * @return 0 if queued
+ */
+static int p_hb_tx(AG_CTX_t *ctx, uint8_t pkt_type, uint8_t prio) {
+    AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, prio);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    frame->dst_mac = HW_MAC_BCAST;
+    frame->data[0] = AG_PROTO_VER1;
+    frame->data[1] = pkt_type;
+    if (pkt_type == AG_PKT_TYPE_ALIVE) {
+        frame->data[2] = ctx->comm.hb.sts.gen;
+        frame->nb = AG_PKT_ALIVE_NB;
+    } else {
+        frame->data[2] = ctx->comm.hb.sts.groups;
+        frame->data[3] = ctx->comm.hb.sts.caps_hw;
+        frame->data[4] = ctx->comm.hb.sts.caps;
+        frame->data[5] = ctx->comm.hb.sts.tmc_prio;
+        frame->data[6] = ctx->comm.hb.sts.gen;
+        frame->data[7] = ctx->comm.hb.sts.last_err;
+        frame->data[8] = (uint8_t) (ctx->comm.hb.sts.type & 0xFF);
+        frame->data[9] = (uint8_t) (ctx->comm.hb.sts.type >> 8);
+        frame->nb = AG_PKT_STATUS_NB;
+        ctx->comm.hb.full = 0;
+        ctx->comm.hb.cnt_full ++;
+    }
+    ag_comm_tx(ctx, frame);
+    return 0;
+}
+
+/**
+ * @brief tell the other MCs to drop us now instead of aging us out
+ *
+ * The frame goes ahead of everything queued and is on the air before
+ * returning, only call from task_rf.
+ */
+void ag_comm_leave(AG_CTX_t *ctx) {
+    AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_SAFETY);
+    if (frame == NULL) {
+        printf("%s - CANNOT send leave\n", __func__);
+        return;
+    }
+
+    frame->dst_mac = HW_MAC_BCAST;
+    frame->data[0] = AG_PROTO_VER1;
+    frame->data[1] = AG_PKT_TYPE_LEAVE;
+    frame->nb = AG_PKT_LEAVE_NB;
+    ag_comm_tx_flush(ctx, ag_comm_tx_submit(ctx, frame), AG_TX_FLUSH_MS);
+}
+
+/**
+ * @brief broadcast the status when due, called from task_rf
+ *
+ * @return time in ms until the next heartbeat
+ */
+uint32_t ag_comm_hb_main(AG_CTX_t *ctx) {
+    uint32_t ts_now = get_ts_ms();
+
+    if (p_hb_status_upd(ctx)) {
+        // our own status changed, the others need to know
+        ctx->comm.hb.full = 1;
+        ag_comm_hb_reset(ctx);
+    }
+    if (ctx->comm.hb.join_cnt < AG_JOIN_PROBE_CNT) {
+        if ((int32_t) (ctx->comm.hb.ts_join - ts_now) > 0) {
+            return ctx->comm.hb.ts_join - ts_now;
+        }
+        // interactive class, the replies are what fills remote_mods after start
+        if (p_hb_tx(ctx, AG_PKT_TYPE_JOIN, AG_TX_PRIO_CMD) == 0) {
+            ctx->comm.hb.join_cnt ++;
+        }
+        ctx->comm.hb.ts_join = ts_now + AG_JOIN_PROBE_GAP_MS;
+        return AG_JOIN_PROBE_GAP_MS;
+    }
+
+    if ((int32_t) (ctx->comm.hb.ts_next - ts_now) > 0) {
+        return ctx->comm.hb.ts_next - ts_now;
+    }
+
+    if (p_hb_tx(ctx, (ctx->comm.hb.full ? AG_PKT_TYPE_STATUS : AG_PKT_TYPE_ALIVE), AG_TX_PRIO_BG) != 0) {
+        // try again after the next TX completion
+        return AG_HB_PERIOD_MIN_MS / 10;
+    }
+    ctx->comm.hb.cnt ++;
+
+    // schedule from the deadline, not from now, so a late pass does not shift the phase
+    uint32_t delay = p_hb_delay(ctx->comm.hb.period);
+    ctx->comm.hb.period_cur = ctx->comm.hb.period;
+    ctx->comm.hb.ts_next += delay;
+    if ((int32_t) (ctx->comm.hb.ts_next - ts_now) <= 0) {
+        ctx->comm.hb.ts_next = ts_now + delay;
+    }
+    // the master candidates must be heard within AG_TMC_TIMEOUT_MS
+    uint32_t period_max = (ctx->mod_state.tmc_prio != 0) ? AG_TMC_HB_PERIOD_MS : AG_HB_PERIOD_MAX_MS;
+    ctx->comm.hb.period = ((ctx->comm.hb.period * 2) > period_max) ? period_max : (ctx->comm.hb.period * 2);
+    return ctx->comm.hb.ts_next - ts_now;
+}
+
+void ag_comm_rx_main(AG_CTX_t *ctx) {
+    // drain everything received since the last pass
+    AG_FRAME_L0 *rx_frame;
+    while ((rx_frame = p_rx_peek(ctx)) != NULL) {
+        ag_comm_rx_process(ctx, rx_frame);
+        p_rx_pop(ctx);
+    }
+}
+
+/**
+ * @brief wake up the task waiting in ag_comm_wait()
+ */
+void ag_comm_wake(AG_CTX_t *ctx) {
+#if defined(ESP_PLATFORM)
+    if (ctx->comm.rf_task != NULL) {
+        xTaskNotifyGive(ctx->comm.rf_task);
+    }
+#elif defined(__linux__)
+    pthread_mutex_lock(&ctx->comm.rf_lock);
+    ctx->comm.rf_pending = 1;
+    pthread_cond_signal(&ctx->comm.rf_cond);
+    pthread_mutex_unlock(&ctx->comm.rf_lock);
+#endif
+}
+
+/**
+ * @brief block until ag_comm_wake() is called or the timeout expires
+ * @param timeout_ms max time to wait
+ */
+void ag_comm_wait(AG_CTX_t *ctx, uint32_t timeout_ms) {
+#if defined(ESP_PLATFORM)
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout_ms));
+#elif defined(__linux__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += (time_t) (timeout_ms / 1000);
+    ts.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ctx->comm.rf_lock);
+    while (ctx->comm.rf_pending == 0) {
+        if (pthread_cond_timedwait(&ctx->comm.rf_cond, &ctx->comm.rf_lock, &ts) != 0) {
+            break;
+        }
+    }
+    ctx->comm.rf_pending = 0;
+    pthread_mutex_unlock(&ctx->comm.rf_lock);
+#endif
+}
+
+void ag_waiter_init(AG_WAITER_t *waiter) {
+#if defined(ESP_PLATFORM)
+    waiter->task = NULL;
+#elif defined(__linux__)
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter->cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+/**
+ * @brief block until ag_waiter_wake() or the timeout, called and returns with the lock held
+ *
+ * May return early, the caller checks its condition again.
+ */
+void ag_waiter_wait(AG_WAITER_t *waiter, AG_LOCK_t *lock, uint32_t timeout_ms) {
+#if defined(ESP_PLATFORM)
+    // no blocking in a critical section, a notification given in between is kept
+    waiter->task = xTaskGetCurrentTaskHandle();
+    taskEXIT_CRITICAL(lock);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout_ms) + 1);
+    taskENTER_CRITICAL(lock);
+    waiter->task = NULL;
+#elif defined(__linux__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += (time_t) (timeout_ms / 1000);
+    ts.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&waiter->cond, lock, &ts);
 #endif
 }
 
-void ag_comm_main(void) {
+/**
+ * @brief wake the task in ag_waiter_wait(), call after the state it waits for was changed and the lock released
+ */
+void ag_waiter_wake(AG_WAITER_t *waiter) {
 #if defined(ESP_PLATFORM)
-    time_t ts_now = time(NULL);
-    if ((ts_now % 5) == 0) {
-        AG_FRAME_L0 *frame = ag_comm_get_tx_frame();
-        frame->dst_mac[0] = 0x00FFFFFF;
-        frame->dst_mac[1] = 0x00FFFFFF;
-        frame->data[0] = AG_PROTO_VER1;
-        frame->data[1] = AG_PKT_TYPE_STATUS;
-        frame->data[4] = MOD_STATE.caps_sw;
-        ag_comm_tx(frame);
-    }
-    if ((p_rx_frame.flags & AG_FRAME_FLAG_VALID) != 0) {
-        ag_comm_rx_process(&p_rx_frame);
+    TaskHandle_t task = waiter->task;
+    if (task != NULL) {
+        xTaskNotifyGive(task);
     }
 #elif defined(__linux__)
-    time_t ts_now = time(NULL);
-    if ((ts_now % 5) == 0) {
-        AG_FRAME_L0 *frame = ag_comm_get_tx_frame();
-        frame->dst_mac[0] = 0x00FFFFFF;
-        frame->dst_mac[1] = 0x00FFFFFF;
-        frame->data[0] = AG_PROTO_VER1;
-        frame->data[1] = AG_PKT_TYPE_STATUS;
-        frame->data[4] = MOD_STATE.caps_sw;
-        ag_comm_tx(frame);
-    }
-    if ((p_rx_frame.flags & AG_FRAME_FLAG_VALID) != 0) {
-        ag_comm_rx_process(&p_rx_frame);
+    pthread_cond_broadcast(&waiter->cond);
+#endif
+}
+
+void ag_comm_get_stats(AG_CTX_t *ctx, AG_COMM_STATS_t *stats) {
+    stats->rx_cnt = ctx->comm.rx_ring.cnt_rx;
+    stats->rx_overflow = ctx->comm.rx_ring.cnt_overflow;
+    stats->rx_drop = ctx->comm.rx_ring.cnt_drop;
+    stats->rx_hwm = ctx->comm.rx_ring.hwm;
+    stats->pwr_off_cnt = ctx->comm.lat_pwr_off.cnt;
+    stats->pwr_off_last = ctx->comm.lat_pwr_off.last;
+    stats->pwr_off_max = ctx->comm.lat_pwr_off.max;
+    stats->pwr_off_avg = (ctx->comm.lat_pwr_off.cnt == 0) ? 0 :
+                         (uint32_t) (ctx->comm.lat_pwr_off.sum / ctx->comm.lat_pwr_off.cnt);
+    stats->tx_cnt = ctx->comm.tx_pool.cnt_tx;
+    stats->tx_ok = ctx->comm.tx_pool.cnt_ok;
+    stats->tx_fail = ctx->comm.tx_pool.cnt_fail;
+    stats->tx_full = ctx->comm.tx_pool.cnt_full;
+    stats->tx_hwm = ctx->comm.tx_pool.hwm;
+    stats->tx_xmit = ctx->comm.tx_pool.cnt_xmit;
+    stats->tx_aggr = ctx->comm.tx_pool.cnt_aggr;
+    stats->tx_bg_deferred = ctx->comm.tx_pool.cnt_bg_deferred;
+    stats->hb_cnt = ctx->comm.hb.cnt;
+    stats->hb_period = ctx->comm.hb.period_cur;
+    stats->hb_reset = ctx->comm.hb.cnt_reset;
+    stats->join_rx = ctx->comm.hb.cnt_join;
+    stats->leave_rx = ctx->comm.hb.cnt_leave;
+    stats->hb_full = ctx->comm.hb.cnt_full;
+    stats->sync_tx = ctx->comm.hb.cnt_sync_tx;
+    stats->sync_rx = ctx->comm.hb.cnt_sync_rx;
+#if defined(ESP_PLATFORM)
+    ESPNOW_PEER_STATS_t peer;
+    espnow_get_peer_stats(&peer);
+    stats->peer_hit = peer.hit;
+    stats->peer_miss = peer.miss;
+    stats->peer_evict = peer.evict;
+    stats->peer_fallback = peer.fallback;
+#elif defined(__linux__)
+    SIMNET_STATS_t sim = {0};
+    // NULL until task_rf is up
+    if (ctx->comm.sim != NULL) {
+        simnet_get_stats(ctx->comm.sim, &sim);
     }
+    stats->peer_hit = sim.hit;
+    stats->peer_miss = 0;
+    stats->peer_evict = 0;
+    stats->peer_fallback = sim.fallback;
+    stats->sim_lost = sim.lost;
 #endif
+    P_TX_LOCK(ctx);
+    for (int i = 0; i < AG_TX_PRIO_CNT; i++) {
+        stats->tx_depth[i] = ctx->comm.tx_pool.queue[i].cnt;
+        stats->tx_depth_max[i] = ctx->comm.tx_pool.queue[i].cnt_max;
+        stats->tx_delay_max[i] = ctx->comm.tx_pool.queue[i].delay_max;
+    }
+    P_TX_UNLOCK(ctx);
 }
+
+#if defined(__linux__)
+/**
+ * @return 0 if the link model is on and mac sent frames to this MC
+ */
+int ag_comm_get_sim_link(AG_CTX_t *ctx, HW_MAC_t mac, AG_SIM_LINK_STATS_t *stats) {
+    SIMNET_LINK_STATS_t link;
+
+    if ((ctx->comm.sim == NULL) || (simnet_get_link_stats(ctx->comm.sim, mac, &link) != 0)) {
+        return -1;
+    }
+    stats->rx = link.rx;
+    stats->delivered = link.delivered;
+    stats->lost = link.lost;
+    stats->cut = link.cut;
+    stats->full = link.full;
+    stats->delay_avg = link.delay_avg;
+    stats->delay_max = link.delay_max;
+    return 0;
+}
+#endif
@@ -4,27 +4,319 @@
 #define AGATHIS_COMM_ZC5DS878HG83B98T
 /** @file */
 
+#include <stdatomic.h>
 #include <stdint.h>
 
-#define AG_FRAME_LEN            16
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "base.h"
+#include "defs.h"
+#include "../hw/misc.h"
+
+#define AG_FRAME_LEN            16  /**< max length of one packet */
+#define AG_FRAME_AIR_LEN        250 /**< max length on air (ESP_NOW_MAX_DATA_LEN) */
+#define AG_FRAME_MAX_LEN        242 /**< packets are aggregated up to it, leaves room for the AG_PKT_TYPE_UCAST header */
 #define AG_FRAME_FLAG_VALID     0x01
 
+#define AG_RX_RING_LEN          16  /**< RX ring capacity, must be a power of 2 */
+#define AG_TX_POOL_LEN          8   /**< number of TX descriptors */
+#define AG_TX_RESERVE_SAFETY    2   /**< TX descriptors only the SAFETY frames may take */
+#define AG_TX_RESERVE_CMD       1   /**< next TX descriptors the BG and BULK frames may not take */
+#define AG_TX_RESERVE_BG        1   /**< next TX descriptors the BULK frames may not take */
+#define AG_TX_INFLIGHT_MAX      2   /**< frames handed to the radio and not yet confirmed */
+#define AG_TX_BG_RATE           10  /**< max background frames per second */
+#define AG_TX_BG_BURST          4   /**< max background frames sent back to back */
+#define AG_TX_COALESCE_MS       20  /**< max time a background frame waits for others to the same destination */
+#define AG_TX_FLUSH_MS          100 /**< max time task_rf waits for its own frame, see ag_comm_tx_flush() */
+
+#define AG_HB_PERIOD_MIN_MS     1000    /**< heartbeat period while the membership changes */
+#define AG_HB_PERIOD_MAX_MS     8000    /**< heartbeat period of a stable chain, well below AG_MC_MAX_AGE_MS */
+#define AG_HB_JITTER_DIV        4       /**< every heartbeat is moved by up to +/- period / (2 * AG_HB_JITTER_DIV) */
+#define AG_JOIN_PROBE_CNT       2       /**< join probes sent after start */
+#define AG_JOIN_PROBE_GAP_MS    50
+#define AG_JOIN_REPLY_MS        40      /**< max random delay of the status sent in reply to a join probe */
+
+/**
+ * @brief TX classes, lower value is sent first
+ */
+typedef enum {
+    AG_TX_PRIO_SAFETY,  /**< power control, reset */
+    AG_TX_PRIO_CMD,     /**< interactive commands */
+    AG_TX_PRIO_BG,      /**< status, telemetry - rate limited */
+    AG_TX_PRIO_BULK,    /**< fragments of large messages, uses what is left */
+    AG_TX_PRIO_CNT,
+} AG_TX_PRIO_t;
+
+typedef enum {
+    AG_TX_STS_PENDING,
+    AG_TX_STS_OK,
+    AG_TX_STS_FAIL,
+    AG_TX_STS_TIMEOUT,
+} AG_TX_STS_t;
+
 typedef struct {
-    uint32_t dst_mac[2];
-    uint32_t src_mac[2];
+    HW_MAC_t dst_mac;
+    HW_MAC_t src_mac;
     uint8_t flags;
     uint8_t nb;
     uint8_t *data;
+    uint32_t ts;    /**< RX timestamp or TX submit timestamp in us */
+    uint8_t prio;   /**< TX class, AG_TX_PRIO_t */
+    int8_t rssi;    /**< RX signal strength in dBm, 0 if not known */
 } AG_FRAME_L0;
 
-int ag_comm_is_frame_master(AG_FRAME_L0 *frame);
+/**
+ * @brief communication counters
+ */
+typedef struct {
+    uint32_t rx_cnt;        /**< frames queued in the RX ring */
+    uint32_t rx_overflow;   /**< frames lost because the RX ring was full */
+    uint32_t rx_drop;       /**< malformed frames dropped */
+    uint32_t rx_hwm;        /**< RX ring high-water mark */
+    uint32_t pwr_off_cnt;   /**< power off commands executed */
+    uint32_t pwr_off_last;  /**< last RX to ag_brd_pwr_off() latency in us */
+    uint32_t pwr_off_max;   /**< worst RX to ag_brd_pwr_off() latency in us */
+    uint32_t pwr_off_avg;   /**< average RX to ag_brd_pwr_off() latency in us */
+    uint32_t tx_cnt;        /**< frames submitted */
+    uint32_t tx_ok;         /**< frames confirmed by the radio */
+    uint32_t tx_fail;       /**< frames that failed to send */
+    uint32_t tx_full;       /**< frame requests refused because the TX pool was empty */
+    uint32_t tx_hwm;        /**< TX pool high-water mark */
+    uint32_t tx_xmit;       /**< radio transmissions */
+    uint32_t tx_aggr;       /**< radio transmissions carrying more than one frame */
+    uint32_t tx_bg_deferred;    /**< background frames held back by the rate cap */
+    uint8_t tx_depth[AG_TX_PRIO_CNT];       /**< frames queued per class */
+    uint8_t tx_depth_max[AG_TX_PRIO_CNT];   /**< max frames queued per class */
+    uint32_t tx_delay_max[AG_TX_PRIO_CNT];  /**< worst queueing delay per class in us */
+    uint32_t hb_cnt;        /**< heartbeats sent */
+    uint32_t hb_full;       /**< status records sent in full (join probes and heartbeats) */
+    uint32_t hb_period;     /**< current heartbeat period in ms, without the jitter */
+    uint32_t hb_reset;      /**< heartbeat period shortened by a membership change */
+    uint32_t join_rx;       /**< join probes received */
+    uint32_t leave_rx;      /**< leave announcements received */
+    uint32_t sync_tx;       /**< full status requested after a missed generation */
+    uint32_t sync_rx;       /**< full status requested by the others */
+    uint32_t peer_hit;      /**< unicast frames to a peer with a radio slot (sim: to its queue only) */
+    uint32_t peer_miss;     /**< unicast frames to a peer that needed a radio slot */
+    uint32_t peer_evict;    /**< radio slots taken from the least recently used peer */
+    uint32_t peer_fallback; /**< unicast frames sent as broadcast (sim: MAC not learned yet) */
+    uint32_t sim_lost;      /**< sim shared memory: frames dropped on a full inbox or overwritten before read */
+} AG_COMM_STATS_t;
+
+#if defined(__linux__)
+/**
+ * @brief simulated link from another MC, see AG_SIM_LINK
+ */
+typedef struct {
+    uint32_t rx;            /**< frames sent on the link */
+    uint32_t delivered;
+    uint32_t lost;          /**< dropped by the loss rate */
+    uint32_t cut;           /**< dropped by a partition */
+    uint32_t full;          /**< dropped over the rate backlog or the delay queue */
+    uint32_t delay_avg;     /**< in us */
+    uint32_t delay_max;     /**< in us */
+} AG_SIM_LINK_STATS_t;
+#endif
+
+/**
+ * @brief lock of the state shared by task_rf and the other tasks of an MC
+ */
+#if defined(ESP_PLATFORM)
+typedef portMUX_TYPE AG_LOCK_t;
+#elif defined(__linux__)
+typedef pthread_mutex_t AG_LOCK_t;
+#endif
+
+static inline void ag_lock_init(AG_LOCK_t *lock) {
+#if defined(ESP_PLATFORM)
+    portMUX_INITIALIZE(lock);
+#elif defined(__linux__)
+    pthread_mutex_init(lock, NULL);
+#endif
+}
+
+/**
+ * @brief task blocked until task_rf has a result for it, one task waits at a time
+ */
+typedef struct {
+#if defined(ESP_PLATFORM)
+    TaskHandle_t task;      /**< NULL if nobody waits */
+#elif defined(__linux__)
+    pthread_cond_t cond;
+#endif
+} AG_WAITER_t;
+
+#define AG_TX_DESC_FREE      0
+#define AG_TX_DESC_ALLOC     1  /**< owned by the caller of ag_comm_get_tx_frame() */
+#define AG_TX_DESC_QUEUED    2  /**< waiting for task_rf */
+#define AG_TX_DESC_INFLIGHT  3  /**< handed to the radio, waiting for the TX callback */
+#define AG_TX_DESC_DONE      4  /**< status available, waiting for ag_comm_tx_wait() */
+
+/**
+ * @brief TX descriptor, the frame must stay the first member
+ */
+typedef struct {
+    AG_FRAME_L0 frame;
+    uint8_t buff[AG_FRAME_MAX_LEN];
+    uint8_t state;
+    uint8_t sts;
+    uint8_t gen;
+    uint8_t auto_free;
+    uint8_t next;       /**< next descriptor sent in the same transmission */
+    AG_WAITER_t waiter; /**< task in ag_comm_tx_wait() */
+} AG_TX_DESC_t;
+
+#define AG_TX_DESC_NONE     0xFF
+
+/**
+ * @brief FIFO of descriptor indexes for one TX class
+ */
+typedef struct {
+    uint8_t idx[AG_TX_POOL_LEN];
+    uint8_t head;
+    uint8_t cnt;
+    uint8_t cnt_max;
+    uint32_t delay_max;
+} AG_TX_FIFO_t;
+
+/**
+ * @brief pool of TX descriptors and the FIFOs of descriptor indexes
+ */
+typedef struct {
+    AG_TX_DESC_t desc[AG_TX_POOL_LEN];
+    AG_TX_FIFO_t queue[AG_TX_PRIO_CNT];
+    uint32_t bg_tokens;     /**< background frames allowed, in 1/1000 frame */
+    uint32_t bg_ts;         /**< last refill of bg_tokens in ms */
+    uint32_t cnt_bg_deferred;
+    uint8_t inflight[AG_TX_POOL_LEN];
+    uint8_t inflight_head;
+    uint8_t inflight_cnt;
+    uint8_t used;
+    uint8_t aggr[AG_FRAME_MAX_LEN];     /**< only used by task_rf */
+    HW_MAC_t report_mac[AG_TX_POOL_LEN];    /**< unicast TX outcomes for the link stats of task_rf */
+    uint8_t report_ok[AG_TX_POOL_LEN];
+    uint8_t report_head;
+    uint8_t report_cnt;
+    uint32_t cnt_xmit;
+    uint32_t cnt_aggr;
+    uint32_t cnt_tx;
+    uint32_t cnt_ok;
+    uint32_t cnt_fail;
+    uint32_t cnt_full;
+    uint32_t hwm;
+} AG_TX_POOL_t;
+
+/**
+ * @brief single-producer/single-consumer ring of RX frames
+ *
+ * The radio callback (ESP-NOW) or the RX thread (sim) is the only
+ * producer and advances head, task_rf is the only consumer and advances tail.
+ */
+typedef struct {
+    AG_FRAME_L0 frame[AG_RX_RING_LEN];
+    uint8_t buff[AG_RX_RING_LEN][AG_FRAME_MAX_LEN];
+    atomic_uint head;
+    atomic_uint tail;
+    uint32_t cnt_rx;
+    uint32_t cnt_overflow;
+    uint32_t cnt_drop;
+    uint32_t hwm;
+} AG_RX_RING_t;
+
+typedef struct {
+    uint32_t cnt;
+    uint32_t last;
+    uint32_t max;
+    uint64_t sum;
+} AG_LATENCY_t;
+
+/**
+ * @brief heartbeat (status broadcast) schedule, only used by task_rf
+ */
+typedef struct {
+    uint32_t period;        /**< in ms, doubles after every heartbeat up to AG_HB_PERIOD_MAX_MS */
+    uint32_t period_cur;    /**< period until the next heartbeat in ms */
+    uint32_t ts_next;       /**< next heartbeat in ms */
+    AG_MC_STATUS_t sts;     /**< our status record, sts.gen is its generation */
+    uint8_t full;           /**< next heartbeat carries the full record */
+    uint8_t join_cnt;       /**< join probes sent */
+    uint32_t ts_join;       /**< next join probe in ms */
+    uint32_t cnt;
+    uint32_t cnt_full;
+    uint32_t cnt_reset;
+    uint32_t cnt_join;
+    uint32_t cnt_leave;
+    uint32_t cnt_sync_tx;
+    uint32_t cnt_sync_rx;
+} AG_HB_t;
+
+#if defined(__linux__)
+struct simnet;
+#endif
+
+typedef struct {
+    AG_TX_POOL_t tx_pool;
+    AG_LOCK_t tx_mux;
+    AG_RX_RING_t rx_ring;
+#if defined(ESP_PLATFORM)
+    TaskHandle_t rf_task;           /**< woken up by the RX path */
+#elif defined(__linux__)
+    pthread_mutex_t rf_lock;
+    pthread_cond_t rf_cond;
+    int rf_pending;
+    struct simnet *sim;             /**< simulated radio, started by ag_comm_start() */
+#endif
+    AG_LATENCY_t lat_pwr_off;
+    AG_HB_t hb;
+} AG_COMM_STATE_t;
+
+int ag_comm_is_frame_master(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+AG_FRAME_L0 *ag_comm_get_tx_frame(AG_CTX_t *ctx, uint8_t prio);
+
+void ag_comm_init(AG_CTX_t *ctx);
+
+void ag_comm_start(AG_CTX_t *ctx);
+
+uint32_t ag_comm_hb_main(AG_CTX_t *ctx);
+
+void ag_comm_hb_reset(AG_CTX_t *ctx);
+
+void ag_comm_leave(AG_CTX_t *ctx);
+
+void ag_comm_rx_main(AG_CTX_t *ctx);
+
+void ag_comm_wake(AG_CTX_t *ctx);
+
+void ag_comm_wait(AG_CTX_t *ctx, uint32_t timeout_ms);
+
+void ag_waiter_init(AG_WAITER_t *waiter);
+
+void ag_waiter_wait(AG_WAITER_t *waiter, AG_LOCK_t *lock, uint32_t timeout_ms);
+
+void ag_waiter_wake(AG_WAITER_t *waiter);
+
+int ag_comm_tx(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+int ag_comm_tx_submit(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+int ag_comm_tx_free_cnt(AG_CTX_t *ctx, uint8_t prio);
+
+AG_TX_STS_t ag_comm_tx_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms);
 
-AG_FRAME_L0 *ag_comm_get_tx_frame(void);
+AG_TX_STS_t ag_comm_tx_flush(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms);
 
-void ag_comm_init(void);
+uint32_t ag_comm_tx_main(AG_CTX_t *ctx);
 
-void ag_comm_main(void);
+void ag_comm_get_stats(AG_CTX_t *ctx, AG_COMM_STATS_t *stats);
 
-int ag_comm_tx(AG_FRAME_L0 *frame);
+#if defined(__linux__)
+int ag_comm_get_sim_link(AG_CTX_t *ctx, HW_MAC_t mac, AG_SIM_LINK_STATS_t *stats);
+#endif
 
 #endif /* AGATHIS_COMM_ZC5DS878HG83B98T */
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AGATHIS_CTX_V6NB3KQ8XH2TWR5E
+#define AGATHIS_CTX_V6NB3KQ8XH2TWR5E
+/** @file */
+
+#include <stdint.h>
+
+#if defined(__linux__)
+#include "../sim/state.h"
+#endif
+
+#include "alarm.h"
+#include "base.h"
+#include "comm.h"
+#include "defs.h"
+#include "frag.h"
+#include "ping.h"
+#include "rcmd.h"
+#include "../hw/misc.h"
+
+/**
+ * @brief everything one MC (Management Controller) owns
+ *
+ * Passed to all the ag_*, stor_* and CLI entry points. The firmware has one,
+ * allocated statically, the simulator can run many MCs in one process.
+ * Set sim before ag_init(), the rest is initialized by ag_init().
+ */
+struct ag_ctx {
+    HW_MAC_t hw_id;                     /**< usually the MAC address */
+    AG_MC_STATE_t mod_state;            /**< saved by stor_save_state() */
+    AG_RMT_MC_STATE_t remote_mods[AG_MC_MAX_CNT];
+    AG_BASE_STATE_t base;
+    AG_COMM_STATE_t comm;
+    AG_RCMD_STATE_t rcmd;
+    AG_FRAG_STATE_t frag;
+    AG_PING_STATE_t ping;
+    AG_ALARM_STATE_t alarm;
+#if defined(__linux__)
+    SIM_STATE_t *sim;                   /**< sim id, MAC, queue and EEPROM file, &SIM_STATE if NULL */
+#endif
+};
+
+#endif /* AGATHIS_CTX_V6NB3KQ8XH2TWR5E */
@@ -15,8 +15,44 @@ typedef enum {
 
 #define AG_PROTO_VER1       1
 
-#define AG_PKT_TYPE_STATUS  0x00
-#define AG_PKT_TYPE_CMD     0x01
+/* every packet starts with [0] AG_PROTO_VER1, [1] AG_PKT_TYPE_* */
+#define AG_PKT_TYPE_STATUS  0x00    /**< [2] groups, [3] caps_hw_ext, [4] caps_sw, [5] master election priority,
+                                         [6] generation, [7] last_err, [8..9] type */
+#define AG_PKT_TYPE_CMD     0x01    /**< [2] cmd, [3..4] seq (0 = no ACK) */
+#define AG_PKT_TYPE_ACK     0x02    /**< [2] cmd, [3..4] seq, [5] AG_MC_CMD_STATUS_t */
+#define AG_PKT_TYPE_AGGR    0x03    /**< [2] number of packets, then [len][packet] for each */
+#define AG_PKT_TYPE_FRAG    0x04    /**< [2] msg id, [3] index | AG_FRAG_FLAG_POLL, [4] count, [5..6] msg length, [7..] data */
+#define AG_PKT_TYPE_FRAG_ACK 0x05   /**< [2] msg id, [3..6] bitmap of the fragments received */
+#define AG_PKT_TYPE_GCMD    0x06    /**< [2] cmd, [3..4] seq (0 = no ACK), [5] AG_GRP_*, [6] group id or caps mask */
+#define AG_PKT_TYPE_JOIN    0x07    /**< same as AG_PKT_TYPE_STATUS, the others answer with their status */
+#define AG_PKT_TYPE_LEAVE   0x08    /**< sender is going away */
+#define AG_PKT_TYPE_UCAST   0x09    /**< [2..7] destination MAC, [8..] frame - unicast sent as broadcast */
+#define AG_PKT_TYPE_ALIVE   0x0A    /**< [2] generation - status unchanged since that generation */
+#define AG_PKT_TYPE_SYNC    0x0B    /**< receiver missed a generation, send the full status */
+#define AG_PKT_TYPE_ECHO    0x0C    /**< [2] run id, [3..4] seq, [5..8] sender timestamp in us, [9..] padding */
+#define AG_PKT_TYPE_ECHO_REPLY 0x0D /**< AG_PKT_TYPE_ECHO sent back */
+#define AG_PKT_TYPE_ALARM   0x0E    /**< [2..7] origin MAC, [8] alarm id, [9] AG_ERR_* (AG_ERR_NONE = cleared),
+                                         [10..13] us since raised at the origin */
+
+#define AG_PKT_STATUS_NB    10
+#define AG_PKT_CMD_NB       5
+#define AG_PKT_ACK_NB       6
+#define AG_PKT_AGGR_HDR_NB  3
+#define AG_PKT_FRAG_HDR_NB  7
+#define AG_PKT_FRAG_ACK_NB  7
+#define AG_PKT_GCMD_NB      7
+#define AG_PKT_LEAVE_NB     2
+#define AG_PKT_UCAST_HDR_NB 8
+#define AG_PKT_ALIVE_NB     3
+#define AG_PKT_SYNC_NB      2
+#define AG_PKT_ECHO_NB      9
+#define AG_PKT_ALARM_NB     14
+
+/* targets of AG_PKT_TYPE_GCMD */
+#define AG_GRP_ALL          0x00    /**< every MC */
+#define AG_GRP_CAP          0x01    /**< MCs with any of the AG_CAP_* bits in the mask */
+#define AG_GRP_ID           0x02    /**< MCs in the user-defined group */
+#define AG_GRP_ID_CNT       8       /**< number of user-defined groups, one bit each */
 
 #define AG_CMD_ID           0x01
 #define AG_CMD_RESET        0x02
@@ -39,4 +75,9 @@ typedef enum {
 #define AG_ERR_NONE         0
 #define AG_ERR_MULTI_MASTER 1
 
+/**
+ * @brief state of one MC, see ctx.h
+ */
+typedef struct ag_ctx AG_CTX_t;
+
 #endif /* AGATHIS_98RXG9U8BUUHY401 */
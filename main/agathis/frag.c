@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "frag.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "ctx.h"
+#include "../hw/misc.h"
+
+#define P_FRAG_FREE     0
+#define P_FRAG_SEND     1   /**< fragments left to send in this round */
+#define P_FRAG_WAIT     2   /**< round sent, waiting for the FRAG_ACK */
+#define P_FRAG_DONE     3   /**< finished, waiting for ag_frag_wait(ctx) */
+
+#define P_FRAG_RX_FREE  0
+#define P_FRAG_RX_ASM   1   /**< reassembling */
+#define P_FRAG_RX_DONE  2   /**< complete, kept to answer repeated polls */
+
+#if defined(ESP_PLATFORM)
+#define P_FRAG_LOCK(ctx)    taskENTER_CRITICAL(&(ctx)->frag.mux)
+#define P_FRAG_UNLOCK(ctx)  taskEXIT_CRITICAL(&(ctx)->frag.mux)
+#elif defined(__linux__)
+#define P_FRAG_LOCK(ctx)    pthread_mutex_lock(&(ctx)->frag.mux)
+#define P_FRAG_UNLOCK(ctx)  pthread_mutex_unlock(&(ctx)->frag.mux)
+#endif
+
+void ag_frag_init(AG_CTX_t *ctx) {
+    ag_lock_init(&ctx->frag.mux);
+    ag_waiter_init(&ctx->frag.waiter);
+}
+
+static uint32_t p_frag_mask(uint8_t cnt) {
+    return (cnt >= 32) ? 0xFFFFFFFF : (uint32_t) ((1UL << cnt) - 1);
+}
+
+static uint16_t p_frag_len(uint16_t len, uint8_t cnt, uint8_t idx) {
+    return (idx == (cnt - 1)) ? (uint16_t) (len - (idx * AG_FRAG_DATA_LEN)) : AG_FRAG_DATA_LEN;
+}
+
+/**
+ * @brief send a message of up to AG_FRAG_MSG_MAX bytes
+ *
+ * @param data MUST stay valid until ag_frag_wait() returns
+ * @return handle that MUST be passed to ag_frag_wait(), or -1
+ */
+int ag_frag_send(AG_CTX_t *ctx, HW_MAC_t mac, const uint8_t *data, uint16_t len) {
+    AG_FRAG_TX_t *tx = &ctx->frag.tx;
+    int hndl = -1;
+
+    if ((len == 0) || (len > AG_FRAG_MSG_MAX)) {
+        return -1;
+    }
+
+    P_FRAG_LOCK(ctx);
+    if (tx->state == P_FRAG_FREE) {
+        if (ctx->frag.msg_id == 0) {
+            // random start so a restarted sender does not look like a repeated message
+            ctx->frag.msg_id = (uint8_t) get_rand_u32();
+        }
+        ctx->frag.msg_id ++;
+
+        tx->mac = mac;
+        tx->data = data;
+        tx->len = len;
+        tx->msg_id = ctx->frag.msg_id;
+        tx->cnt = (uint8_t) ((len + AG_FRAG_DATA_LEN - 1) / AG_FRAG_DATA_LEN);
+        tx->state = P_FRAG_SEND;
+        tx->stall = 0;
+        tx->acked = 0;
+        tx->todo = p_frag_mask(tx->cnt);
+        tx->ts_first = get_ts_us();
+        tx->ts_poll = get_ts_ms();
+        tx->res.sts = AG_FRAG_STS_PENDING;
+        tx->res.cnt = tx->cnt;
+        tx->res.tx = 0;
+        tx->res.time = 0;
+        ctx->frag.stats.tx_msg ++;
+        hndl = (tx->gen << 8);
+    }
+    P_FRAG_UNLOCK(ctx);
+
+    if (hndl >= 0) {
+        ag_comm_wake(ctx);
+    }
+    return hndl;
+}
+
+/**
+ * @brief wait for a message sent with ag_frag_send() to be acknowledged
+ *
+ * Do not call from task_rf, it is the one sending the fragments.
+ * The transfer is abandoned if timeout_ms expires first.
+ */
+AG_FRAG_STS_t ag_frag_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms, AG_FRAG_RESULT_t *res) {
+    AG_FRAG_TX_t *tx = &ctx->frag.tx;
+
+    if ((hndl < 0) || ((hndl & 0xFF) != 0)) {
+        return AG_FRAG_STS_ERROR;
+    }
+
+    AG_FRAG_STS_t sts = AG_FRAG_STS_PENDING;
+    uint32_t ts_start = get_ts_ms();
+
+    P_FRAG_LOCK(ctx);
+    while (sts == AG_FRAG_STS_PENDING) {
+        uint32_t elapsed = get_ts_ms() - ts_start;
+
+        if ((tx->gen != (uint8_t) (hndl >> 8)) || (tx->state == P_FRAG_FREE)) {
+            sts = AG_FRAG_STS_ERROR;
+        } else if (tx->state == P_FRAG_DONE) {
+            sts = (AG_FRAG_STS_t) tx->res.sts;
+        } else if (elapsed >= timeout_ms) {
+            ctx->frag.stats.tx_fail ++;
+            tx->res.sts = AG_FRAG_STS_TIMEOUT;
+            sts = AG_FRAG_STS_TIMEOUT;
+        } else {
+            // woken up by the last FRAG_ACK or the give up of task_rf
+            ag_waiter_wait(&ctx->frag.waiter, &ctx->frag.mux, timeout_ms - elapsed);
+        }
+    }
+    if (sts != AG_FRAG_STS_ERROR) {
+        *res = tx->res;
+        tx->state = P_FRAG_FREE;
+        tx->data = NULL;
+        tx->gen ++;
+    }
+    P_FRAG_UNLOCK(ctx);
+    return sts;
+}
+
+/**
+ * @brief send the fragments of the current round while there is room in the TX pool
+ *
+ * @return time in ms until a poll times out, UINT32_MAX if waiting for the TX pool
+ */
+static uint32_t p_frag_tx(AG_CTX_t *ctx) {
+    AG_FRAG_TX_t *tx = &ctx->frag.tx;
+    uint32_t wait_ms = UINT32_MAX;
+    int done = 0;
+
+    while (1) {
+        uint8_t buff[AG_FRAME_MAX_LEN];
+        HW_MAC_t mac;
+        uint16_t nb = 0;
+
+        if (ag_comm_tx_free_cnt(ctx, AG_TX_PRIO_BULK) == 0) {
+            // woken up by the TX completion
+            break;
+        }
+
+        P_FRAG_LOCK(ctx);
+        if (tx->state == P_FRAG_WAIT) {
+            uint32_t elapsed = get_ts_ms() - tx->ts_poll;
+            if (elapsed < AG_FRAG_RTO_MS) {
+                wait_ms = AG_FRAG_RTO_MS - elapsed;
+            } else if (tx->stall >= AG_FRAG_TRY_MAX) {
+                ctx->frag.stats.tx_fail ++;
+                tx->res.sts = AG_FRAG_STS_TIMEOUT;
+                tx->state = P_FRAG_DONE;
+                done = 1;
+            } else {
+                // the poll or its answer got lost, poll again with the last fragment missing
+                uint32_t missing = p_frag_mask(tx->cnt) & ~tx->acked;
+                uint8_t idx = 31;
+                while ((missing & (1UL << idx)) == 0) {
+                    idx --;
+                }
+                tx->todo = 1UL << idx;
+                tx->stall ++;
+                tx->state = P_FRAG_SEND;
+            }
+        }
+        if ((tx->state == P_FRAG_SEND) && (tx->todo != 0)) {
+            uint8_t idx = 0;
+            while ((tx->todo & (1UL << idx)) == 0) {
+                idx ++;
+            }
+            uint16_t len = p_frag_len(tx->len, tx->cnt, idx);
+
+            tx->todo &= (uint32_t) ~(1UL << idx);
+            buff[0] = AG_PROTO_VER1;
+            buff[1] = AG_PKT_TYPE_FRAG;
+            buff[2] = tx->msg_id;
+            buff[3] = idx;
+            if (tx->todo == 0) {
+                // last fragment of the round
+                buff[3] |= AG_FRAG_FLAG_POLL;
+                tx->ts_poll = get_ts_ms();
+                tx->state = P_FRAG_WAIT;
+            }
+            buff[4] = tx->cnt;
+            buff[5] = (uint8_t) (tx->len & 0xFF);
+            buff[6] = (uint8_t) (tx->len >> 8);
+            memcpy(&buff[AG_PKT_FRAG_HDR_NB], &tx->data[idx * AG_FRAG_DATA_LEN], len);
+            nb = (uint16_t) (AG_PKT_FRAG_HDR_NB + len);
+            mac = tx->mac;
+
+            if (tx->res.tx >= tx->cnt) {
+                ctx->frag.stats.tx_retx ++;
+            }
+            tx->res.tx ++;
+            ctx->frag.stats.tx_frag ++;
+        }
+        P_FRAG_UNLOCK(ctx);
+
+        if (nb == 0) {
+            break;
+        }
+
+        AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_BULK);
+        if (frame == NULL) {
+            // the poll timer recovers the fragment
+            break;
+        }
+        frame->dst_mac = mac;
+        memcpy(frame->data, buff, nb);
+        frame->nb = (uint8_t) nb;
+        ag_comm_tx(ctx, frame);
+    }
+
+    if (done != 0) {
+        ag_waiter_wake(&ctx->frag.waiter);
+    }
+    return wait_ms;
+}
+
+/**
+ * @brief release the reassembly slots that timed out
+ *
+ * @return time in ms until the next slot times out, UINT32_MAX if none
+ */
+static uint32_t p_frag_rx_age(AG_CTX_t *ctx) {
+    uint32_t ts_now = get_ts_ms();
+    uint32_t wait_ms = UINT32_MAX;
+
+    for (int i = 0; i < AG_FRAG_RX_SLOTS; i++) {
+        AG_FRAG_RX_t *rx = &ctx->frag.rx[i];
+        if (rx->state == P_FRAG_RX_FREE) {
+            continue;
+        }
+
+        uint32_t elapsed = ts_now - rx->ts_last;
+        if (elapsed >= AG_FRAG_RX_TIMEOUT_MS) {
+            if (rx->state == P_FRAG_RX_ASM) {
+                ctx->frag.stats.rx_timeout ++;
+            }
+            rx->state = P_FRAG_RX_FREE;
+        } else if ((AG_FRAG_RX_TIMEOUT_MS - elapsed) < wait_ms) {
+            // only incomplete messages need the timer to be exact
+            if (rx->state == P_FRAG_RX_ASM) {
+                wait_ms = AG_FRAG_RX_TIMEOUT_MS - elapsed;
+            }
+        }
+    }
+    return wait_ms;
+}
+
+/**
+ * @brief send fragments, poll the receiver, age the reassembly slots, called from task_rf
+ *
+ * @return time in ms after which it needs to be called again, UINT32_MAX if not needed
+ */
+uint32_t ag_frag_main(AG_CTX_t *ctx) {
+    uint32_t wait_ms = p_frag_tx(ctx);
+    uint32_t wait_tmp = p_frag_rx_age(ctx);
+
+    return (wait_tmp < wait_ms) ? wait_tmp : wait_ms;
+}
+
+static void p_frag_tx_ack(AG_CTX_t *ctx, const AG_FRAG_RX_t *rx) {
+    AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_CMD);
+    if (frame == NULL) {
+        // the sender polls again
+        return;
+    }
+
+    frame->dst_mac = rx->mac;
+    frame->data[0] = AG_PROTO_VER1;
+    frame->data[1] = AG_PKT_TYPE_FRAG_ACK;
+    frame->data[2] = rx->msg_id;
+    frame->data[3] = (uint8_t) (rx->rcvd & 0xFF);
+    frame->data[4] = (uint8_t) ((rx->rcvd >> 8) & 0xFF);
+    frame->data[5] = (uint8_t) ((rx->rcvd >> 16) & 0xFF);
+    frame->data[6] = (uint8_t) (rx->rcvd >> 24);
+    frame->nb = AG_PKT_FRAG_ACK_NB;
+    ag_comm_tx(ctx, frame);
+}
+
+/**
+ * @brief find the reassembly slot of a peer, take a free one for a new peer
+ */
+static AG_FRAG_RX_t *p_frag_rx_slot(AG_CTX_t *ctx, HW_MAC_t mac) {
+    AG_FRAG_RX_t *free_slot = NULL;
+
+    for (int i = 0; i < AG_FRAG_RX_SLOTS; i++) {
+        AG_FRAG_RX_t *rx = &ctx->frag.rx[i];
+        if (rx->state == P_FRAG_RX_FREE) {
+            if (free_slot == NULL) {
+                free_slot = rx;
+            }
+        } else if (rx->mac == mac) {
+            return rx;
+        } else if ((rx->state == P_FRAG_RX_DONE) && (free_slot == NULL)) {
+            free_slot = rx;
+        }
+    }
+    return free_slot;
+}
+
+/**
+ * @brief store a fragment, deliver the message when complete
+ */
+void ag_frag_rx(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    uint8_t msg_id = frame->data[2];
+    uint8_t idx = frame->data[3] & (uint8_t) ~AG_FRAG_FLAG_POLL;
+    uint8_t cnt = frame->data[4];
+    uint16_t len = (uint16_t) (frame->data[5] | (frame->data[6] << 8));
+
+    if ((len == 0) || (len > AG_FRAG_MSG_MAX) || (idx >= cnt)
+            || (cnt != ((len + AG_FRAG_DATA_LEN - 1) / AG_FRAG_DATA_LEN))
+            || (frame->nb != (AG_PKT_FRAG_HDR_NB + p_frag_len(len, cnt, idx)))) {
+        printf("%s - INVALID fragment\n", __func__);
+        return;
+    }
+    ctx->frag.stats.rx_frag ++;
+
+    AG_FRAG_RX_t *rx = p_frag_rx_slot(ctx, frame->src_mac);
+    if (rx == NULL) {
+        ctx->frag.stats.rx_no_slot ++;
+        return;
+    }
+    if ((rx->state == P_FRAG_RX_FREE) || (rx->mac != frame->src_mac) || (rx->msg_id != msg_id)) {
+        // new message, the peer gave up on the previous one
+        if (rx->state == P_FRAG_RX_ASM) {
+            ctx->frag.stats.rx_timeout ++;
+        }
+        rx->mac = frame->src_mac;
+        rx->msg_id = msg_id;
+        rx->cnt = cnt;
+        rx->len = len;
+        rx->rcvd = 0;
+        rx->state = P_FRAG_RX_ASM;
+    }
+    rx->ts_last = get_ts_ms();
+
+    if ((rx->rcvd & (1UL << idx)) != 0) {
+        ctx->frag.stats.rx_dup ++;
+    } else if (rx->state == P_FRAG_RX_ASM) {
+        memcpy(&rx->buff[idx * AG_FRAG_DATA_LEN], &frame->data[AG_PKT_FRAG_HDR_NB],
+               p_frag_len(len, cnt, idx));
+        rx->rcvd |= 1UL << idx;
+        if (rx->rcvd == p_frag_mask(cnt)) {
+            rx->state = P_FRAG_RX_DONE;
+            ctx->frag.stats.rx_msg ++;
+            ctx->frag.stats.rx_bytes += len;
+            if (ctx->frag.rx_cbk != NULL) {
+                ctx->frag.rx_cbk(ctx, rx->mac, rx->buff, rx->len);
+            }
+            // do not wait for the poll, saves a round trip
+            p_frag_tx_ack(ctx, rx);
+            return;
+        }
+    }
+
+    if ((frame->data[3] & AG_FRAG_FLAG_POLL) != 0) {
+        p_frag_tx_ack(ctx, rx);
+    }
+}
+
+/**
+ * @brief update the fragments acknowledged, schedule the missing ones
+ */
+void ag_frag_rx_ack(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    AG_FRAG_TX_t *tx = &ctx->frag.tx;
+    uint32_t rcvd = (uint32_t) frame->data[3] | ((uint32_t) frame->data[4] << 8)
+                    | ((uint32_t) frame->data[5] << 16) | ((uint32_t) frame->data[6] << 24);
+    int done = 0;
+
+    P_FRAG_LOCK(ctx);
+    if (((tx->state == P_FRAG_SEND) || (tx->state == P_FRAG_WAIT)) && (tx->msg_id == frame->data[2])
+            && (tx->mac == frame->src_mac)) {
+        uint32_t mask = p_frag_mask(tx->cnt);
+        if (((rcvd & mask) & ~tx->acked) != 0) {
+            tx->stall = 0;
+        }
+        tx->acked |= rcvd & mask;
+        tx->todo &= ~tx->acked;
+        if (tx->acked == mask) {
+            tx->res.sts = AG_FRAG_STS_DONE;
+            tx->res.time = frame->ts - tx->ts_first;
+            tx->state = P_FRAG_DONE;
+            done = 1;
+        } else if (tx->state == P_FRAG_WAIT) {
+            // selective retransmit of what is missing
+            tx->todo = mask & ~tx->acked;
+            tx->state = P_FRAG_SEND;
+        }
+    }
+    P_FRAG_UNLOCK(ctx);
+
+    if (done != 0) {
+        ag_waiter_wake(&ctx->frag.waiter);
+    }
+}
+
+/**
+ * @brief set the function called from task_rf with every message reassembled
+ */
+void ag_frag_set_rx_callback(AG_CTX_t *ctx,
+                             void fptr(AG_CTX_t *ctx, HW_MAC_t mac, const uint8_t *data, uint16_t len)) {
+    ctx->frag.rx_cbk = fptr;
+}
+
+void ag_frag_get_stats(AG_CTX_t *ctx, AG_FRAG_STATS_t *stats) {
+    P_FRAG_LOCK(ctx);
+    *stats = ctx->frag.stats;
+    P_FRAG_UNLOCK(ctx);
+}
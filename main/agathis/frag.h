@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AGATHIS_FRAG_K7RZ2XW9DV4NQ6HB
+#define AGATHIS_FRAG_K7RZ2XW9DV4NQ6HB
+/** @file */
+
+#include <stdint.h>
+
+#include "comm.h"
+#include "defs.h"
+
+#define AG_FRAG_DATA_LEN        (AG_FRAME_MAX_LEN - AG_PKT_FRAG_HDR_NB)  /**< data bytes per fragment */
+#define AG_FRAG_CNT_MAX         32      /**< fragments per message, one bit each in the FRAG_ACK bitmap */
+#define AG_FRAG_MSG_MAX         4096    /**< max message length */
+#define AG_FRAG_RX_SLOTS        2       /**< messages reassembled at the same time, one per peer */
+#define AG_FRAG_RX_TIMEOUT_MS   1000    /**< reassembly slot released after this long without a fragment */
+#define AG_FRAG_RTO_MS          100     /**< wait for a FRAG_ACK before polling again */
+#define AG_FRAG_TRY_MAX         5       /**< polls without progress before giving up */
+#define AG_FRAG_FLAG_POLL       0x80    /**< in the index byte, receiver answers with a FRAG_ACK */
+
+#if (AG_FRAG_MSG_MAX > (AG_FRAG_CNT_MAX * AG_FRAG_DATA_LEN))
+#error "AG_FRAG_MSG_MAX does not fit in AG_FRAG_CNT_MAX fragments"
+#endif
+
+typedef enum {
+    AG_FRAG_STS_PENDING,
+    AG_FRAG_STS_DONE,       /**< all fragments acknowledged */
+    AG_FRAG_STS_TIMEOUT,    /**< receiver stopped answering */
+    AG_FRAG_STS_ERROR,      /**< invalid handle */
+} AG_FRAG_STS_t;
+
+/**
+ * @brief outcome of a message sent with ag_frag_send()
+ */
+typedef struct {
+    uint8_t sts;        /**< AG_FRAG_STS_t */
+    uint8_t cnt;        /**< number of fragments */
+    uint16_t tx;        /**< fragments transmitted, retransmits included */
+    uint32_t time;      /**< first fragment to last FRAG_ACK in us */
+} AG_FRAG_RESULT_t;
+
+typedef struct {
+    uint32_t tx_msg;        /**< messages sent */
+    uint32_t tx_fail;       /**< messages not acknowledged */
+    uint32_t tx_frag;       /**< fragments sent */
+    uint32_t tx_retx;       /**< fragments sent again */
+    uint32_t rx_msg;        /**< messages reassembled */
+    uint32_t rx_bytes;      /**< bytes reassembled */
+    uint32_t rx_frag;       /**< fragments received */
+    uint32_t rx_dup;        /**< fragments received twice */
+    uint32_t rx_timeout;    /**< incomplete messages dropped */
+    uint32_t rx_no_slot;    /**< fragments dropped because all the reassembly slots were busy */
+} AG_FRAG_STATS_t;
+
+/**
+ * @brief message being sent
+ */
+typedef struct {
+    HW_MAC_t mac;
+    const uint8_t *data;    /**< owned by the caller until ag_frag_wait() returns */
+    uint16_t len;
+    uint8_t msg_id;
+    uint8_t cnt;
+    uint8_t state;
+    uint8_t gen;
+    uint8_t stall;          /**< polls without progress */
+    uint32_t acked;         /**< bitmap of the fragments acknowledged */
+    uint32_t todo;          /**< bitmap of the fragments to send in this round */
+    uint32_t ts_first;      /**< first fragment in us */
+    uint32_t ts_poll;       /**< last poll in ms */
+    AG_FRAG_RESULT_t res;
+} AG_FRAG_TX_t;
+
+/**
+ * @brief message being reassembled, only used by task_rf
+ */
+typedef struct {
+    HW_MAC_t mac;
+    uint8_t msg_id;
+    uint8_t cnt;
+    uint8_t state;
+    uint16_t len;
+    uint32_t rcvd;          /**< bitmap of the fragments received */
+    uint32_t ts_last;       /**< last fragment in ms */
+    uint8_t buff[AG_FRAG_MSG_MAX];
+} AG_FRAG_RX_t;
+
+typedef struct {
+    AG_FRAG_TX_t tx;
+    AG_FRAG_RX_t rx[AG_FRAG_RX_SLOTS];
+    uint8_t msg_id;
+    void (*rx_cbk)(AG_CTX_t *ctx, HW_MAC_t mac, const uint8_t *data, uint16_t len);
+    AG_FRAG_STATS_t stats;
+    AG_WAITER_t waiter;     /**< task in ag_frag_wait() */
+    AG_LOCK_t mux;
+} AG_FRAG_STATE_t;
+
+void ag_frag_init(AG_CTX_t *ctx);
+
+int ag_frag_send(AG_CTX_t *ctx, HW_MAC_t mac, const uint8_t *data, uint16_t len);
+
+AG_FRAG_STS_t ag_frag_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms, AG_FRAG_RESULT_t *res);
+
+uint32_t ag_frag_main(AG_CTX_t *ctx);
+
+void ag_frag_rx(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+void ag_frag_rx_ack(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+void ag_frag_set_rx_callback(AG_CTX_t *ctx,
+                             void fptr(AG_CTX_t *ctx, HW_MAC_t mac, const uint8_t *data, uint16_t len));
+
+void ag_frag_get_stats(AG_CTX_t *ctx, AG_FRAG_STATS_t *stats);
+
+#endif /* AGATHIS_FRAG_K7RZ2XW9DV4NQ6HB */
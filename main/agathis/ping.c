@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "ping.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "ctx.h"
+#include "../hw/misc.h"
+
+#define P_PING_FREE     0
+#define P_PING_SEND     1   /**< probes left to send */
+#define P_PING_WAIT     2   /**< all probes sent, waiting for the replies */
+#define P_PING_DONE     3   /**< finished, waiting for ag_ping_wait(ctx) */
+
+#if defined(ESP_PLATFORM)
+#define P_PING_LOCK(ctx)    taskENTER_CRITICAL(&(ctx)->ping.mux)
+#define P_PING_UNLOCK(ctx)  taskEXIT_CRITICAL(&(ctx)->ping.mux)
+#elif defined(__linux__)
+#define P_PING_LOCK(ctx)    pthread_mutex_lock(&(ctx)->ping.mux)
+#define P_PING_UNLOCK(ctx)  pthread_mutex_unlock(&(ctx)->ping.mux)
+#endif
+
+void ag_ping_init(AG_CTX_t *ctx) {
+    ag_lock_init(&ctx->ping.mux);
+    ag_waiter_init(&ctx->ping.waiter);
+}
+
+/**
+ * @brief start sending cnt probes of size bytes to mac, one every interval_ms
+ *
+ * @return handle that MUST be passed to ag_ping_wait(), or -1
+ */
+int ag_ping_start(AG_CTX_t *ctx, HW_MAC_t mac, uint16_t cnt, uint32_t interval_ms, uint8_t size) {
+    int hndl = -1;
+
+    if ((cnt == 0) || (cnt > AG_PING_CNT_MAX)) {
+        return -1;
+    }
+    if ((interval_ms < AG_PING_INTERVAL_MIN_MS) || (interval_ms > AG_PING_INTERVAL_MAX_MS)) {
+        return -1;
+    }
+    if ((size < AG_PKT_ECHO_NB) || (size > AG_FRAME_MAX_LEN)) {
+        return -1;
+    }
+
+    P_PING_LOCK(ctx);
+    if (ctx->ping.run.state == P_PING_FREE) {
+        if (ctx->ping.run.run_id == 0) {
+            // random start so a restarted MC does not match the replies of its previous life
+            ctx->ping.run.run_id = (uint8_t) get_rand_u32();
+        }
+        ctx->ping.run.run_id ++;
+
+        ctx->ping.run.mac = mac;
+        ctx->ping.run.state = P_PING_SEND;
+        ctx->ping.run.size = size;
+        ctx->ping.run.cnt = cnt;
+        ctx->ping.run.sent = 0;
+        ctx->ping.run.rcvd = 0;
+        ctx->ping.run.dup = 0;
+        ctx->ping.run.interval = interval_ms;
+        ctx->ping.run.ts_next = get_ts_ms();
+        memset(ctx->ping.run.acked, 0, sizeof (ctx->ping.run.acked));
+        hndl = (ctx->ping.run.gen << 8);
+    }
+    P_PING_UNLOCK(ctx);
+
+    if (hndl >= 0) {
+        ag_comm_wake(ctx);
+    }
+    return hndl;
+}
+
+static uint8_t p_ping_bucket(uint32_t rtt) {
+    uint32_t bound = AG_PING_HIST_BASE_US;
+    uint8_t idx = 0;
+
+    while ((rtt >= bound) && (idx < (AG_PING_HIST_CNT - 1))) {
+        bound <<= 1;
+        idx ++;
+    }
+    return idx;
+}
+
+static int p_ping_cmp(const void *a, const void *b) {
+    uint32_t ua = *(const uint32_t *) a;
+    uint32_t ub = *(const uint32_t *) b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+/**
+ * @return nearest-rank percentile of the sorted samples
+ */
+static uint32_t p_ping_pct(const uint32_t *sorted, uint16_t cnt, uint32_t pct) {
+    uint32_t rank = ((pct * cnt) + 99) / 100;
+
+    return sorted[(rank == 0) ? 0 : (rank - 1)];
+}
+
+static void p_ping_summary(AG_CTX_t *ctx, AG_PING_RESULT_t *res) {
+    uint64_t sum = 0;
+    uint16_t cnt = res->rcvd;
+
+    memset(res->hist, 0, sizeof (res->hist));
+    res->min = 0;
+    res->avg = 0;
+    res->p50 = 0;
+    res->p99 = 0;
+    res->max = 0;
+    if (cnt == 0) {
+        return;
+    }
+
+    qsort(ctx->ping.sorted, cnt, sizeof (ctx->ping.sorted[0]), p_ping_cmp);
+    for (uint16_t i = 0; i < cnt; i++) {
+        sum += ctx->ping.sorted[i];
+        res->hist[p_ping_bucket(ctx->ping.sorted[i])] ++;
+    }
+    res->min = ctx->ping.sorted[0];
+    res->max = ctx->ping.sorted[cnt - 1];
+    res->avg = (uint32_t) (sum / cnt);
+    res->p50 = p_ping_pct(ctx->ping.sorted, cnt, 50);
+    res->p99 = p_ping_pct(ctx->ping.sorted, cnt, 99);
+}
+
+/**
+ * @brief wait for a run started with ag_ping_start() to finish
+ *
+ * Do not call from task_rf, it is the one sending the probes.
+ * The run is abandoned if timeout_ms expires first.
+ */
+AG_PING_STS_t ag_ping_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms, AG_PING_RESULT_t *res) {
+    if ((hndl < 0) || ((hndl & 0xFF) != 0)) {
+        return AG_PING_STS_ERROR;
+    }
+
+    AG_PING_STS_t sts = AG_PING_STS_PENDING;
+    uint32_t ts_start = get_ts_ms();
+
+    P_PING_LOCK(ctx);
+    while (sts == AG_PING_STS_PENDING) {
+        uint32_t elapsed = get_ts_ms() - ts_start;
+
+        if ((ctx->ping.run.gen != (uint8_t) (hndl >> 8)) || (ctx->ping.run.state == P_PING_FREE)) {
+            sts = AG_PING_STS_ERROR;
+        } else if (ctx->ping.run.state == P_PING_DONE) {
+            sts = AG_PING_STS_DONE;
+        } else if (elapsed >= timeout_ms) {
+            sts = AG_PING_STS_TIMEOUT;
+        } else {
+            // woken up by the last reply or the end of the run
+            ag_waiter_wait(&ctx->ping.waiter, &ctx->ping.mux, timeout_ms - elapsed);
+        }
+    }
+    if (sts != AG_PING_STS_ERROR) {
+        res->sts = (uint8_t) sts;
+        res->sent = ctx->ping.run.sent;
+        res->rcvd = ctx->ping.run.rcvd;
+        res->dup = ctx->ping.run.dup;
+        memcpy(ctx->ping.sorted, ctx->ping.run.rtt, ctx->ping.run.rcvd * sizeof (ctx->ping.run.rtt[0]));
+        ctx->ping.run.state = P_PING_FREE;
+        ctx->ping.run.gen ++;
+    }
+    P_PING_UNLOCK(ctx);
+
+    if (sts != AG_PING_STS_ERROR) {
+        p_ping_summary(ctx, res);
+    }
+    return sts;
+}
+
+/**
+ * @brief send the probes that are due, called from task_rf
+ *
+ * @return time in ms until the next probe or the end of the run
+ */
+uint32_t ag_ping_main(AG_CTX_t *ctx) {
+    uint8_t buff[AG_FRAME_MAX_LEN];
+    uint32_t wait_ms = UINT32_MAX;
+    uint32_t ts_now = get_ts_ms();
+    HW_MAC_t mac = HW_MAC_NONE;
+    uint8_t nb = 0;
+    int done = 0;
+
+    P_PING_LOCK(ctx);
+    if ((ctx->ping.run.state == P_PING_SEND) && ((int32_t) (ts_now - ctx->ping.run.ts_next) >= 0)) {
+        uint16_t seq = ctx->ping.run.sent;
+
+        memset(buff, 0, ctx->ping.run.size);
+        buff[0] = AG_PROTO_VER1;
+        buff[1] = AG_PKT_TYPE_ECHO;
+        buff[2] = ctx->ping.run.run_id;
+        buff[3] = (uint8_t) (seq & 0xFF);
+        buff[4] = (uint8_t) (seq >> 8);
+        mac = ctx->ping.run.mac;
+        nb = ctx->ping.run.size;
+
+        ctx->ping.run.sent ++;
+        ctx->ping.run.ts_next += ctx->ping.run.interval;
+        if ((int32_t) (ts_now - ctx->ping.run.ts_next) >= 0) {
+            // do not send a burst to catch up
+            ctx->ping.run.ts_next = ts_now + ctx->ping.run.interval;
+        }
+        if (ctx->ping.run.sent == ctx->ping.run.cnt) {
+            ctx->ping.run.state = P_PING_WAIT;
+            ctx->ping.run.ts_next = ts_now + AG_PING_TIMEOUT_MS;
+        }
+    }
+    if ((ctx->ping.run.state == P_PING_WAIT) && ((int32_t) (ts_now - ctx->ping.run.ts_next) >= 0)) {
+        ctx->ping.run.state = P_PING_DONE;
+        done = 1;
+    }
+    if ((ctx->ping.run.state == P_PING_SEND) || (ctx->ping.run.state == P_PING_WAIT)) {
+        int32_t tmp = (int32_t) (ctx->ping.run.ts_next - ts_now);
+        wait_ms = (tmp > 0) ? (uint32_t) tmp : 0;
+    }
+    P_PING_UNLOCK(ctx);
+
+    if (done != 0) {
+        ag_waiter_wake(&ctx->ping.waiter);
+    }
+
+    if (nb != 0) {
+        AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_CMD);
+        if (frame == NULL) {
+            // counted as lost, like a probe dropped on air
+            return wait_ms;
+        }
+        // stamped last so the RTT covers the TX queue but not the code above
+        uint32_t ts_tx = get_ts_us();
+        buff[5] = (uint8_t) (ts_tx & 0xFF);
+        buff[6] = (uint8_t) ((ts_tx >> 8) & 0xFF);
+        buff[7] = (uint8_t) ((ts_tx >> 16) & 0xFF);
+        buff[8] = (uint8_t) (ts_tx >> 24);
+        frame->dst_mac = mac;
+        memcpy(frame->data, buff, nb);
+        frame->nb = nb;
+        ag_comm_tx(ctx, frame);
+    }
+    return wait_ms;
+}
+
+/**
+ * @brief answer a probe, the packet goes back unchanged but for its type
+ */
+void ag_ping_rx(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    if (frame->nb < AG_PKT_ECHO_NB) {
+        return;
+    }
+
+    AG_FRAME_L0 *reply = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_CMD);
+    if (reply == NULL) {
+        // counted as lost by the sender
+        return;
+    }
+    reply->dst_mac = frame->src_mac;
+    memcpy(reply->data, frame->data, frame->nb);
+    reply->data[1] = AG_PKT_TYPE_ECHO_REPLY;
+    reply->nb = frame->nb;
+    ag_comm_tx(ctx, reply);
+}
+
+void ag_ping_rx_reply(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    if (frame->nb < AG_PKT_ECHO_NB) {
+        return;
+    }
+
+    uint16_t seq = (uint16_t) (frame->data[3] | (frame->data[4] << 8));
+    uint32_t ts_tx = (uint32_t) frame->data[5] | ((uint32_t) frame->data[6] << 8)
+                     | ((uint32_t) frame->data[7] << 16) | ((uint32_t) frame->data[8] << 24);
+    int done = 0;
+
+    P_PING_LOCK(ctx);
+    if (((ctx->ping.run.state == P_PING_SEND) || (ctx->ping.run.state == P_PING_WAIT))
+            && (ctx->ping.run.mac == frame->src_mac) && (ctx->ping.run.run_id == frame->data[2])
+            && (seq < ctx->ping.run.sent)) {
+        uint8_t bit = (uint8_t) (1 << (seq % 8));
+        if ((ctx->ping.run.acked[seq / 8] & bit) != 0) {
+            ctx->ping.run.dup ++;
+        } else {
+            ctx->ping.run.acked[seq / 8] |= bit;
+            ctx->ping.run.rtt[ctx->ping.run.rcvd] = frame->ts - ts_tx;
+            ctx->ping.run.rcvd ++;
+            if ((ctx->ping.run.state == P_PING_WAIT) && (ctx->ping.run.rcvd == ctx->ping.run.cnt)) {
+                ctx->ping.run.state = P_PING_DONE;
+                done = 1;
+            }
+        }
+    }
+    P_PING_UNLOCK(ctx);
+
+    if (done != 0) {
+        ag_waiter_wake(&ctx->ping.waiter);
+    }
+}
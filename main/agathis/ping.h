@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AGATHIS_PING_T3HQ8VN5BZ2MXK7C
+#define AGATHIS_PING_T3HQ8VN5BZ2MXK7C
+/** @file */
+
+#include <stdint.h>
+
+#include "comm.h"
+#include "defs.h"
+
+#define AG_PING_CNT_MAX         100     /**< probes per run */
+#define AG_PING_INTERVAL_MIN_MS 1
+#define AG_PING_INTERVAL_MAX_MS 10000
+#define AG_PING_TIMEOUT_MS      1000    /**< wait for the replies after the last probe */
+#define AG_PING_HIST_CNT        12      /**< RTT buckets, the last one has no upper bound */
+#define AG_PING_HIST_BASE_US    250     /**< upper bound of the first bucket, doubled for each next one */
+
+typedef enum {
+    AG_PING_STS_PENDING,
+    AG_PING_STS_DONE,       /**< all probes sent and answered or timed out */
+    AG_PING_STS_TIMEOUT,    /**< run abandoned by ag_ping_wait(), partial results */
+    AG_PING_STS_ERROR,      /**< invalid handle */
+} AG_PING_STS_t;
+
+/**
+ * @brief outcome of a run started with ag_ping_start(), RTT in us
+ */
+typedef struct {
+    uint8_t sts;        /**< AG_PING_STS_t */
+    uint16_t sent;      /**< probes sent */
+    uint16_t rcvd;      /**< probes answered */
+    uint16_t dup;       /**< replies received twice */
+    uint32_t min;
+    uint32_t avg;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t max;
+    uint16_t hist[AG_PING_HIST_CNT];
+} AG_PING_RESULT_t;
+
+/**
+ * @brief probe run, only one at a time
+ */
+typedef struct {
+    HW_MAC_t mac;
+    uint8_t state;
+    uint8_t gen;
+    uint8_t run_id;         /**< tells the replies of an old run apart */
+    uint8_t size;           /**< probe length on air */
+    uint16_t cnt;
+    uint16_t sent;
+    uint16_t rcvd;
+    uint16_t dup;
+    uint32_t interval;      /**< between probes in ms */
+    uint32_t ts_next;       /**< next probe, or end of the run while waiting, in ms */
+    uint8_t acked[(AG_PING_CNT_MAX + 7) / 8];   /**< bitmap of the probes answered */
+    uint32_t rtt[AG_PING_CNT_MAX];              /**< in the order the replies arrived */
+} AG_PING_RUN_t;
+
+typedef struct {
+    AG_PING_RUN_t run;
+    uint32_t sorted[AG_PING_CNT_MAX];   /**< samples sorted by ag_ping_wait(), outside the lock */
+    AG_WAITER_t waiter;                 /**< task in ag_ping_wait() */
+    AG_LOCK_t mux;
+} AG_PING_STATE_t;
+
+void ag_ping_init(AG_CTX_t *ctx);
+
+int ag_ping_start(AG_CTX_t *ctx, HW_MAC_t mac, uint16_t cnt, uint32_t interval_ms, uint8_t size);
+
+AG_PING_STS_t ag_ping_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms, AG_PING_RESULT_t *res);
+
+uint32_t ag_ping_main(AG_CTX_t *ctx);
+
+void ag_ping_rx(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+void ag_ping_rx_reply(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+#endif /* AGATHIS_PING_T3HQ8VN5BZ2MXK7C */
@@ -0,0 +1,583 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "rcmd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "base.h"
+#include "ctx.h"
+#include "../hw/misc.h"
+
+#define P_RCMD_FREE     0
+#define P_RCMD_WAIT     1   /**< waiting for the ACK */
+#define P_RCMD_DONE     2   /**< finished, waiting for ag_rcmd_wait(ctx) */
+
+#if defined(ESP_PLATFORM)
+#define P_RCMD_LOCK(ctx)    taskENTER_CRITICAL(&(ctx)->rcmd.mux)
+#define P_RCMD_UNLOCK(ctx)  taskEXIT_CRITICAL(&(ctx)->rcmd.mux)
+#elif defined(__linux__)
+#define P_RCMD_LOCK(ctx)    pthread_mutex_lock(&(ctx)->rcmd.mux)
+#define P_RCMD_UNLOCK(ctx)  pthread_mutex_unlock(&(ctx)->rcmd.mux)
+#endif
+
+void ag_rcmd_init(AG_CTX_t *ctx) {
+    ctx->rcmd.rto = AG_RCMD_RTO_INIT_MS;
+    ag_lock_init(&ctx->rcmd.mux);
+    ag_waiter_init(&ctx->rcmd.waiter);
+}
+
+static uint16_t p_frame_seq(const AG_FRAME_L0 *frame) {
+    return (uint16_t) (frame->data[3] | (frame->data[4] << 8));
+}
+
+static void p_rcmd_tx(AG_CTX_t *ctx, const AG_RCMD_PEND_t *pend) {
+    AG_FRAME_L0 *frame = ag_comm_get_tx_frame(ctx, pend->prio);
+    if (frame == NULL) {
+        // counts as a lost transmission, the retransmit timer takes care of it
+        return;
+    }
+
+    frame->dst_mac = pend->mac;
+    frame->data[0] = AG_PROTO_VER1;
+    frame->data[1] = AG_PKT_TYPE_CMD;
+    frame->data[2] = pend->cmd;
+    frame->data[3] = (uint8_t) (pend->seq & 0xFF);
+    frame->data[4] = (uint8_t) (pend->seq >> 8);
+    frame->nb = AG_PKT_CMD_NB;
+    if (pend->grp != 0) {
+        frame->data[1] = AG_PKT_TYPE_GCMD;
+        frame->data[5] = pend->grp_type;
+        frame->data[6] = pend->grp_arg;
+        frame->nb = AG_PKT_GCMD_NB;
+    }
+    ag_comm_tx(ctx, frame);
+}
+
+static int p_map_test(const uint32_t *map, int idx) {
+    return (map[idx / 32] & (1UL << (idx % 32))) != 0;
+}
+
+static void p_map_set(uint32_t *map, int idx) {
+    map[idx / 32] |= 1UL << (idx % 32);
+}
+
+static int p_mac_cmp(const void *a, const void *b) {
+    HW_MAC_t mac_a = *(const HW_MAC_t *) a;
+    HW_MAC_t mac_b = *(const HW_MAC_t *) b;
+
+    return (mac_a > mac_b) - (mac_a < mac_b);
+}
+
+/**
+ * @return position of mac in the targets of a group command or -1
+ */
+static int p_grp_find(const AG_RCMD_GRP_t *map, uint16_t cnt, HW_MAC_t mac) {
+    int lo = 0;
+    int hi = (int) cnt - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (map->mac[mid] == mac) {
+            return mid;
+        }
+        if (map->mac[mid] < mac) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief update the RTT estimators (RFC 6298), called with the lock held
+ * @param rtt sample in us
+ */
+static void p_rcmd_rtt_sample(AG_CTX_t *ctx, uint32_t rtt) {
+    if (ctx->rcmd.srtt == 0) {
+        ctx->rcmd.srtt = rtt;
+        ctx->rcmd.rttvar = rtt / 2;
+    } else {
+        uint32_t err = (rtt > ctx->rcmd.srtt) ? (rtt - ctx->rcmd.srtt) : (ctx->rcmd.srtt - rtt);
+        ctx->rcmd.rttvar = ((3 * ctx->rcmd.rttvar) + err) / 4;
+        ctx->rcmd.srtt = ((7 * ctx->rcmd.srtt) + rtt) / 8;
+    }
+
+    uint32_t rto = (ctx->rcmd.srtt + (4 * ctx->rcmd.rttvar)) / 1000;
+    if (rto < AG_RCMD_RTO_MIN_MS) {
+        rto = AG_RCMD_RTO_MIN_MS;
+    } else if (rto > AG_RCMD_RTO_MAX_MS) {
+        rto = AG_RCMD_RTO_MAX_MS;
+    }
+    ctx->rcmd.rto = rto;
+}
+
+static void p_rcmd_finish(AG_RCMD_PEND_t *pend, AG_RCMD_STS_t sts) {
+    pend->res.sts = (uint8_t) sts;
+    pend->state = P_RCMD_DONE;
+}
+
+/**
+ * @brief take a free pending entry and send the command a first time
+ *
+ * @return handle or -1
+ */
+static int p_rcmd_start(AG_CTX_t *ctx, HW_MAC_t mac, uint8_t cmd, uint8_t prio,
+                        uint8_t grp, uint8_t grp_type, uint8_t grp_arg) {
+    AG_RCMD_PEND_t *pend = NULL;
+    AG_RCMD_PEND_t first;
+    int hndl = -1;
+
+    P_RCMD_LOCK(ctx);
+    for (int i = 0; i < AG_RCMD_PEND_MAX; i++) {
+        if (ctx->rcmd.pend[i].state == P_RCMD_FREE) {
+            pend = &ctx->rcmd.pend[i];
+            hndl = (pend->gen << 8) | i;
+            break;
+        }
+    }
+    if (pend != NULL) {
+        if (ctx->rcmd.seq == 0) {
+            // random start so a restarted master does not look like a duplicate
+            ctx->rcmd.seq = (uint16_t) get_rand_u32();
+        }
+        ctx->rcmd.seq ++;
+        if (ctx->rcmd.seq == 0) {
+            ctx->rcmd.seq = 1;
+        }
+
+        pend->mac = mac;
+        pend->seq = ctx->rcmd.seq;
+        pend->cmd = cmd;
+        pend->prio = prio;
+        pend->state = P_RCMD_WAIT;
+        pend->grp = grp;
+        pend->grp_type = grp_type;
+        pend->grp_arg = grp_arg;
+        pend->missing = 0;
+        if (grp != 0) {
+            AG_RCMD_GRP_t *map = &ctx->rcmd.grp[pend - ctx->rcmd.pend];
+            memset(map->acked, 0, sizeof (map->acked));
+            for (int i = 0; i < AG_MC_MAX_CNT; i++) {
+                if (ag_grp_match_remote(ctx, i, grp_type, grp_arg)) {
+                    map->mac[pend->missing] = ctx->remote_mods[i].mac;
+                    pend->missing ++;
+                }
+            }
+            qsort(map->mac, pend->missing, sizeof (HW_MAC_t), p_mac_cmp);
+        }
+        pend->res.sts = AG_RCMD_STS_PENDING;
+        pend->res.result = (grp != 0) ? MC_CMD_OK : MC_CMD_FAIL;
+        pend->res.tries = 1;
+        pend->res.targets = pend->missing;
+        pend->res.acked = 0;
+        pend->res.rtt = 0;
+        pend->ts_first = get_ts_us();
+        pend->ts_last = pend->ts_first;
+        pend->rto = ctx->rcmd.rto;
+        ctx->rcmd.stats.tx ++;
+        first = *pend;
+        if ((grp != 0) && (pend->missing == 0)) {
+            // nobody known to ACK, one transmission covers the MCs not heard from yet
+            p_rcmd_finish(pend, AG_RCMD_STS_DONE);
+        }
+    }
+    P_RCMD_UNLOCK(ctx);
+
+    if (pend == NULL) {
+        return -1;
+    }
+
+    p_rcmd_tx(ctx, &first);
+    // task_rf has to pick up the new retransmit deadline
+    ag_comm_wake(ctx);
+    return hndl;
+}
+
+/**
+ * @brief send a command and retransmit it until it is ACKed
+ *
+ * @param mac destination
+ * @param cmd AG_CMD_*
+ * @param prio TX class, AG_TX_PRIO_t
+ * @return handle that MUST be passed to ag_rcmd_wait(), or -1
+ */
+int ag_rcmd_send(AG_CTX_t *ctx, HW_MAC_t mac, uint8_t cmd, uint8_t prio) {
+    return p_rcmd_start(ctx, mac, cmd, prio, 0, 0, 0);
+}
+
+/**
+ * @brief broadcast a command to a group of MCs in one frame
+ *
+ * The frame is retransmitted until every known MC of the group ACKed it,
+ * the MCs execute it only once.
+ * @param grp_type AG_GRP_*
+ * @param grp_arg group id for AG_GRP_ID, AG_CAP_* mask for AG_GRP_CAP
+ * @return handle that MUST be passed to ag_rcmd_wait(), or -1
+ */
+int ag_rcmd_send_group(AG_CTX_t *ctx, uint8_t grp_type, uint8_t grp_arg, uint8_t cmd, uint8_t prio) {
+    return p_rcmd_start(ctx, HW_MAC_BCAST, cmd, prio, 1, grp_type, grp_arg);
+}
+
+/**
+ * @brief wait for the outcome of a command sent with ag_rcmd_send()
+ *
+ * Do not call from task_rf, it is the one processing the ACKs.
+ * @return AG_RCMD_STS_TIMEOUT also if timeout_ms expires first, the command is dropped then
+ */
+AG_RCMD_STS_t ag_rcmd_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms, AG_RCMD_RESULT_t *res) {
+    if ((hndl < 0) || ((hndl & 0xFF) >= AG_RCMD_PEND_MAX)) {
+        return AG_RCMD_STS_ERROR;
+    }
+
+    AG_RCMD_PEND_t *pend = &ctx->rcmd.pend[hndl & 0xFF];
+    AG_RCMD_STS_t sts = AG_RCMD_STS_PENDING;
+    uint32_t ts_start = get_ts_ms();
+
+    P_RCMD_LOCK(ctx);
+    while (sts == AG_RCMD_STS_PENDING) {
+        uint32_t elapsed = get_ts_ms() - ts_start;
+
+        if ((pend->gen != (uint8_t) (hndl >> 8)) || (pend->state == P_RCMD_FREE)) {
+            sts = AG_RCMD_STS_ERROR;
+        } else if (pend->state == P_RCMD_DONE) {
+            *res = pend->res;
+            sts = (AG_RCMD_STS_t) pend->res.sts;
+            pend->state = P_RCMD_FREE;
+            pend->gen ++;
+        } else if (elapsed >= timeout_ms) {
+            // nobody waits for it anymore, stop the retransmits
+            *res = pend->res;
+            ctx->rcmd.stats.timeout ++;
+            pend->state = P_RCMD_FREE;
+            pend->gen ++;
+            sts = AG_RCMD_STS_TIMEOUT;
+        } else {
+            // woken up by the ACK or the last retransmit timing out
+            ag_waiter_wait(&ctx->rcmd.waiter, &ctx->rcmd.mux, timeout_ms - elapsed);
+        }
+    }
+    P_RCMD_UNLOCK(ctx);
+    return sts;
+}
+
+/**
+ * @brief retransmit the commands that were not ACKed in time, called from task_rf
+ *
+ * @return time in ms until the next retransmit is due, UINT32_MAX if none
+ */
+uint32_t ag_rcmd_main(AG_CTX_t *ctx) {
+    AG_RCMD_PEND_t retx[AG_RCMD_PEND_MAX];
+    uint8_t n_retx = 0;
+    uint8_t n_done = 0;
+    uint32_t wait_ms = UINT32_MAX;
+
+    P_RCMD_LOCK(ctx);
+    uint32_t ts_now = get_ts_us();
+    for (int i = 0; i < AG_RCMD_PEND_MAX; i++) {
+        AG_RCMD_PEND_t *pend = &ctx->rcmd.pend[i];
+        if (pend->state != P_RCMD_WAIT) {
+            continue;
+        }
+
+        uint32_t elapsed = (ts_now - pend->ts_last) / 1000;
+        if (elapsed < pend->rto) {
+            if ((pend->rto - elapsed) < wait_ms) {
+                wait_ms = pend->rto - elapsed;
+            }
+            continue;
+        }
+
+        if (pend->res.tries >= AG_RCMD_TRY_MAX) {
+            ctx->rcmd.stats.timeout ++;
+            p_rcmd_finish(pend, AG_RCMD_STS_TIMEOUT);
+            n_done ++;
+            continue;
+        }
+
+        // exponential backoff
+        pend->rto = ((pend->rto * 2) > AG_RCMD_RTO_MAX_MS) ? AG_RCMD_RTO_MAX_MS : (pend->rto * 2);
+        pend->ts_last = ts_now;
+        pend->res.tries ++;
+        ctx->rcmd.stats.retx ++;
+        retx[n_retx ++] = *pend;
+        if (pend->rto < wait_ms) {
+            wait_ms = pend->rto;
+        }
+    }
+    P_RCMD_UNLOCK(ctx);
+
+    if (n_done != 0) {
+        ag_waiter_wake(&ctx->rcmd.waiter);
+    }
+    for (int i = 0; i < n_retx; i++) {
+        p_rcmd_tx(ctx, &retx[i]);
+    }
+    return wait_ms;
+}
+
+/**
+ * @brief count the ACK of one target of a group command, called with the lock held
+ */
+static void p_rcmd_rx_ack_grp(AG_CTX_t *ctx, AG_RCMD_PEND_t *pend, const AG_FRAME_L0 *frame) {
+    AG_RCMD_GRP_t *map = &ctx->rcmd.grp[pend - ctx->rcmd.pend];
+    int idx = p_grp_find(map, pend->res.targets, frame->src_mac);
+    if ((idx < 0) || p_map_test(map->acked, idx)) {
+        // not known when the command was sent or retransmitted ACK
+        return;
+    }
+
+    p_map_set(map->acked, idx);
+    pend->res.acked ++;
+    pend->missing --;
+    if (frame->data[5] != MC_CMD_OK) {
+        pend->res.result = frame->data[5];
+    }
+    if (pend->res.tries == 1) {
+        ag_link_rtt(ctx, frame->src_mac, frame->ts - pend->ts_last);
+    }
+    pend->res.rtt = frame->ts - pend->ts_first;
+    ctx->rcmd.stats.ack ++;
+    if (pend->missing == 0) {
+        p_rcmd_finish(pend, AG_RCMD_STS_DONE);
+    }
+}
+
+/**
+ * @brief match an ACK to the pending command
+ */
+void ag_rcmd_rx_ack(AG_CTX_t *ctx, AG_FRAME_L0 *frame) {
+    uint16_t seq = p_frame_seq(frame);
+    int done = 0;
+
+    P_RCMD_LOCK(ctx);
+    for (int i = 0; i < AG_RCMD_PEND_MAX; i++) {
+        AG_RCMD_PEND_t *pend = &ctx->rcmd.pend[i];
+        if ((pend->state != P_RCMD_WAIT) || (pend->seq != seq)) {
+            continue;
+        }
+        if (pend->grp != 0) {
+            p_rcmd_rx_ack_grp(ctx, pend, frame);
+            done = (pend->state == P_RCMD_DONE);
+            break;
+        }
+        if (pend->mac != frame->src_mac) {
+            continue;
+        }
+
+        // Karn: only unambiguous samples feed the estimator
+        if (pend->res.tries == 1) {
+            p_rcmd_rtt_sample(ctx, frame->ts - pend->ts_last);
+            ag_link_rtt(ctx, frame->src_mac, frame->ts - pend->ts_last);
+        }
+        pend->res.result = frame->data[5];
+        pend->res.rtt = frame->ts - pend->ts_first;
+        ctx->rcmd.stats.ack ++;
+        p_rcmd_finish(pend, AG_RCMD_STS_DONE);
+        done = 1;
+        break;
+    }
+    P_RCMD_UNLOCK(ctx);
+
+    if (done != 0) {
+        ag_waiter_wake(&ctx->rcmd.waiter);
+    }
+}
+
+/**
+ * @brief remembered commands of the sender, called from task_rf
+ *
+ * @param add take a free or the least recent entry if the sender has none
+ * @return entry or NULL
+ */
+static AG_RCMD_RX_SRC_t *p_rcmd_rx_src(AG_CTX_t *ctx, HW_MAC_t mac, int add) {
+    AG_RCMD_RX_SRC_t *old = NULL;
+    uint32_t ts_now = get_ts_ms();
+
+    for (int i = 0; i < AG_RCMD_RX_SRC_MAX; i++) {
+        AG_RCMD_RX_SRC_t *src = &ctx->rcmd.rx_src[i];
+        if ((src->mac != HW_MAC_NONE) && ((ts_now - src->ts_seen) >= AG_RCMD_RX_AGE_MS)) {
+            // silent long enough to have restarted
+            src->mac = HW_MAC_NONE;
+        }
+        if ((src->mac == mac) && (mac != HW_MAC_NONE)) {
+            return src;
+        }
+        if ((old == NULL) || ((old->mac != HW_MAC_NONE)
+                && ((src->mac == HW_MAC_NONE) || ((int32_t) (src->ts_seen - old->ts_seen) < 0)))) {
+            old = src;
+        }
+    }
+    if (add == 0) {
+        return NULL;
+    }
+
+    memset(old, 0, sizeof (AG_RCMD_RX_SRC_t));
+    old->mac = mac;
+    return old;
+}
+
+/**
+ * @return index of seq in the remembered commands or -1
+ */
+static int p_rcmd_rx_find(const AG_RCMD_RX_SRC_t *src, uint16_t seq) {
+    for (int i = 0; i < src->cnt; i++) {
+        if (src->seq[i] == seq) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return 1 if seq is not remembered but not newer than a forgotten command
+ */
+static int p_rcmd_rx_stale(const AG_RCMD_RX_SRC_t *src, uint16_t seq) {
+    return (src->forgot != 0) && ((int16_t) (seq - src->seq_floor) <= 0);
+}
+
+/**
+ * @brief check if a received command must not be executed
+ *
+ * @param result set to the result of the first execution, MC_CMD_FAIL for a stale command
+ * @return 1 if the command is a duplicate or stale
+ */
+int ag_rcmd_rx_dup(AG_CTX_t *ctx, AG_FRAME_L0 *frame, uint8_t *result) {
+    uint16_t seq = p_frame_seq(frame);
+    if (seq == 0) {
+        return 0;
+    }
+
+    AG_RCMD_RX_SRC_t *src = p_rcmd_rx_src(ctx, frame->src_mac, 0);
+    if (src == NULL) {
+        return 0;
+    }
+    int i = p_rcmd_rx_find(src, seq);
+    if ((i < 0) && (p_rcmd_rx_stale(src, seq) == 0)) {
+        return 0;
+    }
+
+    *result = (i >= 0) ? src->res[i] : MC_CMD_FAIL;
+    src->ts_seen = get_ts_ms();
+    P_RCMD_LOCK(ctx);
+    if (i >= 0) {
+        ctx->rcmd.stats.dup ++;
+    } else {
+        ctx->rcmd.stats.stale ++;
+    }
+    P_RCMD_UNLOCK(ctx);
+    return 1;
+}
+
+/**
+ * @brief remember the result of a received command and ACK it
+ *
+ * @param track 1 to get a handle for ag_comm_tx_flush(), the ACK is only queued otherwise
+ * @return handle, 0 if queued without one, -1 if not sent
+ */
+int ag_rcmd_tx_ack(AG_CTX_t *ctx, AG_FRAME_L0 *frame, uint8_t result, int track) {
+    uint16_t seq = p_frame_seq(frame);
+    if (seq == 0) {
+        // sender does not expect an ACK
+        return -1;
+    }
+
+    AG_RCMD_RX_SRC_t *src = p_rcmd_rx_src(ctx, frame->src_mac, 1);
+    if ((p_rcmd_rx_find(src, seq) < 0) && (p_rcmd_rx_stale(src, seq) == 0)) {
+        if (src->cnt < AG_RCMD_RX_WIN) {
+            src->cnt ++;
+        } else if ((src->forgot == 0) || ((int16_t) (src->seq[src->pos] - src->seq_floor) > 0)) {
+            src->seq_floor = src->seq[src->pos];
+            src->forgot = 1;
+        }
+        src->seq[src->pos] = seq;
+        src->res[src->pos] = result;
+        src->pos = (uint8_t) ((src->pos + 1) % AG_RCMD_RX_WIN);
+    }
+    src->ts_seen = get_ts_ms();
+
+    AG_FRAME_L0 *ack = ag_comm_get_tx_frame(ctx, AG_TX_PRIO_CMD);
+    if (ack == NULL) {
+        // the sender will retransmit
+        return -1;
+    }
+    ack->dst_mac = frame->src_mac;
+    ack->data[0] = AG_PROTO_VER1;
+    ack->data[1] = AG_PKT_TYPE_ACK;
+    ack->data[2] = frame->data[2];
+    ack->data[3] = frame->data[3];
+    ack->data[4] = frame->data[4];
+    ack->data[5] = result;
+    ack->nb = AG_PKT_ACK_NB;
+    if (track != 0) {
+        return ag_comm_tx_submit(ctx, ack);
+    }
+    return ag_comm_tx(ctx, ack);
+}
+
+/**
+ * @brief forget the commands of a restarted MC, called from task_rf
+ */
+void ag_rcmd_rx_forget(AG_CTX_t *ctx, HW_MAC_t mac) {
+    AG_RCMD_RX_SRC_t *src = p_rcmd_rx_src(ctx, mac, 0);
+    if (src != NULL) {
+        src->mac = HW_MAC_NONE;
+    }
+}
+
+/**
+ * @brief an MC left, a reset sent to it is done even if its ACK was lost, called from task_rf
+ */
+void ag_rcmd_rx_leave(AG_CTX_t *ctx, HW_MAC_t mac) {
+    int done = 0;
+
+    P_RCMD_LOCK(ctx);
+    uint32_t ts_now = get_ts_us();
+    for (int i = 0; i < AG_RCMD_PEND_MAX; i++) {
+        AG_RCMD_PEND_t *pend = &ctx->rcmd.pend[i];
+        if ((pend->state != P_RCMD_WAIT) || (pend->cmd != AG_CMD_RESET)) {
+            continue;
+        }
+        if (pend->grp != 0) {
+            int idx = p_grp_find(&ctx->rcmd.grp[i], pend->res.targets, mac);
+            if ((idx < 0) || p_map_test(ctx->rcmd.grp[i].acked, idx)) {
+                continue;
+            }
+            p_map_set(ctx->rcmd.grp[i].acked, idx);
+            pend->res.acked ++;
+            pend->missing --;
+            pend->res.rtt = ts_now - pend->ts_first;
+            if (pend->missing == 0) {
+                p_rcmd_finish(pend, AG_RCMD_STS_DONE);
+                done = 1;
+            }
+        } else if (pend->mac == mac) {
+            pend->res.result = MC_CMD_OK;
+            pend->res.rtt = ts_now - pend->ts_first;
+            p_rcmd_finish(pend, AG_RCMD_STS_DONE);
+            done = 1;
+        }
+    }
+    P_RCMD_UNLOCK(ctx);
+
+    if (done != 0) {
+        ag_waiter_wake(&ctx->rcmd.waiter);
+    }
+}
+
+void ag_rcmd_get_stats(AG_CTX_t *ctx, AG_RCMD_STATS_t *stats) {
+    P_RCMD_LOCK(ctx);
+    *stats = ctx->rcmd.stats;
+    stats->srtt = ctx->rcmd.srtt;
+    stats->rto = ctx->rcmd.rto;
+    P_RCMD_UNLOCK(ctx);
+}
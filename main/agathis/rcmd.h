@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AGATHIS_RCMD_MW4E7XK2QJ9TBS5D
+#define AGATHIS_RCMD_MW4E7XK2QJ9TBS5D
+/** @file */
+
+#include <stdint.h>
+
+#include "base.h"
+#include "comm.h"
+
+#define AG_RCMD_PEND_MAX        8       /**< commands waiting for an ACK */
+#define AG_RCMD_TRY_MAX         6       /**< transmissions before giving up */
+#define AG_RCMD_RTO_INIT_MS     50      /**< retransmit timeout before the first RTT sample */
+#define AG_RCMD_RTO_MIN_MS      10
+#define AG_RCMD_RTO_MAX_MS      1000
+#define AG_RCMD_RX_SRC_MAX      4       /**< senders whose last commands are remembered */
+#define AG_RCMD_RX_WIN          8       /**< commands remembered per sender */
+#define AG_RCMD_RX_AGE_MS       10000   /**< a sender silent this long starts over, longer than its retransmits */
+
+typedef enum {
+    AG_RCMD_STS_PENDING,
+    AG_RCMD_STS_DONE,       /**< ACK received, see result */
+    AG_RCMD_STS_TIMEOUT,    /**< no ACK (not from every target) after AG_RCMD_TRY_MAX transmissions */
+    AG_RCMD_STS_ERROR,      /**< invalid handle */
+} AG_RCMD_STS_t;
+
+/**
+ * @brief outcome of a command sent with ag_rcmd_send()
+ */
+typedef struct {
+    uint8_t sts;        /**< AG_RCMD_STS_t */
+    uint8_t result;     /**< AG_MC_CMD_STATUS_t reported by the target */
+    uint8_t tries;      /**< number of transmissions */
+    uint16_t targets;   /**< group commands: known MCs in the group when it was sent */
+    uint16_t acked;     /**< group commands: targets that ACKed */
+    uint32_t rtt;       /**< first TX to ACK (to the last ACK for group commands) in us */
+} AG_RCMD_RESULT_t;
+
+typedef struct {
+    uint32_t tx;        /**< commands sent */
+    uint32_t retx;      /**< retransmissions */
+    uint32_t ack;       /**< ACKs matched to a pending command */
+    uint32_t timeout;   /**< commands without ACK */
+    uint32_t dup;       /**< duplicate commands received */
+    uint32_t stale;     /**< commands received too late to tell if they were executed */
+    uint32_t srtt;      /**< smoothed RTT in us */
+    uint32_t rto;       /**< current retransmit timeout in ms */
+} AG_RCMD_STATS_t;
+
+#define AG_RCMD_MAP_LEN ((AG_MC_MAX_CNT + 31) / 32)     /**< words of a target bitmap */
+
+/**
+ * @brief command waiting for an ACK
+ */
+typedef struct {
+    HW_MAC_t mac;
+    uint16_t seq;
+    uint8_t cmd;
+    uint8_t prio;
+    uint8_t state;
+    uint8_t gen;
+    uint8_t grp;        /**< 1 for a group command */
+    uint8_t grp_type;   /**< AG_GRP_* */
+    uint8_t grp_arg;
+    uint16_t missing;   /**< targets that did not ACK yet */
+    AG_RCMD_RESULT_t res;
+    uint32_t ts_first;  /**< first TX in us */
+    uint32_t ts_last;   /**< last TX in us */
+    uint32_t rto;       /**< retransmit timeout in ms */
+} AG_RCMD_PEND_t;
+
+/**
+ * @brief targets of a group command, kept out of AG_RCMD_PEND_t so copies stay small
+ *
+ * The MACs are taken when the command is sent, an MC that leaves or ages out
+ * of remote_mods meanwhile still gets its ACK counted.
+ */
+typedef struct {
+    HW_MAC_t mac[AG_MC_MAX_CNT];        /**< expected to ACK, sorted */
+    uint32_t acked[AG_RCMD_MAP_LEN];    /**< by position in mac */
+} AG_RCMD_GRP_t;
+
+/**
+ * @brief last commands executed for one sender, only used by task_rf
+ *
+ * A copy of a remembered command gets the result of its execution, a command
+ * older than the ones forgotten is refused: it may have been executed already.
+ */
+typedef struct {
+    HW_MAC_t mac;                   /**< HW_MAC_NONE if the entry is free */
+    uint16_t seq[AG_RCMD_RX_WIN];
+    uint8_t res[AG_RCMD_RX_WIN];
+    uint8_t cnt;                    /**< valid entries of seq and res */
+    uint8_t pos;                    /**< next entry to overwrite */
+    uint8_t forgot;                 /**< seq_floor is valid */
+    uint16_t seq_floor;             /**< newest sequence number forgotten */
+    uint32_t ts_seen;               /**< last command in ms */
+} AG_RCMD_RX_SRC_t;
+
+typedef struct {
+    AG_RCMD_PEND_t pend[AG_RCMD_PEND_MAX];
+    AG_RCMD_GRP_t grp[AG_RCMD_PEND_MAX];
+    uint16_t seq;
+    uint32_t srtt;      /**< smoothed RTT in us, 0 until the first sample */
+    uint32_t rttvar;    /**< RTT variation in us */
+    uint32_t rto;       /**< retransmit timeout for new commands in ms */
+    AG_RCMD_RX_SRC_t rx_src[AG_RCMD_RX_SRC_MAX];
+    AG_RCMD_STATS_t stats;
+    AG_WAITER_t waiter;     /**< task in ag_rcmd_wait() */
+    AG_LOCK_t mux;
+} AG_RCMD_STATE_t;
+
+void ag_rcmd_init(AG_CTX_t *ctx);
+
+int ag_rcmd_send(AG_CTX_t *ctx, HW_MAC_t mac, uint8_t cmd, uint8_t prio);
+
+int ag_rcmd_send_group(AG_CTX_t *ctx, uint8_t grp_type, uint8_t grp_arg, uint8_t cmd, uint8_t prio);
+
+AG_RCMD_STS_t ag_rcmd_wait(AG_CTX_t *ctx, int hndl, uint32_t timeout_ms, AG_RCMD_RESULT_t *res);
+
+uint32_t ag_rcmd_main(AG_CTX_t *ctx);
+
+void ag_rcmd_rx_ack(AG_CTX_t *ctx, AG_FRAME_L0 *frame);
+
+int ag_rcmd_rx_dup(AG_CTX_t *ctx, AG_FRAME_L0 *frame, uint8_t *result);
+
+int ag_rcmd_tx_ack(AG_CTX_t *ctx, AG_FRAME_L0 *frame, uint8_t result, int track);
+
+void ag_rcmd_rx_forget(AG_CTX_t *ctx, HW_MAC_t mac);
+
+void ag_rcmd_rx_leave(AG_CTX_t *ctx, HW_MAC_t mac);
+
+void ag_rcmd_get_stats(AG_CTX_t *ctx, AG_RCMD_STATS_t *stats);
+
+#endif /* AGATHIS_RCMD_MW4E7XK2QJ9TBS5D */
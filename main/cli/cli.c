@@ -35,37 +35,34 @@ uint8_t p_CLI_GetChar(void) {
 }
 #endif
 
-static char p_CLI_BUFF[CLI_BUFF_SIZE + 1] = { 0 };
-static char p_CLI_PROMPT[CLI_PROMPT_SIZE] = { 0 };
-static uint8_t p_no_cmd = 0;
-
-static CLI_PARSED_CMD_t p_PARSED_CMD = {"\0", 0, {"", "", "", ""}};
-
-static CLI_ENV_t p_CLI_ENV;
-
-char * CLI_getPrompt(void) {
-    return p_CLI_PROMPT;
+char * CLI_getPrompt(CLI_CTX_t *cli) {
+    return cli->prompt;
 }
 
-void CLI_setPrompt(const char *str) {
-    strncpy(p_CLI_PROMPT, str, CLI_PROMPT_SIZE);
+void CLI_setPrompt(CLI_CTX_t *cli, const char *str) {
+    strncpy(cli->prompt, str, CLI_PROMPT_SIZE);
 }
 
 static CLI_CMD_t p_cmd_root[3]  = {
     {"info", "", "show module info", &cmd_info},
-    {"set",  "", "change configuration", &cmd_set},
+    {"set",  "<master|group n|prio> <on|off|n>", "change configuration", &cmd_set},
     {"save", "", "save configuration", &cmd_save},
 };
 static CLI_FOLDER_t p_f_root = {"", sizeof(p_cmd_root) / sizeof(p_cmd_root[0]), p_cmd_root,
                                 NULL, NULL, NULL, NULL, NULL
                                };
 
-static CLI_CMD_t p_cmd_mod[5]  = {
+static CLI_CMD_t p_cmd_mod[10]  = {
     {"info", "", "show modules", &cmd_mod_info},
-    {"id", "", "identify module", &cmd_mod_id},
-    {"reset", "", "reset module", &cmd_mod_reset},
-    {"on", "", "power on module", &cmd_mod_power_on},
-    {"off", "", "power off module", &cmd_mod_power_off},
+    {"id", "<id|all|group=n|cap=mask>", "identify module", &cmd_mod_id},
+    {"reset", "<id|all|group=n|cap=mask>", "reset module", &cmd_mod_reset},
+    {"on", "<id|all|group=n|cap=mask>", "power on module", &cmd_mod_power_on},
+    {"off", "<id|all|group=n|cap=mask>", "power off module", &cmd_mod_power_off},
+    {"stats", "", "show comm stats", &cmd_mod_stats},
+    {"link", "", "show link quality", &cmd_mod_link},
+    {"xfer", "<id> [size]", "send test message", &cmd_mod_xfer},
+    {"ping", "<id> [count] [interval] [size]", "measure RTT", &cmd_mod_ping},
+    {"alarm", "", "show alarms", &cmd_mod_alarm},
 };
 static CLI_FOLDER_t p_f_mod = {"mod", sizeof(p_cmd_mod) / sizeof(p_cmd_mod[0]), p_cmd_mod,
                                &p_cmd_mod[0], NULL, NULL, NULL, NULL
@@ -93,9 +90,12 @@ static CLI_FOLDER_t p_f_jtag = {"jtag", 0, NULL, NULL, NULL, NULL, NULL, NULL};
 static CLI_FOLDER_t p_f_usb  = {"usb", 0, NULL, NULL, NULL, NULL, NULL, NULL};
 static CLI_FOLDER_t p_f_pcie = {"pcie", 0, NULL, NULL, NULL, NULL, NULL, NULL};
 
-void CLI_init(void) {
+void CLI_init(CLI_CTX_t *cli, AG_CTX_t *ag) {
     unsigned int i = 0;
 
+    memset(cli, 0, sizeof (CLI_CTX_t));
+    cli->ag = ag;
+
     p_f_root.parent = &p_f_root;
     p_f_root.child = &p_f_lcl;
 
@@ -129,21 +129,20 @@ void CLI_init(void) {
     p_f_pcie.left = &p_f_usb;
 
     for (i = 0; i < CLI_TREE_DEPTH_MAX; i++) {
-        strncpy(p_CLI_ENV.path[i], "\0", CLI_BASE_NAME_SIZE);
+        strncpy(cli->env.path[i], "\0", CLI_BASE_NAME_SIZE);
     }
-    p_CLI_ENV.pathIdx = 0;
-    p_CLI_ENV.folder = &p_f_root;
+    cli->env.pathIdx = 0;
+    cli->env.folder = &p_f_root;
 }
 
-void CLI_getCmd(void) {
+void CLI_getCmd(CLI_CTX_t *cli) {
     uint8_t byteIn;
     uint8_t idx = 0;
 
-    strncpy(p_CLI_BUFF, "\0", (CLI_BUFF_SIZE + 1));
+    strncpy(cli->buff, "\0", (CLI_BUFF_SIZE + 1));
     while (1) {
         if (p_CLI_IsRxReady()) {
             byteIn = p_CLI_GetChar();
-            //printf("DBG: %x\n", byteIn);
 
             // NL or CR end the command
             if ((byteIn == 10) || (byteIn == 13)) {
@@ -153,7 +152,7 @@ void CLI_getCmd(void) {
             if (byteIn == 8) {
                 if (idx > 0) {
                     idx --;
-                    p_CLI_BUFF[idx] = '\0';
+                    cli->buff[idx] = '\0';
                 }
                 continue;
             }
@@ -165,30 +164,29 @@ void CLI_getCmd(void) {
             if (idx == CLI_BUFF_SIZE) {
                 continue;
             }
-            p_CLI_BUFF[idx] = (char)byteIn;
+            cli->buff[idx] = (char)byteIn;
             idx ++;
-            p_CLI_BUFF[idx] = '\0';
+            cli->buff[idx] = '\0';
         }
     }
 }
 
-uint8_t CLI_parseCmd(void) {
-    strncpy(p_PARSED_CMD.cmd, "\0", CLI_WORD_SIZE);
-    p_PARSED_CMD.nParams = 0;
+uint8_t CLI_parseCmd(CLI_CTX_t *cli) {
+    strncpy(cli->parsed.cmd, "\0", CLI_WORD_SIZE);
+    cli->parsed.nParams = 0;
     for (uint8_t i = 0; i < CLI_WORD_CNT; i++) {
-        strncpy(p_PARSED_CMD.params[i], "\0", CLI_WORD_SIZE);
+        strncpy(cli->parsed.params[i], "\0", CLI_WORD_SIZE);
     }
 
-    //printf("DBG: parse ...\n");
     uint8_t j = 0;
     for (uint8_t i = 0; i < CLI_BUFF_SIZE; i ++) {
-        if (p_CLI_BUFF[i] == 32) {
-            p_PARSED_CMD.nParams ++;
+        if (cli->buff[i] == 32) {
+            cli->parsed.nParams ++;
             j = 0;
             continue;
         }
-        if (p_CLI_BUFF[i] == 0) {
-            p_PARSED_CMD.nParams ++;
+        if (cli->buff[i] == 0) {
+            cli->parsed.nParams ++;
             break;
         }
 
@@ -196,23 +194,23 @@ uint8_t CLI_parseCmd(void) {
             printf("ERROR parsing (size)\n");
             return 1;
         }
-        if (p_PARSED_CMD.nParams >= CLI_WORD_CNT) {
+        if (cli->parsed.nParams >= CLI_WORD_CNT) {
             printf("ERROR parsing (param)\n");
             return 2;
         }
 
-        if (p_PARSED_CMD.nParams == 0) {
-            p_PARSED_CMD.cmd[j] = p_CLI_BUFF[i];
+        if (cli->parsed.nParams == 0) {
+            cli->parsed.cmd[j] = cli->buff[i];
             j ++;
-            p_PARSED_CMD.cmd[j] = '\0';
+            cli->parsed.cmd[j] = '\0';
         } else {
-            p_PARSED_CMD.params[p_PARSED_CMD.nParams - 1][j] = p_CLI_BUFF[i];
+            cli->parsed.params[cli->parsed.nParams - 1][j] = cli->buff[i];
             j ++;
-            p_PARSED_CMD.params[p_PARSED_CMD.nParams - 1][j] = '\0';
+            cli->parsed.params[cli->parsed.nParams - 1][j] = '\0';
         }
     }
-    if (p_PARSED_CMD.nParams > 0) {
-        p_PARSED_CMD.nParams --;
+    if (cli->parsed.nParams > 0) {
+        cli->parsed.nParams --;
     }
     return 0;
 }
@@ -226,30 +224,30 @@ CLI_CMD_RETURN_t p_help(void) {
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t p_pwd(void) {
+CLI_CMD_RETURN_t p_pwd(CLI_CTX_t *cli) {
     unsigned int i = 0;
 
-    if (p_CLI_ENV.pathIdx == 0) {
+    if (cli->env.pathIdx == 0) {
         printf("/\n");
     } else {
-        for (i = 0; i < p_CLI_ENV.pathIdx; i++) {
-            printf("/%s", p_CLI_ENV.path[i]);
+        for (i = 0; i < cli->env.pathIdx; i++) {
+            printf("/%s", cli->env.path[i]);
         }
         printf("\n");
     }
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t p_ls(void) {
+CLI_CMD_RETURN_t p_ls(CLI_CTX_t *cli) {
     unsigned int i = 0;
 
-    for (i = 0; i < p_CLI_ENV.folder->nCmds; i ++) {
-        printf("    %s - %s\n", p_CLI_ENV.folder->cmds[i].cmd,
-               p_CLI_ENV.folder->cmds[i].cmdHelp);
+    for (i = 0; i < cli->env.folder->nCmds; i ++) {
+        printf("    %s - %s\n", cli->env.folder->cmds[i].cmd,
+               cli->env.folder->cmds[i].cmdHelp);
     }
 
-    if (p_CLI_ENV.folder->child != NULL) {
-        CLI_FOLDER_t *tmp = p_CLI_ENV.folder->child;
+    if (cli->env.folder->child != NULL) {
+        CLI_FOLDER_t *tmp = cli->env.folder->child;
         while (tmp != NULL) {
             printf("[+] %s\n", tmp->name);
             tmp = tmp->right;
@@ -258,72 +256,71 @@ CLI_CMD_RETURN_t p_ls(void) {
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t p_cd(void) {
-    if (p_PARSED_CMD.nParams == 0) {
-        p_CLI_ENV.folder = &p_f_root;
-        p_CLI_ENV.pathIdx = 0;
+CLI_CMD_RETURN_t p_cd(CLI_CTX_t *cli) {
+    if (cli->parsed.nParams == 0) {
+        cli->env.folder = &p_f_root;
+        cli->env.pathIdx = 0;
         return CMD_DONE;
     }
 
-    if (p_PARSED_CMD.nParams > 1) {
+    if (cli->parsed.nParams > 1) {
         return CMD_WRONG_N;
     }
 
-    if (strncmp(p_PARSED_CMD.params[0], "..", 2) == 0) {
-        p_CLI_ENV.folder = p_CLI_ENV.folder->parent;
-        p_CLI_ENV.pathIdx--;
+    if (strncmp(cli->parsed.params[0], "..", 2) == 0) {
+        cli->env.folder = cli->env.folder->parent;
+        cli->env.pathIdx--;
         return CMD_DONE;
     }
 
-    if (p_CLI_ENV.folder->child == NULL) {
-        printf("UNKNOWN path: %s\n", p_PARSED_CMD.params[0]);
+    if (cli->env.folder->child == NULL) {
+        printf("UNKNOWN path: %s\n", cli->parsed.params[0]);
         return CMD_WRONG_PARAM;
     }
 
-    CLI_FOLDER_t *tmp = p_CLI_ENV.folder->child;
+    CLI_FOLDER_t *tmp = cli->env.folder->child;
     while (tmp != NULL) {
-        if (strncmp(p_PARSED_CMD.params[0], tmp->name, CLI_BASE_NAME_SIZE) == 0) {
-            p_CLI_ENV.folder = tmp;
-            strncpy(p_CLI_ENV.path[p_CLI_ENV.pathIdx++], tmp->name, CLI_BASE_NAME_SIZE);
+        if (strncmp(cli->parsed.params[0], tmp->name, CLI_BASE_NAME_SIZE) == 0) {
+            cli->env.folder = tmp;
+            strncpy(cli->env.path[cli->env.pathIdx++], tmp->name, CLI_BASE_NAME_SIZE);
             return CMD_DONE;
         }
         tmp = tmp->right;
     }
-    printf("UNKNOWN path: %s\n", p_PARSED_CMD.params[0]);
+    printf("UNKNOWN path: %s\n", cli->parsed.params[0]);
     return CMD_DONE;
 }
 
-void CLI_execute(void) {
+void CLI_execute(CLI_CTX_t *cli) {
     unsigned int i = 0;
     CLI_CMD_RETURN_t cmdRet = CMD_NOT_FOUND;
 
-    //printf("DBG: execute %s (%d params) %d\n", p_PARSED_CMD.cmd, p_PARSED_CMD.nParams, p_CLI_ENV.folder);
     printf("\n");
-    if (strlen(p_PARSED_CMD.cmd) == 0) {
-        if (p_CLI_ENV.folder->cmdDefault == NULL) {
-            if (p_no_cmd == 4) {
+    if (strlen(cli->parsed.cmd) == 0) {
+        if (cli->env.folder->cmdDefault == NULL) {
+            if (cli->no_cmd == 4) {
                 printf("press ? for help\n");
-                p_no_cmd = 0;
+                cli->no_cmd = 0;
             } else {
-                p_no_cmd ++;
+                cli->no_cmd ++;
             }
             cmdRet = CMD_DONE;
         } else {
-            cmdRet = p_CLI_ENV.folder->cmdDefault->fptr(&p_PARSED_CMD);
+            cmdRet = cli->env.folder->cmdDefault->fptr(cli->ag, &cli->parsed);
         }
-    } else if (strncmp(p_PARSED_CMD.cmd, "?", 1) == 0) {
+    } else if (strncmp(cli->parsed.cmd, "?", 1) == 0) {
         cmdRet = p_help();
-    } else if (strncmp(p_PARSED_CMD.cmd, "pwd", 3) == 0) {
-        cmdRet = p_pwd();
-    } else if (strncmp(p_PARSED_CMD.cmd, "ls", 2) == 0) {
-        cmdRet = p_ls();
-    } else if (strncmp(p_PARSED_CMD.cmd, "cd", 2) == 0) {
-        cmdRet = p_cd();
+    } else if (strncmp(cli->parsed.cmd, "pwd", 3) == 0) {
+        cmdRet = p_pwd(cli);
+    } else if (strncmp(cli->parsed.cmd, "ls", 2) == 0) {
+        cmdRet = p_ls(cli);
+    } else if (strncmp(cli->parsed.cmd, "cd", 2) == 0) {
+        cmdRet = p_cd(cli);
     } else {
-        for (i = 0; i < p_CLI_ENV.folder->nCmds; i++) {
-            if (strncmp(p_PARSED_CMD.cmd, p_CLI_ENV.folder->cmds[i].cmd,
+        for (i = 0; i < cli->env.folder->nCmds; i++) {
+            if (strncmp(cli->parsed.cmd, cli->env.folder->cmds[i].cmd,
                         CLI_WORD_SIZE) == 0) {
-                cmdRet = p_CLI_ENV.folder->cmds[i].fptr(&p_PARSED_CMD);
+                cmdRet = cli->env.folder->cmds[i].fptr(cli->ag, &cli->parsed);
                 break;
             }
         }
@@ -333,9 +330,7 @@ void CLI_execute(void) {
         printf("UNRECOGNIZED command\n");
     } else if (cmdRet == CMD_WRONG_N) {
         printf("WRONG argument count\n");
-        //printf("  %s %s\n", p_CLI_ENV.folder->cmds[i].cmd, p_CLI_ENV.folder->cmds[i].argDesc);
     } else if (cmdRet == CMD_WRONG_PARAM) {
         printf("WRONG arguments\n");
-        //printf("  %s %s\n", p_CLI_ENV.folder->cmds[i].cmd, p_CLI_ENV.folder->cmds[i].argDesc);
     }
 }
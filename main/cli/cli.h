@@ -14,36 +14,48 @@ typedef struct {
     uint8_t pathIdx;
 } CLI_ENV_t;
 
+/**
+ * @brief state of one CLI, the commands run on the MC ag
+ */
+typedef struct {
+    char buff[CLI_BUFF_SIZE + 1];
+    char prompt[CLI_PROMPT_SIZE];
+    uint8_t no_cmd;
+    CLI_PARSED_CMD_t parsed;
+    CLI_ENV_t env;
+    AG_CTX_t *ag;
+} CLI_CTX_t;
+
 /**
  * @return get CLI prompt
  */
-char * CLI_getPrompt(void);
+char * CLI_getPrompt(CLI_CTX_t *cli);
 
 /**
  * @brief set CLI prompt
  */
-void CLI_setPrompt(const char *str);
+void CLI_setPrompt(CLI_CTX_t *cli, const char *str);
 
 /**
  * @brief init CLI library
  */
-void CLI_init(void);
+void CLI_init(CLI_CTX_t *cli, AG_CTX_t *ag);
 
 /**
  * @brief get command from UART/stdin into the internal buffer
  */
-void CLI_getCmd(void);
+void CLI_getCmd(CLI_CTX_t *cli);
 
 /**
  * @brief parse command from internal buffer
  *
  * @return 0 if no errors
  */
-uint8_t CLI_parseCmd(void);
+uint8_t CLI_parseCmd(CLI_CTX_t *cli);
 
 /**
  * @brief execute command
  */
-void CLI_execute(void);
+void CLI_execute(CLI_CTX_t *cli);
 
 #endif /* CLI_YP8GJVG3TCW7BWQW */
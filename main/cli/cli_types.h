@@ -6,6 +6,8 @@
 
 #include <stdint.h>
 
+#include "../agathis/defs.h"
+
 #define CLI_BUFF_SIZE 32    /**< max command size */
 #define CLI_WORD_CNT 4      /**< number of words for a command */
 #define CLI_WORD_SIZE 12    /**< max command word size */
@@ -31,7 +33,7 @@ typedef struct {
     const char cmd[CLI_WORD_SIZE]; /**< command */
     const char argDesc[CMD_ARG_DESC_SIZE]; /**< argument description */
     const char cmdHelp[CMD_HELP_SIZE]; /**< command help/description */
-    CLI_CMD_RETURN_t (*fptr)(CLI_PARSED_CMD_t *cmdp);
+    CLI_CMD_RETURN_t (*fptr)(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
 } CLI_CMD_t;
 
 typedef struct folder CLI_FOLDER_t;
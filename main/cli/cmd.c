@@ -6,223 +6,489 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../agathis/alarm.h"
 #include "../agathis/base.h"
 #include "../agathis/comm.h"
 #include "../agathis/config.h"
+#include "../agathis/ctx.h"
+#include "../agathis/frag.h"
+#include "../agathis/ping.h"
+#include "../agathis/rcmd.h"
 #include "../hw/storage.h"
 
-CLI_CMD_RETURN_t cmd_info(CLI_PARSED_CMD_t *cmdp) {
+#define CMD_ACK_TIMEOUT_MS 3000 /**< max wait for a command to be ACKed, covers all retransmits */
+#define CMD_XFER_TIMEOUT_MS 10000
+#define CMD_PING_CNT        10
+#define CMD_PING_INTERVAL_MS 100
+
+CLI_CMD_RETURN_t cmd_info(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
     if (cmdp->nParams != 0) {
         return CMD_WRONG_N;
     }
 
-    printf("caps = %#04x/%#04x/%#04x\n", MOD_STATE.caps_hw_ext,
-           MOD_STATE.caps_hw_int, MOD_STATE.caps_sw);
-    printf("error = %d\n", MOD_STATE.last_err);
-    printf("MFR_NAME = %s\n", MOD_STATE.mfr_name);
-    printf("MFR_PN = %s\n", MOD_STATE.mfr_pn);
-    printf("MFR_SN = %s\n", MOD_STATE.mfr_sn);
+    printf("caps = %#04x/%#04x/%#04x\n", ctx->mod_state.caps_hw_ext,
+           ctx->mod_state.caps_hw_int, ctx->mod_state.caps_sw);
+    printf("groups = %#04x\n", ctx->mod_state.groups);
+    printf("master prio = %d\n", ctx->mod_state.tmc_prio);
+    printf("error = %d\n", ctx->mod_state.last_err);
+    printf("MFR_NAME = %s\n", ctx->mod_state.mfr_name);
+    printf("MFR_PN = %s\n", ctx->mod_state.mfr_pn);
+    printf("MFR_SN = %s\n", ctx->mod_state.mfr_sn);
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_set(CLI_PARSED_CMD_t *cmdp) {
-    if (cmdp->nParams != 2) {
+CLI_CMD_RETURN_t cmd_set(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    if ((cmdp->nParams < 2) || (cmdp->nParams > 3)) {
         return CMD_WRONG_N;
     }
 
     if (strncmp(cmdp->params[0], "master", 6) == 0) {
-        if (strncmp(cmdp->params[1], "on", 2) == 0) {
-            MOD_STATE.caps_sw |= AG_CAP_SW_TMC;
-        } else {
-            MOD_STATE.caps_sw &= (uint8_t) (~AG_CAP_SW_TMC);
+        if (cmdp->nParams != 2) {
+            return CMD_WRONG_N;
+        }
+        if (ag_set_master(ctx, (strncmp(cmdp->params[1], "on", 2) == 0)) != 0) {
+            printf("master is elected, set prio 0 first\n");
+        }
+    } else if (strncmp(cmdp->params[0], "group", 5) == 0) {
+        if (cmdp->nParams != 3) {
+            return CMD_WRONG_N;
+        }
+        long grp_id = strtol(cmdp->params[1], NULL, 10);
+        if ((grp_id < 0) || (grp_id >= AG_GRP_ID_CNT)) {
+            printf("INCORRECT group (max %d)\n", (AG_GRP_ID_CNT - 1));
+            return CMD_DONE;
+        }
+        ag_set_group(ctx, (uint8_t) grp_id, (strncmp(cmdp->params[2], "on", 2) == 0));
+    } else if (strncmp(cmdp->params[0], "prio", 4) == 0) {
+        if (cmdp->nParams != 2) {
+            return CMD_WRONG_N;
+        }
+        long prio = strtol(cmdp->params[1], NULL, 10);
+        if ((prio < 0) || (prio > 0xFF)) {
+            printf("INCORRECT prio (max 255)\n");
+            return CMD_DONE;
         }
+        ag_set_tmc_prio(ctx, (uint8_t) prio);
     }
 
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_save(CLI_PARSED_CMD_t *cmdp) {
+CLI_CMD_RETURN_t cmd_save(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
 #if MOD_HAS_STORAGE
-    stor_save_state();
+    stor_save_state(ctx);
 #endif
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_mod_info(CLI_PARSED_CMD_t *cmdp) {
+CLI_CMD_RETURN_t cmd_mod_info(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
     if (cmdp->nParams != 0) {
         return CMD_WRONG_N;
     }
 
     for (int i = 0; i < AG_MC_MAX_CNT; i ++) {
-        if (REMOTE_MODS[i].last_seen == -1) {
+        int age = ag_remote_mod_age(ctx, i);
+        if (age == -1) {
             continue;
         }
-        if ((REMOTE_MODS[i].caps & AG_CAP_SW_TMC) != 0) {
-            printf("%2d - %06x:%06x M (%ds)\n", i,
-                   (unsigned int) REMOTE_MODS[i].mac[1], (unsigned int) REMOTE_MODS[i].mac[0],
-                   REMOTE_MODS[i].last_seen);
+        if ((ctx->remote_mods[i].caps & AG_CAP_SW_TMC) != 0) {
+            printf("%2d - " HW_MAC_FMT " M (%ds) type %d error %d\n", i,
+                   HW_MAC_ARG(ctx->remote_mods[i].mac), age, ctx->remote_mods[i].type, ctx->remote_mods[i].last_err);
         } else  {
-            printf("%2d - %06x:%06x (%ds)\n", i,
-                   (unsigned int) REMOTE_MODS[i].mac[1], (unsigned int) REMOTE_MODS[i].mac[0],
-                   REMOTE_MODS[i].last_seen);
+            printf("%2d - " HW_MAC_FMT " (%ds) type %d error %d\n", i,
+                   HW_MAC_ARG(ctx->remote_mods[i].mac), age, ctx->remote_mods[i].type, ctx->remote_mods[i].last_err);
         }
     }
+    printf("masters = %d, PWR = %d, CLK = %d, 1PPS = %d\n", ag_get_cap_cnt(ctx, AG_CAP_SW_TMC),
+           ag_get_cap_cnt(ctx, AG_CAP_EXT_PWR), ag_get_cap_cnt(ctx, AG_CAP_EXT_CLK), ag_get_cap_cnt(ctx, AG_CAP_EXT_1PPS));
+
+    AG_TMC_STATS_t tmc;
+    ag_get_tmc_stats(ctx, &tmc);
+    printf("elected master = " HW_MAC_FMT ", changes = %u, flaps = %u, election = %u/%u ms\n",
+           HW_MAC_ARG(tmc.mac), (unsigned int) tmc.changes,
+           (unsigned int) tmc.flaps, (unsigned int) tmc.elect_last, (unsigned int) tmc.elect_max);
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_mod_id(CLI_PARSED_CMD_t *cmdp) {
-    if (cmdp->nParams != 1) {
+CLI_CMD_RETURN_t cmd_mod_link(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    if (cmdp->nParams != 0) {
         return CMD_WRONG_N;
     }
 
-    uint8_t mc_id = (uint8_t) strtol(cmdp->params[0], NULL, 10);
-    if (mc_id >= AG_MC_MAX_CNT) {
-        printf("INCORRECT id\n");
-        return CMD_DONE;
-    }
-    if (REMOTE_MODS[mc_id].last_seen == -1) {
-        printf("CANNOT send message to %d\n", mc_id);
-        return CMD_DONE;
+    for (int i = 0; i < AG_MC_MAX_CNT; i ++) {
+        if (ag_remote_mod_age(ctx, i) == -1) {
+            continue;
+        }
+        const AG_LINK_STATS_t *link = &ctx->remote_mods[i].link;
+        printf("%2d - " HW_MAC_FMT " TX %u/%u (%u.%u%%), loss run %u/%u, %u bursts\n", i,
+               HW_MAC_ARG(ctx->remote_mods[i].mac), (unsigned int) link->tx_ok, (unsigned int) link->tx_cnt,
+               (unsigned int) (link->tx_ratio / 10), (unsigned int) (link->tx_ratio % 10),
+               (unsigned int) link->loss_run, (unsigned int) link->loss_run_max,
+               (unsigned int) link->loss_bursts);
+        printf("     RX %u, RSSI %d/%d dBm, RTT %u/%u us\n", (unsigned int) link->rx_cnt,
+               link->rssi, link->rssi_avg, (unsigned int) link->rtt, (unsigned int) link->rtt_avg);
+#if defined(__linux__)
+        AG_SIM_LINK_STATS_t sim;
+        if (ag_comm_get_sim_link(ctx, ctx->remote_mods[i].mac, &sim) == 0) {
+            printf("     sim %u/%u delivered, %u lost, %u cut, %u full, delay %u/%u us\n",
+                   (unsigned int) sim.delivered, (unsigned int) sim.rx, (unsigned int) sim.lost,
+                   (unsigned int) sim.cut, (unsigned int) sim.full, (unsigned int) sim.delay_avg,
+                   (unsigned int) sim.delay_max);
+        }
+#endif
     }
+    return CMD_DONE;
+}
 
-    AG_FRAME_L0 *frame = ag_comm_get_tx_frame();
-    if (frame == NULL) {
-        printf("%s - CANNOT get TX frame\n", __func__);
-        return CMD_DONE;
+CLI_CMD_RETURN_t cmd_mod_alarm(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    if (cmdp->nParams != 0) {
+        return CMD_WRONG_N;
     }
 
-    frame->dst_mac[1] = REMOTE_MODS[mc_id].mac[1];
-    frame->dst_mac[0] = REMOTE_MODS[mc_id].mac[0];
-    frame->data[0] = AG_PROTO_VER1;
-    frame->data[1] = AG_PKT_TYPE_CMD;
-    frame->data[2] = AG_CMD_ID;
-    frame->flags |= AG_FRAME_FLAG_VALID;
-    ag_comm_tx(frame);
+    uint32_t ts_now = get_ts_ms();
+    for (int i = 0; i < AG_ALARM_TBL_LEN; i++) {
+        AG_ALARM_t alarm;
+        if (ag_alarm_get(ctx, i, &alarm) != 0) {
+            continue;
+        }
+        printf(HW_MAC_FMT " error %d %s %us ago, latency %u us, %u alarms\n", HW_MAC_ARG(alarm.mac),
+               alarm.err, (alarm.err == AG_ERR_NONE) ? "cleared" : "raised",
+               (unsigned int) ((ts_now - alarm.ts_rx) / 1000), (unsigned int) alarm.latency,
+               (unsigned int) alarm.cnt);
+    }
+    AG_ALARM_STATS_t stats;
+    ag_alarm_get_stats(ctx, &stats);
+    printf("local = %u (%u copies), received = %u (%u duplicates), max latency = %u us\n",
+           (unsigned int) stats.tx, (unsigned int) stats.tx_copy, (unsigned int) stats.rx,
+           (unsigned int) stats.rx_dup, (unsigned int) stats.latency_max);
+    printf("relayed = %u, relays skipped = %u\n", (unsigned int) stats.relay,
+           (unsigned int) stats.relay_skip);
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_mod_reset(CLI_PARSED_CMD_t *cmdp) {
+/**
+ * @brief parse a group target: all, group=<id> or cap=<AG_CAP_* mask>
+ *
+ * @return 0 if the parameter is a group target
+ */
+static int p_mod_grp_parse(const char *param, uint8_t *grp_type, uint8_t *grp_arg) {
+    if (strncmp(param, "all", 4) == 0) {
+        *grp_type = AG_GRP_ALL;
+        *grp_arg = 0;
+        return 0;
+    }
+    if (strncmp(param, "group=", 6) == 0) {
+        long grp_id = strtol(&param[6], NULL, 10);
+        if ((grp_id < 0) || (grp_id >= AG_GRP_ID_CNT)) {
+            return -1;
+        }
+        *grp_type = AG_GRP_ID;
+        *grp_arg = (uint8_t) grp_id;
+        return 0;
+    }
+    if (strncmp(param, "cap=", 4) == 0) {
+        long caps = strtol(&param[4], NULL, 0);
+        if ((caps <= 0) || (caps > 0xFF)) {
+            return -1;
+        }
+        *grp_type = AG_GRP_CAP;
+        *grp_arg = (uint8_t) caps;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief send a command to one of the remote MCs, or to a group in one frame, and wait for the ACKs
+ */
+static CLI_CMD_RETURN_t p_mod_cmd(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp, uint8_t cmd) {
+    uint8_t grp_type;
+    uint8_t grp_arg;
+    int hndl;
+
     if (cmdp->nParams != 1) {
         return CMD_WRONG_N;
     }
 
-    uint8_t mc_id = (uint8_t) strtol(cmdp->params[0], NULL, 10);
-    if (mc_id >= AG_MC_MAX_CNT) {
-        printf("INCORRECT id\n");
-        return CMD_DONE;
+    uint8_t prio = (cmd == AG_CMD_ID) ? AG_TX_PRIO_CMD : AG_TX_PRIO_SAFETY;
+    int is_grp = (p_mod_grp_parse(cmdp->params[0], &grp_type, &grp_arg) == 0);
+    if (is_grp) {
+        hndl = ag_rcmd_send_group(ctx, grp_type, grp_arg, cmd, prio);
+    } else {
+        long mc_id = strtol(cmdp->params[0], NULL, 10);
+        if ((mc_id < 0) || (mc_id >= AG_MC_MAX_CNT)) {
+            printf("INCORRECT id\n");
+            return CMD_DONE;
+        }
+        if (ctx->remote_mods[mc_id].used == 0) {
+            printf("CANNOT send message to %ld\n", mc_id);
+            return CMD_DONE;
+        }
+        hndl = ag_rcmd_send(ctx, ctx->remote_mods[mc_id].mac, cmd, prio);
     }
-    if (REMOTE_MODS[mc_id].last_seen == -1) {
-        printf("CANNOT send message to %d\n", mc_id);
+    if (hndl < 0) {
+        printf("%s - TOO MANY commands pending\n", __func__);
         return CMD_DONE;
     }
 
-    AG_FRAME_L0 *frame = ag_comm_get_tx_frame();
-    if (frame == NULL) {
-        printf("%s - CANNOT get TX frame\n", __func__);
-        return CMD_DONE;
+    AG_RCMD_RESULT_t res;
+    AG_RCMD_STS_t sts = ag_rcmd_wait(ctx, hndl, CMD_ACK_TIMEOUT_MS, &res);
+    if ((sts == AG_RCMD_STS_DONE) && is_grp) {
+        printf("%s %d/%d (%u.%03u ms, %d tries)\n", (res.result == MC_CMD_OK) ? "OK" : "REJECTED",
+               res.acked, res.targets,
+               (unsigned int) (res.rtt / 1000), (unsigned int) (res.rtt % 1000), res.tries);
+    } else if (sts == AG_RCMD_STS_DONE) {
+        printf("%s (%u.%03u ms, %d tries)\n", (res.result == MC_CMD_OK) ? "OK" : "REJECTED",
+               (unsigned int) (res.rtt / 1000), (unsigned int) (res.rtt % 1000), res.tries);
+    } else if ((sts == AG_RCMD_STS_TIMEOUT) && is_grp) {
+        printf("NO ACK from %d/%d (%d tries)\n", (res.targets - res.acked), res.targets, res.tries);
+    } else if (sts == AG_RCMD_STS_TIMEOUT) {
+        printf("NO ACK (%d tries)\n", res.tries);
+    } else {
+        printf("%s - INVALID handle\n", __func__);
     }
+    return CMD_DONE;
+}
 
-    frame->dst_mac[1] = REMOTE_MODS[mc_id].mac[1];
-    frame->dst_mac[0] = REMOTE_MODS[mc_id].mac[0];
-    frame->data[0] = AG_PROTO_VER1;
-    frame->data[1] = AG_PKT_TYPE_CMD;
-    frame->data[2] = AG_CMD_RESET;
-    frame->flags |= AG_FRAME_FLAG_VALID;
-    ag_comm_tx(frame);
+CLI_CMD_RETURN_t cmd_mod_id(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    return p_mod_cmd(ctx, cmdp, AG_CMD_ID);
+}
+
+CLI_CMD_RETURN_t cmd_mod_reset(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    return p_mod_cmd(ctx, cmdp, AG_CMD_RESET);
+}
+
+CLI_CMD_RETURN_t cmd_mod_power_on(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    return p_mod_cmd(ctx, cmdp, AG_CMD_POWER_ON);
+}
+
+CLI_CMD_RETURN_t cmd_mod_power_off(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    return p_mod_cmd(ctx, cmdp, AG_CMD_POWER_OFF);
+}
+
+CLI_CMD_RETURN_t cmd_mod_stats(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    if (cmdp->nParams != 0) {
+        return CMD_WRONG_N;
+    }
+
+    AG_COMM_STATS_t stats;
+    ag_comm_get_stats(ctx, &stats);
+    printf("RX = %u frames\n", (unsigned int) stats.rx_cnt);
+    printf("RX overflow = %u\n", (unsigned int) stats.rx_overflow);
+    printf("RX drop = %u\n", (unsigned int) stats.rx_drop);
+    printf("RX high-water = %u/%d\n", (unsigned int) stats.rx_hwm, AG_RX_RING_LEN);
+    printf("TX = %u frames (%u ok, %u failed)\n", (unsigned int) stats.tx_cnt,
+           (unsigned int) stats.tx_ok, (unsigned int) stats.tx_fail);
+    printf("TX pool full = %u\n", (unsigned int) stats.tx_full);
+    printf("TX on air = %u (%u aggregated)\n", (unsigned int) stats.tx_xmit,
+           (unsigned int) stats.tx_aggr);
+    printf("TX high-water = %u/%d\n", (unsigned int) stats.tx_hwm, AG_TX_POOL_LEN);
+    printf("TX background deferred = %u\n", (unsigned int) stats.tx_bg_deferred);
+    // no period before the first heartbeat
+    uint32_t hb_rate = (stats.hb_period == 0) ? 0 : (1000000 / stats.hb_period);
+    printf("heartbeat = every %u ms (%u.%03u/s), %u sent, %u resets\n", (unsigned int) stats.hb_period,
+           (unsigned int) (hb_rate / 1000), (unsigned int) (hb_rate % 1000),
+           (unsigned int) stats.hb_cnt, (unsigned int) stats.hb_reset);
+    printf("full status = %u, resync = %u sent/%u received\n", (unsigned int) stats.hb_full,
+           (unsigned int) stats.sync_tx, (unsigned int) stats.sync_rx);
+    printf("join probes = %u, leave = %u\n", (unsigned int) stats.join_rx, (unsigned int) stats.leave_rx);
+    printf("peer slots: hit = %u, miss = %u, evict = %u, broadcast = %u\n",
+           (unsigned int) stats.peer_hit, (unsigned int) stats.peer_miss,
+           (unsigned int) stats.peer_evict, (unsigned int) stats.peer_fallback);
+#if defined(__linux__)
+    printf("sim frames lost = %u\n", (unsigned int) stats.sim_lost);
+#endif
+    const char *prio_name[AG_TX_PRIO_CNT] = {"safety", "cmd", "bg", "bulk"};
+    for (int i = 0; i < AG_TX_PRIO_CNT; i++) {
+        printf("TX %-6s queued %u (max %u), max delay %u us\n", prio_name[i],
+               (unsigned int) stats.tx_depth[i], (unsigned int) stats.tx_depth_max[i],
+               (unsigned int) stats.tx_delay_max[i]);
+    }
+    AG_RCMD_STATS_t rcmd;
+    ag_rcmd_get_stats(ctx, &rcmd);
+    printf("CMD = %u sent, %u retransmits, %u ACKed, %u no ACK, %u duplicates, %u stale\n",
+           (unsigned int) rcmd.tx, (unsigned int) rcmd.retx, (unsigned int) rcmd.ack,
+           (unsigned int) rcmd.timeout, (unsigned int) rcmd.dup, (unsigned int) rcmd.stale);
+    printf("CMD srtt = %u us, rto = %u ms\n", (unsigned int) rcmd.srtt, (unsigned int) rcmd.rto);
+    AG_FRAG_STATS_t frag;
+    ag_frag_get_stats(ctx, &frag);
+    printf("FRAG TX = %u messages (%u failed), %u fragments, %u retransmits\n",
+           (unsigned int) frag.tx_msg, (unsigned int) frag.tx_fail,
+           (unsigned int) frag.tx_frag, (unsigned int) frag.tx_retx);
+    printf("FRAG RX = %u messages (%u B), %u fragments, %u duplicates, %u timeouts, %u no slot\n",
+           (unsigned int) frag.rx_msg, (unsigned int) frag.rx_bytes, (unsigned int) frag.rx_frag,
+           (unsigned int) frag.rx_dup, (unsigned int) frag.rx_timeout, (unsigned int) frag.rx_no_slot);
+    printf("power off = %u (last %u us, avg %u us, max %u us)\n",
+           (unsigned int) stats.pwr_off_cnt, (unsigned int) stats.pwr_off_last,
+           (unsigned int) stats.pwr_off_avg, (unsigned int) stats.pwr_off_max);
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_mod_power_on(CLI_PARSED_CMD_t *cmdp) {
-    if (cmdp->nParams != 1) {
+CLI_CMD_RETURN_t cmd_mod_xfer(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    if ((cmdp->nParams < 1) || (cmdp->nParams > 2)) {
         return CMD_WRONG_N;
     }
 
-    uint8_t mc_id = (uint8_t) strtol(cmdp->params[0], NULL, 10);
-    if (mc_id >= AG_MC_MAX_CNT) {
+    long mc_id = strtol(cmdp->params[0], NULL, 10);
+    if ((mc_id < 0) || (mc_id >= AG_MC_MAX_CNT)) {
         printf("INCORRECT id\n");
         return CMD_DONE;
     }
-    if (REMOTE_MODS[mc_id].last_seen == -1) {
-        printf("CANNOT send message to %d\n", mc_id);
+    if (ctx->remote_mods[mc_id].used == 0) {
+        printf("CANNOT send message to %ld\n", mc_id);
+        return CMD_DONE;
+    }
+    long size = AG_FRAG_MSG_MAX;
+    if (cmdp->nParams == 2) {
+        size = strtol(cmdp->params[1], NULL, 10);
+    }
+    if ((size <= 0) || (size > AG_FRAG_MSG_MAX)) {
+        printf("INCORRECT size (max %d)\n", AG_FRAG_MSG_MAX);
         return CMD_DONE;
     }
 
-    AG_FRAME_L0 *frame = ag_comm_get_tx_frame();
-    if (frame == NULL) {
-        printf("%s - CANNOT get TX frame\n", __func__);
+    // read by task_rf until ag_frag_wait() returns
+    uint8_t *buff = malloc((size_t) size);
+    if (buff == NULL) {
+        printf("%s - CANNOT allocate %ld B\n", __func__, size);
+        return CMD_DONE;
+    }
+    for (long i = 0; i < size; i++) {
+        buff[i] = (uint8_t) i;
+    }
+    int hndl = ag_frag_send(ctx, ctx->remote_mods[mc_id].mac, buff, (uint16_t) size);
+    if (hndl < 0) {
+        free(buff);
+        printf("%s - TRANSFER in progress\n", __func__);
         return CMD_DONE;
     }
 
-    frame->dst_mac[1] = REMOTE_MODS[mc_id].mac[1];
-    frame->dst_mac[0] = REMOTE_MODS[mc_id].mac[0];
-    frame->data[0] = AG_PROTO_VER1;
-    frame->data[1] = AG_PKT_TYPE_CMD;
-    frame->data[2] = AG_CMD_POWER_ON;
-    frame->flags |= AG_FRAME_FLAG_VALID;
-    ag_comm_tx(frame);
+    AG_FRAG_RESULT_t res;
+    AG_FRAG_STS_t sts = ag_frag_wait(ctx, hndl, CMD_XFER_TIMEOUT_MS, &res);
+    free(buff);
+    if (sts == AG_FRAG_STS_DONE) {
+        uint32_t rate = (res.time == 0) ? 0 : (uint32_t) (((uint64_t) size * 1000000) / res.time);
+        printf("OK %ld B in %u.%03u ms (%u B/s), %d fragments, %d sent\n", size,
+               (unsigned int) (res.time / 1000), (unsigned int) (res.time % 1000),
+               (unsigned int) rate, res.cnt, res.tx);
+    } else if (sts == AG_FRAG_STS_TIMEOUT) {
+        printf("NO ACK (%d fragments, %d sent)\n", res.cnt, res.tx);
+    } else {
+        printf("%s - INVALID handle\n", __func__);
+    }
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_mod_power_off(CLI_PARSED_CMD_t *cmdp) {
-    if (cmdp->nParams != 1) {
+CLI_CMD_RETURN_t cmd_mod_ping(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
+    AG_PING_RESULT_t res;
+
+    if ((cmdp->nParams < 1) || (cmdp->nParams > 4)) {
         return CMD_WRONG_N;
     }
 
-    uint8_t mc_id = (uint8_t) strtol(cmdp->params[0], NULL, 10);
-    if (mc_id >= AG_MC_MAX_CNT) {
+    long mc_id = strtol(cmdp->params[0], NULL, 10);
+    if ((mc_id < 0) || (mc_id >= AG_MC_MAX_CNT)) {
         printf("INCORRECT id\n");
         return CMD_DONE;
     }
-    if (REMOTE_MODS[mc_id].last_seen == -1) {
-        printf("CANNOT send message to %d\n", mc_id);
+    if (ctx->remote_mods[mc_id].used == 0) {
+        printf("CANNOT ping %ld\n", mc_id);
+        return CMD_DONE;
+    }
+    long cnt = CMD_PING_CNT;
+    if (cmdp->nParams >= 2) {
+        cnt = strtol(cmdp->params[1], NULL, 10);
+    }
+    if ((cnt <= 0) || (cnt > AG_PING_CNT_MAX)) {
+        printf("INCORRECT count (max %d)\n", AG_PING_CNT_MAX);
+        return CMD_DONE;
+    }
+    long interval = CMD_PING_INTERVAL_MS;
+    if (cmdp->nParams >= 3) {
+        interval = strtol(cmdp->params[2], NULL, 10);
+    }
+    if ((interval < AG_PING_INTERVAL_MIN_MS) || (interval > AG_PING_INTERVAL_MAX_MS)) {
+        printf("INCORRECT interval (%d..%d ms)\n", AG_PING_INTERVAL_MIN_MS, AG_PING_INTERVAL_MAX_MS);
+        return CMD_DONE;
+    }
+    long size = AG_PKT_ECHO_NB;
+    if (cmdp->nParams == 4) {
+        size = strtol(cmdp->params[3], NULL, 10);
+    }
+    if ((size < AG_PKT_ECHO_NB) || (size > AG_FRAME_MAX_LEN)) {
+        printf("INCORRECT size (%d..%d)\n", AG_PKT_ECHO_NB, AG_FRAME_MAX_LEN);
         return CMD_DONE;
     }
 
-    AG_FRAME_L0 *frame = ag_comm_get_tx_frame();
-    if (frame == NULL) {
-        printf("%s - CANNOT get TX frame\n", __func__);
+    int hndl = ag_ping_start(ctx, ctx->remote_mods[mc_id].mac, (uint16_t) cnt, (uint32_t) interval, (uint8_t) size);
+    if (hndl < 0) {
+        printf("%s - PING in progress\n", __func__);
         return CMD_DONE;
     }
 
-    frame->dst_mac[1] = REMOTE_MODS[mc_id].mac[1];
-    frame->dst_mac[0] = REMOTE_MODS[mc_id].mac[0];
-    frame->data[0] = AG_PROTO_VER1;
-    frame->data[1] = AG_PKT_TYPE_CMD;
-    frame->data[2] = AG_CMD_POWER_OFF;
-    frame->flags |= AG_FRAME_FLAG_VALID;
-    ag_comm_tx(frame);
+    // the run ends on its own AG_PING_TIMEOUT_MS after the last probe
+    uint32_t timeout = (uint32_t) (cnt * interval) + (2 * AG_PING_TIMEOUT_MS);
+    AG_PING_STS_t sts = ag_ping_wait(ctx, hndl, timeout, &res);
+    if (sts == AG_PING_STS_ERROR) {
+        printf("%s - INVALID handle\n", __func__);
+        return CMD_DONE;
+    }
+    if (sts == AG_PING_STS_TIMEOUT) {
+        printf("TIMEOUT, partial results\n");
+    }
+    uint32_t loss = (res.sent == 0) ? 0 : (uint32_t) (((res.sent - res.rcvd) * 1000) / res.sent);
+    printf("%u sent, %u received, %u.%u%% loss, %u duplicates\n", (unsigned int) res.sent,
+           (unsigned int) res.rcvd, (unsigned int) (loss / 10), (unsigned int) (loss % 10),
+           (unsigned int) res.dup);
+    if (res.rcvd == 0) {
+        return CMD_DONE;
+    }
+    printf("RTT min/avg/p50/p99/max = %u/%u/%u/%u/%u us\n", (unsigned int) res.min,
+           (unsigned int) res.avg, (unsigned int) res.p50, (unsigned int) res.p99,
+           (unsigned int) res.max);
+    uint32_t bound = AG_PING_HIST_BASE_US;
+    for (int i = 0; i < AG_PING_HIST_CNT; i++) {
+        if (res.hist[i] != 0) {
+            if (i == (AG_PING_HIST_CNT - 1)) {
+                printf("  >= %6u us: %u\n", (unsigned int) (bound >> 1), (unsigned int) res.hist[i]);
+            } else {
+                printf("  <  %6u us: %u\n", (unsigned int) bound, (unsigned int) res.hist[i]);
+            }
+        }
+        bound <<= 1;
+    }
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_pwr_stats(CLI_PARSED_CMD_t *cmdp) {
+CLI_CMD_RETURN_t cmd_pwr_stats(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
     if (cmdp->nParams != 0) {
         return CMD_WRONG_N;
     }
 
     printf("V5_SRC = OFF\n");
     printf("V5_LOAD = OFF\n");
-    printf("I5 = %.3f A\n", ag_get_I5_NOM());
-    printf("I3 = %.3f A\n", ag_get_I3_NOM());
+    printf("I5 = %.3f A\n", ag_get_I5_NOM(ctx));
+    printf("I3 = %.3f A\n", ag_get_I3_NOM(ctx));
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_pwr_ctrl(CLI_PARSED_CMD_t *cmdp) {
+CLI_CMD_RETURN_t cmd_pwr_ctrl(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
     if (cmdp->nParams != 0) {
         return CMD_WRONG_N;
     }
 
-    printf("SRC_I5_NOM = %.3f A\n", MOD_STATE.i5_nom);
-    printf("SRC_I5_CUTOFF = %.3f A\n", MOD_STATE.i5_cutoff);
-    printf("SRC_I3_NOM = %.3f A\n", MOD_STATE.i3_nom);
-    printf("SRC_I3_CUTOFF = %.3f A\n", MOD_STATE.i3_cutoff);
+    printf("SRC_I5_NOM = %.3f A\n", ctx->mod_state.i5_nom);
+    printf("SRC_I5_CUTOFF = %.3f A\n", ctx->mod_state.i5_cutoff);
+    printf("SRC_I3_NOM = %.3f A\n", ctx->mod_state.i3_nom);
+    printf("SRC_I3_CUTOFF = %.3f A\n", ctx->mod_state.i3_cutoff);
 
-    printf("LOAD_I5_NOM = %.3f A\n", MOD_STATE.i5_nom);
-    printf("LOAD_I5_CUTOFF = %.3f A\n", MOD_STATE.i5_cutoff);
-    printf("LOAD_I3_NOM = %.3f A\n", MOD_STATE.i3_nom);
+    printf("LOAD_I5_NOM = %.3f A\n", ctx->mod_state.i5_nom);
+    printf("LOAD_I5_CUTOFF = %.3f A\n", ctx->mod_state.i5_cutoff);
+    printf("LOAD_I3_NOM = %.3f A\n", ctx->mod_state.i3_nom);
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_pwr_v5_src(CLI_PARSED_CMD_t *cmdp) {
+CLI_CMD_RETURN_t cmd_pwr_v5_src(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
     if (cmdp->nParams != 1) {
         return CMD_WRONG_N;
     }
@@ -237,7 +503,7 @@ CLI_CMD_RETURN_t cmd_pwr_v5_src(CLI_PARSED_CMD_t *cmdp) {
     return CMD_DONE;
 }
 
-CLI_CMD_RETURN_t cmd_pwr_v5_load(CLI_PARSED_CMD_t *cmdp) {
+CLI_CMD_RETURN_t cmd_pwr_v5_load(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp) {
     if (cmdp->nParams != 1) {
         return CMD_WRONG_N;
     }
@@ -9,20 +9,25 @@
 #include "cli_types.h"
 #include "../agathis/config.h"
 
-CLI_CMD_RETURN_t cmd_info(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_set(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_save(CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_info(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_set(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_save(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
 
-CLI_CMD_RETURN_t cmd_mod_info(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_mod_id(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_mod_reset(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_mod_power_on(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_mod_power_off(CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_info(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_id(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_reset(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_power_on(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_power_off(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_stats(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_link(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_xfer(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_ping(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_mod_alarm(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
 #if MOD_HAS_PWR
-CLI_CMD_RETURN_t cmd_pwr_stats(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_pwr_ctrl(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_pwr_v5_src(CLI_PARSED_CMD_t *cmdp);
-CLI_CMD_RETURN_t cmd_pwr_v5_load(CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_pwr_stats(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_pwr_ctrl(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_pwr_v5_src(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
+CLI_CMD_RETURN_t cmd_pwr_v5_load(AG_CTX_t *ctx, CLI_PARSED_CMD_t *cmdp);
 #endif
 
 #endif /* CMD_H868VY2FS9UU4CP6 */
@@ -3,43 +3,54 @@
 #include "misc.h"
 
 #if defined(ESP_PLATFORM)
-#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_timer.h"
 #elif defined(__linux__)
-#include "../sim/state.h"
+#include <stdlib.h>
+#include <time.h>
 #endif
 
 /**
- * @brief returns the HW ID - usually the MAC address
- * @param mac array of 6 * uint8_t
+ * @brief returns a monotonic timestamp, wraps around so only use differences
+ * @return time in ms
  */
-void get_HW_ID(uint8_t *mac) {
+uint32_t get_ts_ms(void) {
 #if defined(ESP_PLATFORM)
-    uint8_t buff[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-    ESP_ERROR_CHECK(esp_efuse_mac_get_default(buff));
-    for (int i = 0; i < 6; i++) {
-        mac[0] = buff[5 - i];
-    }
+    return (uint32_t) (esp_timer_get_time() / 1000);
 #elif defined(__linux__)
-    for (int i = 0; i < 6; i++) {
-        mac[i] = SIM_STATE.mac[i];
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (((uint64_t) ts.tv_sec * 1000U) + ((uint64_t) ts.tv_nsec / 1000000U));
+#endif
+}
+
+/**
+ * @brief returns a monotonic timestamp, wraps around so only use differences
+ * @return time in us
+ */
+uint32_t get_ts_us(void) {
+#if defined(ESP_PLATFORM)
+    return (uint32_t) esp_timer_get_time();
+#elif defined(__linux__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (((uint64_t) ts.tv_sec * 1000000U) + ((uint64_t) ts.tv_nsec / 1000U));
 #endif
 }
 
 /**
- * @brief returns the HW ID - usually the MAC address
- * @param mac array of 2 * uint32_t
+ * @return random number, not suitable for cryptography
  */
-void get_HW_ID_compact(uint32_t *mac) {
+uint32_t get_rand_u32(void) {
 #if defined(ESP_PLATFORM)
-    uint8_t buff[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-    ESP_ERROR_CHECK(esp_efuse_mac_get_default(buff));
-    mac[1] = ((uint32_t) buff[0] << 16) | ((uint32_t) buff[1] << 8) | buff[2];
-    mac[0] = ((uint32_t) buff[3] << 16) | ((uint32_t) buff[4] << 8) | buff[5];
+    return esp_random();
 #elif defined(__linux__)
-    // *INDENT-OFF*
-    mac[1] = ((uint32_t) SIM_STATE.mac[5] << 16) | ((uint32_t) SIM_STATE.mac[4] << 8) | SIM_STATE.mac[3];
-    mac[0] = ((uint32_t) SIM_STATE.mac[2] << 16) | ((uint32_t) SIM_STATE.mac[1] << 8) | SIM_STATE.mac[0];
-    // *INDENT-ON*
+    // per thread, the simulated MCs may share a process
+    static __thread unsigned int seed = 0;
+    if (seed == 0) {
+        // different sequence for every thread of every simulated MC
+        seed = get_ts_us() ^ (unsigned int) (uintptr_t) &seed;
+    }
+    return ((uint32_t) rand_r(&seed) << 16) ^ (uint32_t) rand_r(&seed);
 #endif
 }
@@ -5,8 +5,47 @@
 
 #include <stdint.h>
 
-void get_HW_ID(uint8_t *mac);
+/**
+ * @brief 48-bit MAC address, the first byte on air is in bits 47..40
+ *
+ * Addresses are compared and ordered as integers.
+ */
+typedef uint64_t HW_MAC_t;
 
-void get_HW_ID_compact(uint32_t *mac);
+#define HW_MAC_NONE     0ULL
+#define HW_MAC_BCAST    0x0000FFFFFFFFFFFFULL
+#define HW_MAC_LEN      6
+#define HW_MAC_FMT      "%06x:%06x"     /**< printf format, use with HW_MAC_ARG() */
+#define HW_MAC_ARG(m)   (unsigned int) ((m) >> 24), (unsigned int) ((m) & 0xFFFFFFU)
+
+/**
+ * @param b HW_MAC_LEN bytes in the order on air
+ */
+static inline HW_MAC_t hw_mac_from_bytes(const uint8_t *b) {
+    return ((HW_MAC_t) b[0] << 40) | ((HW_MAC_t) b[1] << 32) | ((HW_MAC_t) b[2] << 24)
+           | ((HW_MAC_t) b[3] << 16) | ((HW_MAC_t) b[4] << 8) | (HW_MAC_t) b[5];
+}
+
+/**
+ * @param b HW_MAC_LEN bytes in the order on air
+ */
+static inline void hw_mac_to_bytes(HW_MAC_t mac, uint8_t *b) {
+    for (int i = (HW_MAC_LEN - 1); i >= 0; i--) {
+        b[i] = (uint8_t) mac;
+        mac >>= 8;
+    }
+}
+
+static inline uint32_t hw_mac_hash(HW_MAC_t mac) {
+    uint32_t h = ((uint32_t) mac * 0x9E3779B1U) ^ ((uint32_t) (mac >> 32) * 0x85EBCA77U);
+
+    return h ^ (h >> 15);
+}
+
+uint32_t get_ts_ms(void);
+
+uint32_t get_ts_us(void);
+
+uint32_t get_rand_u32(void);
 
 #endif /* MISC_DR7WHAS4LTQNESQ3 */
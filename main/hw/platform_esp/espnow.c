@@ -12,6 +12,7 @@
 #include "esp_mac.h"
 #include "esp_random.h"
 #include "esp_crc.h"
+#include "esp_idf_version.h"
 
 #include "base.h"
 
@@ -52,39 +53,179 @@ static void example_espnow_send_cb(const uint8_t *mac_addr,
     ESP_LOGI(TAG, "TX to "MACSTR" status %d", MAC2STR(mac_addr), status);
 }
 
-static void example_espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len) {
-    ESP_LOGI(TAG, "RX from "MACSTR" %d B", MAC2STR(mac_addr), len);
-//    ESP_LOGI(TAG, "%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x", data[0], data[1], data[2], data[3], data[4],
-//             data[5], data[6], data[7], data[8], data[9]);
+static void (*p_rx_cbk)(const uint8_t *mac_addr, const uint8_t *data, int len, int8_t rssi) = NULL;
+
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
+static void p_espnow_recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int len) {
+    if (p_rx_cbk != NULL) {
+        p_rx_cbk(info->src_addr, data, len, (int8_t) info->rx_ctrl->rssi);
+    }
+}
+#else
+static void p_espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len) {
+    // no RSSI with this IDF version
+    if (p_rx_cbk != NULL) {
+        p_rx_cbk(mac_addr, data, len, 0);
+    }
+}
+#endif
+
+/*
+ * The driver only takes ESP_NOW_MAX_TOTAL_PEER_NUM peers (fewer with encryption),
+ * so only the most recently addressed ones are registered.
+ */
+typedef struct {
+    HW_MAC_t mac;
+    uint32_t last;      /**< p_peer.tick of the last use, 0 if the slot is free */
+} ESPNOW_PEER_SLOT_t;
+
+static struct {
+    ESPNOW_PEER_SLOT_t slot[ESPNOW_PEER_SLOTS];
+    uint32_t tick;
+    ESPNOW_PEER_STATS_t stats;  /**< read from the CLI, under mux */
+    portMUX_TYPE mux;
+} p_peer = {
+    .mux = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static esp_err_t p_peer_register(HW_MAC_t mac) {
+    esp_now_peer_info_t peer;
+
+    memset(&peer, 0, sizeof(esp_now_peer_info_t));
+    peer.channel = CONFIG_ESPNOW_CHANNEL;
+    peer.ifidx = ESPNOW_WIFI_IF;
+    peer.encrypt = false;
+    hw_mac_to_bytes(mac, peer.peer_addr);
+    esp_err_t err = esp_now_add_peer(&peer);
+    if ((err != ESP_OK) && (err != ESP_ERR_ESPNOW_EXIST)) {
+        ESP_LOGE(TAG, "CANNOT add peer (%d)", err);
+        return err;
+    }
+    return ESP_OK;
 }
 
-void espnow_add_peer(uint32_t mac_addr1, uint32_t mac_addr0) {
-    //ESP_LOGI(TAG, "add peer %x %x\n", (unsigned int) mac_addr1, (unsigned int) mac_addr0);
-    uint8_t mac_addr[6] = {(uint8_t) (mac_addr1 >> 16), (uint8_t) (mac_addr1 >> 8), (uint8_t) (mac_addr1),
-                           (uint8_t) (mac_addr0 >> 16), (uint8_t) (mac_addr0 >> 8), (uint8_t) (mac_addr0)
-                        };
-    esp_now_peer_info_t *peer = malloc(sizeof(esp_now_peer_info_t));
-    if (peer == NULL) {
-        ESP_LOGE(TAG, "CANNOT malloc peer");
-        esp_now_deinit();
+static void p_peer_unregister(HW_MAC_t mac) {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+
+    hw_mac_to_bytes(mac, mac_addr);
+    esp_err_t err = esp_now_del_peer(mac_addr);
+    if ((err != ESP_OK) && (err != ESP_ERR_ESPNOW_NOT_FOUND)) {
+        ESP_LOGE(TAG, "CANNOT del peer (%d)", err);
+    }
+}
+
+/**
+ * @return slot of the peer or -1
+ */
+static int p_peer_find(HW_MAC_t mac) {
+    for (int i = 0; i < ESPNOW_PEER_SLOTS; i++) {
+        if ((p_peer.slot[i].last != 0) && (p_peer.slot[i].mac == mac)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return free slot or -1
+ */
+static int p_peer_free(void) {
+    for (int i = 0; i < ESPNOW_PEER_SLOTS; i++) {
+        if (p_peer.slot[i].last == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void p_peer_touch(int i) {
+    p_peer.tick ++;
+    if (p_peer.tick == 0) {
+        p_peer.tick = 1;
+    }
+    p_peer.slot[i].last = p_peer.tick;
+}
+
+/**
+ * @brief register a new peer if there is a free slot, otherwise it gets one when addressed
+ */
+void espnow_add_peer(HW_MAC_t mac) {
+    if (p_peer_find(mac) >= 0) {
+        return;
+    }
+
+    int i = p_peer_free();
+    if (i < 0) {
         return;
     }
+    if (p_peer_register(mac) == ESP_OK) {
+        p_peer.slot[i].mac = mac;
+        p_peer_touch(i);
+    }
+}
+
+void espnow_del_peer(HW_MAC_t mac) {
+    int i = p_peer_find(mac);
+    if (i < 0) {
+        return;
+    }
+
+    p_peer_unregister(mac);
+    p_peer.slot[i].last = 0;
+}
+
+static void p_peer_count(uint32_t *cnt) {
+    taskENTER_CRITICAL(&p_peer.mux);
+    (*cnt) ++;
+    taskEXIT_CRITICAL(&p_peer.mux);
+}
+
+/**
+ * @brief make sure a peer can be sent to, the least recently used one makes room if needed
+ *
+ * The new peer is registered before the old one goes, a failure leaves the slots as they were.
+ * @return ESP_OK if the peer is registered, otherwise the frame has to be broadcast
+ */
+esp_err_t espnow_use_peer(HW_MAC_t mac) {
+    if (mac == HW_MAC_BCAST) {
+        return ESP_OK;
+    }
 
-    memset(peer, 0, sizeof(esp_now_peer_info_t));
-    peer->channel = CONFIG_ESPNOW_CHANNEL;
-    peer->ifidx = ESPNOW_WIFI_IF;
-    peer->encrypt = false;
-    memcpy(peer->peer_addr, mac_addr, ESP_NOW_ETH_ALEN);
-    ESP_ERROR_CHECK( esp_now_add_peer(peer) );
-    free(peer);
+    int i = p_peer_find(mac);
+    if (i >= 0) {
+        p_peer_count(&p_peer.stats.hit);
+        p_peer_touch(i);
+        return ESP_OK;
+    }
+
+    p_peer_count(&p_peer.stats.miss);
+    i = p_peer_free();
+    int evict = (i < 0);
+    if (evict != 0) {
+        i = 0;
+        for (int j = 1; j < ESPNOW_PEER_SLOTS; j++) {
+            if (p_peer.slot[j].last < p_peer.slot[i].last) {
+                i = j;
+            }
+        }
+    }
+    if (p_peer_register(mac) != ESP_OK) {
+        p_peer_count(&p_peer.stats.fallback);
+        return ESP_FAIL;
+    }
+    if (evict != 0) {
+        p_peer_unregister(p_peer.slot[i].mac);
+        p_peer_count(&p_peer.stats.evict);
+    }
+    p_peer.slot[i].mac = mac;
+    p_peer_touch(i);
+    return ESP_OK;
 }
 
-void espnow_del_peer(uint32_t mac_addr1, uint32_t mac_addr0) {
-    //ESP_LOGI(TAG, "del peer %x %x\n", (unsigned int) mac_addr1, (unsigned int) mac_addr0);
-    uint8_t mac_addr[6] = {(uint8_t) (mac_addr1 >> 16), (uint8_t) (mac_addr1 >> 8), (uint8_t) (mac_addr1),
-                           (uint8_t) (mac_addr0 >> 16), (uint8_t) (mac_addr0 >> 8), (uint8_t) (mac_addr0)
-    };
-    ESP_ERROR_CHECK( esp_now_del_peer(mac_addr) );
+void espnow_get_peer_stats(ESPNOW_PEER_STATS_t *stats) {
+    taskENTER_CRITICAL(&p_peer.mux);
+    *stats = p_peer.stats;
+    taskEXIT_CRITICAL(&p_peer.mux);
 }
 
 void espnow_init(void) {
@@ -93,24 +234,30 @@ void espnow_init(void) {
     /* Initialize ESPNOW and register sending and receiving callback function. */
     ESP_ERROR_CHECK( esp_now_init() );
     ESP_ERROR_CHECK( esp_now_register_send_cb(example_espnow_send_cb) );
-    ESP_ERROR_CHECK( esp_now_register_recv_cb(example_espnow_recv_cb) );
+    ESP_ERROR_CHECK( esp_now_register_recv_cb(p_espnow_recv_cb) );
 
     /* Set primary master key. */
     ESP_ERROR_CHECK( esp_now_set_pmk((uint8_t *)CONFIG_ESPNOW_PMK) );
 
-    espnow_add_peer(0x00FFFFFF, 0x00FFFFFF);
+    // the broadcast peer is always registered, outside of the slots
+    ESP_ERROR_CHECK( p_peer_register(HW_MAC_BCAST) );
 }
 
 void espnow_set_tx_callback(void fptr(const uint8_t *mac_addr, esp_now_send_status_t status)) {
     ESP_ERROR_CHECK( esp_now_register_send_cb(fptr) );
 }
 
-void espnow_set_rx_callback(void fptr(const uint8_t *mac_addr, const uint8_t *data, int len)) {
-    ESP_ERROR_CHECK( esp_now_register_recv_cb(fptr) );
+void espnow_set_rx_callback(void fptr(const uint8_t *mac_addr, const uint8_t *data, int len, int8_t rssi)) {
+    p_rx_cbk = fptr;
 }
 
-void espnow_tx(const uint8_t *mac_addr, const uint8_t *data, size_t len) {
-    if(esp_now_send(mac_addr, data, len) != ESP_OK) {
+esp_err_t espnow_tx(HW_MAC_t mac, const uint8_t *data, size_t len) {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+
+    hw_mac_to_bytes(mac, mac_addr);
+    esp_err_t err = esp_now_send(mac_addr, data, len);
+    if (err != ESP_OK) {
         ESP_LOGE(TAG, "TX error");
     }
+    return err;
 }
@@ -7,18 +7,40 @@
 
 #include "esp_now.h"
 
+#include "../misc.h"
+
+#if defined(CONFIG_ESPNOW_PEER_SLOTS)
+#define ESPNOW_PEER_SLOTS CONFIG_ESPNOW_PEER_SLOTS  /**< unicast peers registered with the driver */
+#else
+#define ESPNOW_PEER_SLOTS 16
+#endif
+
+/**
+ * @brief peer slot counters
+ */
+typedef struct {
+    uint32_t hit;       /**< unicast TX to a registered peer */
+    uint32_t miss;      /**< unicast TX that needed a slot */
+    uint32_t evict;     /**< least recently used peer dropped for another one */
+    uint32_t fallback;  /**< unicast TX sent as broadcast, no slot could be had */
+} ESPNOW_PEER_STATS_t;
+
 void espnow_init(void);
 
 void espnow_set_tx_callback(void fptr(const uint8_t *mac_addr,
                                       esp_now_send_status_t status));
 
 void espnow_set_rx_callback(void fptr(const uint8_t *mac_addr,
-                                      const uint8_t *data, int len));
+                                      const uint8_t *data, int len, int8_t rssi));
+
+void espnow_add_peer(HW_MAC_t mac);
+
+void espnow_del_peer(HW_MAC_t mac);
 
-void espnow_add_peer(uint32_t mac_addr1, uint32_t mac_addr0);
+esp_err_t espnow_use_peer(HW_MAC_t mac);
 
-void espnow_del_peer(uint32_t mac_addr1, uint32_t mac_addr0);
+void espnow_get_peer_stats(ESPNOW_PEER_STATS_t *stats);
 
-void espnow_tx(const uint8_t *mac_addr, const uint8_t *data, size_t len);
+esp_err_t espnow_tx(HW_MAC_t mac, const uint8_t *data, size_t len);
 
 #endif /* ESPNOW_RSYL4WZS99DQRV9U */
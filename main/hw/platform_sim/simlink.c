@@ -0,0 +1,581 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "simlink.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+
+/*
+ * Link model, loaded from the file named by AG_SIM_LINK. It is applied where the
+ * frames leave the transport, the only place where each MC receiving a broadcast
+ * is known. One rule or event per line, sim ids are given as "n", "lo-hi" or "*":
+ *
+ *   link <from> <to> [loss <%>] [delay <ms>] [jitter <ms>] [rate <kbit/s>]
+ *   at <ms> cut <ids> <ids>
+ *   at <ms> heal <ids> <ids>
+ *
+ * The last link line matching a pair wins. The frames of a link get the delay
+ * plus a uniform jitter but keep their order, the rate adds the time on air and
+ * queues the frames behind each other. A cut drops the frames between the two
+ * groups both ways until healed. Event times count from the last modification
+ * of the file so every MC follows the same schedule, the file is reloaded when
+ * it changes and touching it replays the events.
+ */
+#define P_LINK_QUEUE_LEN    256     /**< frames delayed by the link model */
+#define P_LINK_EVENT_MAX    64
+#define P_LINK_LINE_LEN     160
+#define P_LINK_RELOAD_MS    1000    /**< file modification check period */
+#define P_LINK_BACKLOG_MS   500     /**< max wait for the rate of a link, more is dropped */
+#define P_LINK_FULL_US      500     /**< RX thread pause while the receiver is full */
+
+typedef struct {
+    uint32_t loss;          /**< dropped when get_rand_u32() is below */
+    uint32_t delay_us;
+    uint32_t jitter_us;     /**< uniform, added to delay_us */
+    uint32_t rate_kbps;     /**< 0 = no limit */
+} P_LINK_RULE_t;
+
+typedef struct {
+    uint32_t t_ms;          /**< after the file modification */
+    uint8_t cut;            /**< 0 to heal */
+    uint16_t a_lo;
+    uint16_t a_hi;
+    uint16_t b_lo;
+    uint16_t b_hi;
+} P_LINK_EVENT_t;
+
+typedef struct {
+    P_LINK_RULE_t rule[SIMNET_ID_MAX];   /**< by sender sim id */
+    P_LINK_EVENT_t event[P_LINK_EVENT_MAX];
+    int event_cnt;
+} P_LINK_CFG_t;
+
+/**
+ * @brief link from another MC to this one
+ */
+typedef struct {
+    HW_MAC_t mac;
+    uint8_t cut;
+    uint16_t pending;       /**< frames in the delay queue, the times below are stale without */
+    uint32_t ts_busy;       /**< end of the last frame on air in us, with a rate */
+    uint32_t ts_due;        /**< delivery of the last frame in us */
+    uint32_t rx;
+    uint32_t delivered;
+    uint32_t lost;
+    uint32_t dropped_cut;
+    uint32_t dropped_full;
+    uint64_t delay_sum;
+    uint32_t delay_max;
+} P_LINK_PEER_t;
+
+typedef struct {
+    uint32_t due;           /**< in us */
+    uint32_t seq;           /**< keeps the order of the frames due at the same time */
+    int16_t id;
+    uint8_t nb;
+    HW_MAC_t dst_mac;
+    HW_MAC_t src_mac;
+    uint8_t data[SIMNET_DATA_MAX];
+} P_LINK_FRAME_t;
+
+struct simlink {
+    int id;                 /**< own sim id */
+    const char *path;
+    struct timespec mtime;
+    uint32_t ts_check;
+    uint32_t ts_base;       /**< get_ts_ms() at the file modification */
+    int event_next;
+    P_LINK_CFG_t cfg;
+    P_LINK_PEER_t peer[SIMNET_ID_MAX];
+    P_LINK_FRAME_t frame[P_LINK_QUEUE_LEN];
+    uint16_t heap[P_LINK_QUEUE_LEN];    /**< frame indexes, earliest due first */
+    uint16_t free_idx[P_LINK_QUEUE_LEN];
+    int cnt;
+    uint32_t seq;
+    P_LINK_CFG_t cfg_new;   /**< parsed before it replaces cfg */
+    pthread_mutex_t mux;    /**< RX thread, stats read by the CLI */
+};
+
+#define P_LINK_LOCK(link)   pthread_mutex_lock(&(link)->mux)
+#define P_LINK_UNLOCK(link) pthread_mutex_unlock(&(link)->mux)
+
+static int p_link_ids(const char *tok, uint16_t *lo, uint16_t *hi) {
+    char *end;
+
+    if (strcmp(tok, "*") == 0) {
+        *lo = 0;
+        *hi = SIMNET_ID_MAX - 1;
+        return 0;
+    }
+    long id_lo = strtol(tok, &end, 10);
+    long id_hi = id_lo;
+    if ((end != tok) && (*end == '-')) {
+        const char *tmp = end + 1;
+        id_hi = strtol(tmp, &end, 10);
+        if (end == tmp) {
+            return -1;
+        }
+    }
+    if ((end == tok) || (*end != 0) || (id_lo < 0) || (id_hi < id_lo) || (id_hi >= SIMNET_ID_MAX)) {
+        return -1;
+    }
+    *lo = (uint16_t) id_lo;
+    *hi = (uint16_t) id_hi;
+    return 0;
+}
+
+static int p_link_num(const char *tok, double max, double *val) {
+    char *end;
+
+    if (tok == NULL) {
+        return -1;
+    }
+    *val = strtod(tok, &end);
+    if ((end == tok) || (*end != 0) || (*val < 0) || (*val > max)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return 0 if the line is empty, a comment or valid
+ */
+static int p_link_parse(char *line, int id_own, P_LINK_CFG_t *cfg) {
+    char *save;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+    uint16_t a_lo, a_hi, b_lo, b_hi;
+    double val;
+
+    if ((tok == NULL) || (tok[0] == '#')) {
+        return 0;
+    }
+    if (strcmp(tok, "at") == 0) {
+        if (cfg->event_cnt >= P_LINK_EVENT_MAX) {
+            return -1;
+        }
+        if (p_link_num(strtok_r(NULL, " \t\r\n", &save), UINT32_MAX, &val) != 0) {
+            return -1;
+        }
+        P_LINK_EVENT_t *event = &cfg->event[cfg->event_cnt];
+        event->t_ms = (uint32_t) val;
+        tok = strtok_r(NULL, " \t\r\n", &save);
+        if ((tok == NULL) || ((strcmp(tok, "cut") != 0) && (strcmp(tok, "heal") != 0))) {
+            return -1;
+        }
+        event->cut = (strcmp(tok, "cut") == 0) ? 1 : 0;
+        tok = strtok_r(NULL, " \t\r\n", &save);
+        if ((tok == NULL) || (p_link_ids(tok, &event->a_lo, &event->a_hi) != 0)) {
+            return -1;
+        }
+        tok = strtok_r(NULL, " \t\r\n", &save);
+        if ((tok == NULL) || (p_link_ids(tok, &event->b_lo, &event->b_hi) != 0)) {
+            return -1;
+        }
+        if (strtok_r(NULL, " \t\r\n", &save) != NULL) {
+            return -1;
+        }
+        // kept sorted, the file may list them in any order
+        int i = cfg->event_cnt;
+        P_LINK_EVENT_t tmp = *event;
+        while ((i > 0) && (cfg->event[i - 1].t_ms > tmp.t_ms)) {
+            cfg->event[i] = cfg->event[i - 1];
+            i --;
+        }
+        cfg->event[i] = tmp;
+        cfg->event_cnt ++;
+        return 0;
+    }
+    if (strcmp(tok, "link") != 0) {
+        return -1;
+    }
+
+    tok = strtok_r(NULL, " \t\r\n", &save);
+    if ((tok == NULL) || (p_link_ids(tok, &a_lo, &a_hi) != 0)) {
+        return -1;
+    }
+    tok = strtok_r(NULL, " \t\r\n", &save);
+    if ((tok == NULL) || (p_link_ids(tok, &b_lo, &b_hi) != 0)) {
+        return -1;
+    }
+    P_LINK_RULE_t rule = {0};
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        const char *arg = strtok_r(NULL, " \t\r\n", &save);
+        if (strcmp(tok, "loss") == 0) {
+            if (p_link_num(arg, 100, &val) != 0) {
+                return -1;
+            }
+            rule.loss = (val >= 100) ? UINT32_MAX : (uint32_t) ((val / 100) * 4294967296.0);
+        } else if (strcmp(tok, "delay") == 0) {
+            if (p_link_num(arg, 60000, &val) != 0) {
+                return -1;
+            }
+            rule.delay_us = (uint32_t) (val * 1000);
+        } else if (strcmp(tok, "jitter") == 0) {
+            if (p_link_num(arg, 60000, &val) != 0) {
+                return -1;
+            }
+            rule.jitter_us = (uint32_t) (val * 1000);
+        } else if (strcmp(tok, "rate") == 0) {
+            if ((p_link_num(arg, 1000000, &val) != 0) || (val < 1)) {
+                return -1;
+            }
+            rule.rate_kbps = (uint32_t) val;
+        } else {
+            return -1;
+        }
+    }
+    // only the links towards this MC matter here
+    if ((id_own >= b_lo) && (id_own <= b_hi)) {
+        for (int id = a_lo; id <= a_hi; id++) {
+            cfg->rule[id] = rule;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return 0 if the file was read into cfg_new
+ */
+static int p_link_read(SIMLINK_t *link, struct timespec *mtime) {
+    char line[P_LINK_LINE_LEN];
+    struct stat st;
+    int nr = 0;
+
+    FILE *fp = fopen(link->path, "r");
+    if (fp == NULL) {
+        perror("CANNOT open link model");
+        return -1;
+    }
+    if (fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return -1;
+    }
+    memset(&link->cfg_new, 0, sizeof (link->cfg_new));
+    while (fgets(line, sizeof (line), fp) != NULL) {
+        nr ++;
+        if (p_link_parse(line, link->id, &link->cfg_new) != 0) {
+            printf("E (%s) link model line %d INVALID\n", __func__, nr);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    *mtime = st.st_mtim;
+    return 0;
+}
+
+static void p_link_event(SIMLINK_t *link, const P_LINK_EVENT_t *event) {
+    int id = link->id;
+
+    for (int i = 0; i < SIMNET_ID_MAX; i++) {
+        if ((((id >= event->a_lo) && (id <= event->a_hi)) && ((i >= event->b_lo) && (i <= event->b_hi)))
+                || (((id >= event->b_lo) && (id <= event->b_hi)) && ((i >= event->a_lo) && (i <= event->a_hi)))) {
+            link->peer[i].cut = event->cut;
+        }
+    }
+    printf("I (link) %u ms: %s %u-%u %u-%u\n", (unsigned int) event->t_ms, event->cut ? "cut" : "heal",
+           event->a_lo, event->a_hi, event->b_lo, event->b_hi);
+}
+
+/**
+ * @brief switch to cfg_new, the events restart from the file modification, call with P_LINK_LOCK
+ */
+static void p_link_apply(SIMLINK_t *link, const struct timespec *mtime) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t age = ((int64_t) (ts.tv_sec - mtime->tv_sec) * 1000) + ((ts.tv_nsec - mtime->tv_nsec) / 1000000);
+    link->cfg = link->cfg_new;
+    link->mtime = *mtime;
+    link->ts_base = get_ts_ms() - (uint32_t) ((age > 0) ? age : 0);
+    link->event_next = 0;
+    for (int i = 0; i < SIMNET_ID_MAX; i++) {
+        link->peer[i].cut = 0;
+    }
+}
+
+/**
+ * @brief reload the file if it changed and run the events that are due, call with P_LINK_LOCK
+ */
+static void p_link_check(SIMLINK_t *link) {
+    uint32_t ts_now = get_ts_ms();
+
+    if ((ts_now - link->ts_check) >= P_LINK_RELOAD_MS) {
+        struct stat st;
+        struct timespec mtime;
+
+        link->ts_check = ts_now;
+        if ((stat(link->path, &st) == 0)
+                && ((st.st_mtim.tv_sec != link->mtime.tv_sec) || (st.st_mtim.tv_nsec != link->mtime.tv_nsec))) {
+            // a bad edit keeps the previous model
+            if (p_link_read(link, &mtime) == 0) {
+                p_link_apply(link, &mtime);
+                printf("I (link) %s reloaded\n", link->path);
+            } else {
+                link->mtime = st.st_mtim;
+            }
+        }
+    }
+    while ((link->event_next < link->cfg.event_cnt)
+            && ((ts_now - link->ts_base) >= link->cfg.event[link->event_next].t_ms)) {
+        p_link_event(link, &link->cfg.event[link->event_next]);
+        link->event_next ++;
+    }
+}
+
+static int p_link_before(SIMLINK_t *link, uint16_t a, uint16_t b) {
+    int32_t dif = (int32_t) (link->frame[a].due - link->frame[b].due);
+
+    return (dif < 0) || ((dif == 0) && ((int32_t) (link->frame[a].seq - link->frame[b].seq) < 0));
+}
+
+static void p_link_push(SIMLINK_t *link, uint16_t idx) {
+    int pos = link->cnt ++;
+
+    while (pos > 0) {
+        int up = (pos - 1) / 2;
+        if (!p_link_before(link, idx, link->heap[up])) {
+            break;
+        }
+        link->heap[pos] = link->heap[up];
+        pos = up;
+    }
+    link->heap[pos] = idx;
+}
+
+static void p_link_pop(SIMLINK_t *link) {
+    uint16_t idx = link->heap[-- link->cnt];
+    int pos = 0;
+
+    link->free_idx[P_LINK_QUEUE_LEN - link->cnt - 1] = link->heap[0];
+    while (1) {
+        int down = (2 * pos) + 1;
+        if (down >= link->cnt) {
+            break;
+        }
+        if (((down + 1) < link->cnt) && p_link_before(link, link->heap[down + 1], link->heap[down])) {
+            down ++;
+        }
+        if (!p_link_before(link, link->heap[down], idx)) {
+            break;
+        }
+        link->heap[pos] = link->heap[down];
+        pos = down;
+    }
+    if (link->cnt != 0) {
+        link->heap[pos] = idx;
+    }
+}
+
+/**
+ * @brief hand the delayed frames that are due to the receiver
+ *
+ * @return frames queued by the receiver
+ */
+int simlink_flush(SIMLINK_t *link, const SIMNET_RX_t *rx) {
+    uint32_t ts_now = get_ts_us();
+    int cnt = 0;
+
+    P_LINK_LOCK(link);
+    p_link_check(link);
+    while ((link->cnt != 0) && (rx->full(rx->arg) == 0)) {
+        P_LINK_FRAME_t *frame = &link->frame[link->heap[0]];
+        if ((int32_t) (frame->due - ts_now) > 0) {
+            break;
+        }
+        P_LINK_PEER_t *peer = &link->peer[frame->id];
+        if (rx->rx(rx->arg, frame->dst_mac, frame->src_mac, frame->data, frame->nb) == 0) {
+            peer->delivered ++;
+            cnt ++;
+        }
+        peer->pending --;
+        p_link_pop(link);
+    }
+    P_LINK_UNLOCK(link);
+    return cnt;
+}
+
+/**
+ * @return time in us until simlink_flush() has something to do
+ */
+uint32_t simlink_wait_us(SIMLINK_t *link) {
+    uint32_t ts_now = get_ts_ms();
+
+    P_LINK_LOCK(link);
+    // next file check
+    int32_t wait_ms = (int32_t) (P_LINK_RELOAD_MS - (ts_now - link->ts_check));
+    if (link->event_next < link->cfg.event_cnt) {
+        int32_t tmp = (int32_t) (link->cfg.event[link->event_next].t_ms - (ts_now - link->ts_base));
+        if (tmp < wait_ms) {
+            wait_ms = tmp;
+        }
+    }
+    uint32_t wait_us = (wait_ms > 0) ? ((uint32_t) wait_ms * 1000) : 0;
+    if (link->cnt != 0) {
+        int32_t tmp = (int32_t) (link->frame[link->heap[0]].due - get_ts_us());
+        if (tmp <= 0) {
+            // only a full receiver holds a frame that is due
+            tmp = P_LINK_FULL_US;
+        }
+        if ((uint32_t) tmp < wait_us) {
+            wait_us = (uint32_t) tmp;
+        }
+    }
+    P_LINK_UNLOCK(link);
+    return wait_us;
+}
+
+/**
+ * @brief pass a frame through the link from sim id to this MC
+ *
+ * @return 0 if it was queued by the receiver right away
+ */
+int simlink_rx(SIMLINK_t *link, const SIMNET_RX_t *rx, int id,
+               HW_MAC_t dst_mac, HW_MAC_t src_mac, const uint8_t *data, int len) {
+    if ((id < 0) || (id >= SIMNET_ID_MAX) || (len <= 0) || (len > SIMNET_DATA_MAX)) {
+        return rx->rx(rx->arg, dst_mac, src_mac, data, len);
+    }
+
+    // the frames of this link that are due and the events go first
+    simlink_flush(link, rx);
+
+    uint32_t ts_now = get_ts_us();
+    P_LINK_LOCK(link);
+    P_LINK_PEER_t *peer = &link->peer[id];
+    const P_LINK_RULE_t *rule = &link->cfg.rule[id];
+    peer->mac = src_mac;
+    peer->rx ++;
+    if (peer->cut != 0) {
+        peer->dropped_cut ++;
+        P_LINK_UNLOCK(link);
+        return -1;
+    }
+    if ((rule->loss != 0) && (get_rand_u32() <= rule->loss)) {
+        peer->lost ++;
+        P_LINK_UNLOCK(link);
+        return -1;
+    }
+
+    uint32_t ts_due = ts_now;
+    if (rule->rate_kbps != 0) {
+        if ((peer->pending != 0) && ((int32_t) (peer->ts_busy - ts_now) > 0)) {
+            ts_due = peer->ts_busy;
+        }
+        if ((ts_due - ts_now) > (P_LINK_BACKLOG_MS * 1000)) {
+            peer->dropped_full ++;
+            P_LINK_UNLOCK(link);
+            return -1;
+        }
+        ts_due += ((uint32_t) len * 8 * 1000) / rule->rate_kbps;
+        peer->ts_busy = ts_due;
+    }
+    ts_due += rule->delay_us;
+    if (rule->jitter_us != 0) {
+        ts_due += get_rand_u32() % (rule->jitter_us + 1);
+    }
+    if ((peer->pending != 0) && ((int32_t) (peer->ts_due - ts_due) > 0)) {
+        // a frame does not overtake the previous one of the link
+        ts_due = peer->ts_due;
+    }
+
+    int32_t delay = (int32_t) (ts_due - ts_now);
+    if ((delay <= 0) && (rx->full(rx->arg) == 0)) {
+        P_LINK_UNLOCK(link);
+        int ret = rx->rx(rx->arg, dst_mac, src_mac, data, len);
+        P_LINK_LOCK(link);
+        if (ret == 0) {
+            peer->delivered ++;
+        }
+        P_LINK_UNLOCK(link);
+        return ret;
+    }
+    if (link->cnt >= P_LINK_QUEUE_LEN) {
+        peer->dropped_full ++;
+        P_LINK_UNLOCK(link);
+        return -1;
+    }
+    if (delay < 0) {
+        // due, waits for the receiver to catch up
+        delay = 0;
+    }
+    peer->ts_due = ts_due;
+    peer->pending ++;
+    peer->delay_sum += (uint32_t) delay;
+    if ((uint32_t) delay > peer->delay_max) {
+        peer->delay_max = (uint32_t) delay;
+    }
+
+    uint16_t idx = link->free_idx[P_LINK_QUEUE_LEN - link->cnt - 1];
+    P_LINK_FRAME_t *frame = &link->frame[idx];
+    frame->due = ts_due;
+    frame->seq = link->seq ++;
+    frame->id = (int16_t) id;
+    frame->nb = (uint8_t) len;
+    frame->dst_mac = dst_mac;
+    frame->src_mac = src_mac;
+    memcpy(frame->data, data, (size_t) len);
+    p_link_push(link, idx);
+    P_LINK_UNLOCK(link);
+    return -1;
+}
+
+/**
+ * @brief load the link model of sim id
+ *
+ * @return NULL on failure
+ */
+SIMLINK_t *simlink_init(int id, const char *path) {
+    struct timespec mtime;
+
+    SIMLINK_t *link = (SIMLINK_t *) calloc(1, sizeof (SIMLINK_t));
+    if (link == NULL) {
+        printf("CANNOT allocate link model\n");
+        return NULL;
+    }
+    link->id = id;
+    link->path = path;
+    if (p_link_read(link, &mtime) != 0) {
+        free(link);
+        return NULL;
+    }
+    for (int i = 0; i < P_LINK_QUEUE_LEN; i++) {
+        link->free_idx[i] = (uint16_t) i;
+    }
+    pthread_mutex_init(&link->mux, NULL);
+    link->ts_check = get_ts_ms();
+    p_link_apply(link, &mtime);
+    p_link_check(link);
+    printf("I (link) model loaded from %s\n", path);
+    return link;
+}
+
+/**
+ * @return 0 if mac sent frames to this MC
+ */
+int simlink_get_stats(SIMLINK_t *link, HW_MAC_t mac, SIMNET_LINK_STATS_t *stats) {
+    int ret = -1;
+
+    P_LINK_LOCK(link);
+    for (int i = 0; i < SIMNET_ID_MAX; i++) {
+        const P_LINK_PEER_t *peer = &link->peer[i];
+        if ((peer->mac != mac) || (peer->rx == 0)) {
+            continue;
+        }
+        stats->rx = peer->rx;
+        stats->delivered = peer->delivered;
+        stats->lost = peer->lost;
+        stats->cut = peer->dropped_cut;
+        stats->full = peer->dropped_full;
+        stats->delay_avg = (peer->delivered == 0) ? 0 : (uint32_t) (peer->delay_sum / peer->delivered);
+        stats->delay_max = peer->delay_max;
+        ret = 0;
+        break;
+    }
+    P_LINK_UNLOCK(link);
+    return ret;
+}
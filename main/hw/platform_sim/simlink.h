@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SIMLINK_PMLZRX2HGMTX14XO
+#define SIMLINK_PMLZRX2HGMTX14XO
+
+#include <stdint.h>
+
+#include "simnet.h"
+
+typedef struct simlink SIMLINK_t;
+
+SIMLINK_t *simlink_init(int id, const char *path);
+
+int simlink_rx(SIMLINK_t *link, const SIMNET_RX_t *rx, int id,
+               HW_MAC_t dst_mac, HW_MAC_t src_mac, const uint8_t *data, int len);
+
+int simlink_flush(SIMLINK_t *link, const SIMNET_RX_t *rx);
+
+uint32_t simlink_wait_us(SIMLINK_t *link);
+
+int simlink_get_stats(SIMLINK_t *link, HW_MAC_t mac, SIMNET_LINK_STATS_t *stats);
+
+#endif /* SIMLINK_PMLZRX2HGMTX14XO */
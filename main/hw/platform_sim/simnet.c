@@ -0,0 +1,534 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "simnet.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "../../sim/state.h"
+#include "simlink.h"
+#include "simshm.h"
+
+/*
+ * Every simulated MC reads its own queue, P_SIM_MQ_DIR has one queue per MC.
+ * The queues of the others are kept open and followed with inotify, their MAC
+ * is learned from the frames they send. Unicast goes to the queue of the
+ * destination only, broadcast and the destinations not learned yet to all.
+ */
+#define P_SIM_MQ_DIR        "/dev/mqueue"
+#define P_SIM_PEER_MAX      256     /**< other simulated MCs reachable */
+#define P_SIM_MAP_LEN       512     /**< MAC to peer map, power of 2 larger than P_SIM_PEER_MAX */
+#define P_SIM_RESCAN_MS     1000    /**< directory rescan period when inotify is not available */
+#define P_SIM_FULL_US       500     /**< RX thread pause while the receiver is full */
+
+/**
+ * @brief queue of another simulated MC
+ */
+typedef struct {
+    int id;
+    mqd_t mq;       /**< kept open, non-blocking */
+    HW_MAC_t mac;   /**< HW_MAC_NONE until a frame from it is received */
+    uint8_t seen;   /**< found by the last rescan */
+} P_SIM_PEER_t;
+
+/**
+ * @brief simulated radio of one MC, several of them may share a process
+ */
+struct simnet {
+    int id;                         /**< own sim id */
+    HW_MAC_t mac;
+    mqd_t mq;                       /**< own queue */
+    SIMNET_RX_t rx;
+    SIMSHM_t *shm;                  /**< NULL with the mqueue transport */
+    SIMLINK_t *link;                /**< NULL without AG_SIM_LINK */
+    P_SIM_PEER_t peer[P_SIM_PEER_MAX];
+    int cnt;
+    int16_t by_id[SIMNET_ID_MAX];   /**< index in peer + 1, 0 = no queue */
+    int16_t map[P_SIM_MAP_LEN];     /**< index in peer + 1 by MAC, 0 = empty, linear probing */
+    int init;
+    int watch_fd;                   /**< inotify on P_SIM_MQ_DIR, -1 to rescan instead */
+    uint32_t ts_scan;
+    uint32_t cnt_hit;               /**< unicast frames sent to one queue */
+    uint32_t cnt_fallback;          /**< unicast frames sent to all the queues */
+    pthread_mutex_t mux;            /**< TX from task_rf, MACs learned by the RX thread */
+};
+
+#define P_SIM_LOCK(net)     pthread_mutex_lock(&(net)->mux)
+#define P_SIM_UNLOCK(net)   pthread_mutex_unlock(&(net)->mux)
+
+static void p_sim_map_add(SIMNET_t *net, int idx) {
+    uint32_t pos = hw_mac_hash(net->peer[idx].mac) & (P_SIM_MAP_LEN - 1);
+
+    while (net->map[pos] != 0) {
+        pos = (pos + 1) & (P_SIM_MAP_LEN - 1);
+    }
+    net->map[pos] = (int16_t) (idx + 1);
+}
+
+static void p_sim_map_rebuild(SIMNET_t *net) {
+    memset(net->map, 0, sizeof (net->map));
+    for (int i = 0; i < net->cnt; i++) {
+        if (net->peer[i].mac != HW_MAC_NONE) {
+            p_sim_map_add(net, i);
+        }
+    }
+}
+
+/**
+ * @return index of the peer with this MAC or -1
+ */
+static int p_sim_map_find(SIMNET_t *net, HW_MAC_t mac) {
+    uint32_t pos = hw_mac_hash(mac) & (P_SIM_MAP_LEN - 1);
+
+    while (net->map[pos] != 0) {
+        int idx = net->map[pos] - 1;
+        if (net->peer[idx].mac == mac) {
+            return idx;
+        }
+        pos = (pos + 1) & (P_SIM_MAP_LEN - 1);
+    }
+    return -1;
+}
+
+/**
+ * @return sim id of a queue name, -1 if it is not the queue of another MC
+ */
+static int p_sim_queue_id(SIMNET_t *net, const char *name) {
+    size_t len = strlen(SIM_MQ_PREFIX);
+
+    if (strncmp(SIM_MQ_PREFIX, name, len) != 0) {
+        return -1;
+    }
+    char *end = NULL;
+    long id = strtol(&name[len], &end, 10);
+    if ((end == &name[len]) || (*end != '\0') || (id < 0) || (id >= SIMNET_ID_MAX)
+            || (id == net->id)) {
+        return -1;
+    }
+    return (int) id;
+}
+
+static void p_sim_peer_add(SIMNET_t *net, const char *name, int id) {
+    char path[SIM_PATH_LEN];
+
+    if (net->by_id[id] != 0) {
+        net->peer[net->by_id[id] - 1].seen = 1;
+        return;
+    }
+    if (net->cnt >= P_SIM_PEER_MAX) {
+        printf("%s - CANNOT add %s, too many MCs\n", __func__, name);
+        return;
+    }
+    snprintf(path, SIM_PATH_LEN, "/%s", name);
+    mqd_t mq = mq_open(path, O_WRONLY | O_NONBLOCK);
+    if (mq == -1) {
+        perror("CANNOT open mq");
+        return;
+    }
+    P_SIM_PEER_t *peer = &net->peer[net->cnt];
+    peer->id = id;
+    peer->mq = mq;
+    peer->mac = HW_MAC_NONE;
+    peer->seen = 1;
+    net->cnt ++;
+    net->by_id[id] = (int16_t) net->cnt;
+}
+
+static void p_sim_peer_del(SIMNET_t *net, int idx) {
+    mq_close(net->peer[idx].mq);
+    net->by_id[net->peer[idx].id] = 0;
+    net->cnt --;
+    if (idx != net->cnt) {
+        net->peer[idx] = net->peer[net->cnt];
+        net->by_id[net->peer[idx].id] = (int16_t) (idx + 1);
+    }
+    p_sim_map_rebuild(net);
+}
+
+/**
+ * @brief open the queues that appeared, close the ones that are gone
+ */
+static void p_sim_rescan(SIMNET_t *net) {
+    DIR *d = opendir(P_SIM_MQ_DIR);
+    if (d == NULL) {
+        printf("%s\n", "CANNOT open folder");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < net->cnt; i++) {
+        net->peer[i].seen = 0;
+    }
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+        int id = p_sim_queue_id(net, dir->d_name);
+        if (id >= 0) {
+            p_sim_peer_add(net, dir->d_name, id);
+        }
+    }
+    closedir(d);
+    for (int i = (net->cnt - 1); i >= 0; i--) {
+        if (net->peer[i].seen == 0) {
+            p_sim_peer_del(net, i);
+        }
+    }
+    net->ts_scan = get_ts_ms();
+}
+
+/**
+ * @brief bring the peer table up to date, called before every TX
+ */
+static void p_sim_refresh(SIMNET_t *net) {
+    if (net->init == 0) {
+        net->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if ((net->watch_fd != -1)
+                && (inotify_add_watch(net->watch_fd, P_SIM_MQ_DIR, IN_CREATE | IN_DELETE) == -1)) {
+            close(net->watch_fd);
+            net->watch_fd = -1;
+        }
+        if (net->watch_fd == -1) {
+            perror("no inotify, rescanning " P_SIM_MQ_DIR);
+        }
+        net->init = 1;
+        p_sim_rescan(net);
+        return;
+    }
+
+    if (net->watch_fd == -1) {
+        if ((get_ts_ms() - net->ts_scan) >= P_SIM_RESCAN_MS) {
+            p_sim_rescan(net);
+        }
+        return;
+    }
+
+    char ev_buff[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(net->watch_fd, ev_buff, sizeof (ev_buff))) > 0) {
+        for (char *pos = ev_buff; pos < (ev_buff + len);) {
+            const struct inotify_event *ev = (const struct inotify_event *) pos;
+            pos += sizeof (struct inotify_event) + ev->len;
+
+            if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+                p_sim_rescan(net);
+                continue;
+            }
+            int id = (ev->len != 0) ? p_sim_queue_id(net, ev->name) : -1;
+            if (id < 0) {
+                continue;
+            }
+            if ((ev->mask & IN_CREATE) != 0) {
+                p_sim_peer_add(net, ev->name, id);
+            } else if (((ev->mask & IN_DELETE) != 0) && (net->by_id[id] != 0)) {
+                p_sim_peer_del(net, net->by_id[id] - 1);
+            }
+        }
+    }
+}
+
+/**
+ * @brief remember the MAC of the MC that owns queue id
+ */
+static void p_sim_learn(SIMNET_t *net, int id, HW_MAC_t mac) {
+    if ((id < 0) || (id >= SIMNET_ID_MAX)) {
+        return;
+    }
+
+    P_SIM_LOCK(net);
+    int idx = net->by_id[id] - 1;
+    if ((idx >= 0) && (net->peer[idx].mac != mac)) {
+        if (net->peer[idx].mac == HW_MAC_NONE) {
+            net->peer[idx].mac = mac;
+            p_sim_map_add(net, idx);
+        } else {
+            // restarted with another MAC
+            net->peer[idx].mac = mac;
+            p_sim_map_rebuild(net);
+        }
+    }
+    P_SIM_UNLOCK(net);
+}
+
+/**
+ * @return 0 if the message was queued to every destination
+ */
+static int p_sim_tx(SIMNET_t *net, HW_MAC_t dst_mac, const uint8_t *buff, size_t nb) {
+    int ret = 0;
+    int err = 0;    // of the failed send, EAGAIN only if all failed on a full queue
+
+    P_SIM_LOCK(net);
+    p_sim_refresh(net);
+    int idx = (dst_mac == HW_MAC_BCAST) ? -1 : p_sim_map_find(net, dst_mac);
+    if (idx >= 0) {
+        net->cnt_hit ++;
+        if (mq_send(net->peer[idx].mq, (const char *) buff, nb, 0) == -1) {
+            err = errno;
+            ret = -1;
+        }
+    } else {
+        if (dst_mac != HW_MAC_BCAST) {
+            net->cnt_fallback ++;
+        }
+        for (int i = 0; i < net->cnt; i++) {
+            if (mq_send(net->peer[i].mq, (const char *) buff, nb, 0) == -1) {
+                if ((err == 0) || (err == EAGAIN)) {
+                    err = errno;
+                }
+                ret = -1;
+            }
+        }
+    }
+    P_SIM_UNLOCK(net);
+
+    if ((ret != 0) && (err != EAGAIN)) {
+        printf("CANNOT send msg: %s\n", strerror(err));
+    }
+    return ret;
+}
+
+/**
+ * @brief hand one sim message to the receiver
+ *
+ * @return 0 if a frame was queued by the receiver
+ */
+static int p_sim_rx_msg(SIMNET_t *net, const uint8_t *buff, ssize_t nb_rx) {
+    if (nb_rx < SIMNET_HDR_NB) {
+        return -1;
+    }
+
+    HW_MAC_t dst_mac = hw_mac_from_bytes(&buff[0]);
+    HW_MAC_t src_mac = hw_mac_from_bytes(&buff[HW_MAC_LEN]);
+    int id = buff[12] | (buff[13] << 8);
+    if (net->shm != NULL) {
+        simshm_learn(net->shm, id, src_mac);
+    } else {
+        p_sim_learn(net, id, src_mac);
+    }
+    // unicast to a MAC the sender has not learned yet reaches everybody
+    if ((dst_mac != HW_MAC_BCAST) && (dst_mac != net->mac)) {
+        return -1;
+    }
+    if (net->link != NULL) {
+        return simlink_rx(net->link, &net->rx, id, dst_mac, src_mac,
+                          &buff[SIMNET_HDR_NB], (int) (nb_rx - SIMNET_HDR_NB));
+    }
+    return net->rx.rx(net->rx.arg, dst_mac, src_mac, &buff[SIMNET_HDR_NB], (int) (nb_rx - SIMNET_HDR_NB));
+}
+
+/**
+ * @brief RX thread of the mqueue transport, the only caller of the receiver
+ *
+ * Blocks for the first message, then drains what is already in the queue and
+ * wakes the receiver once per batch. The messages stay in the queue while the
+ * receiver is full.
+ */
+static void *p_sim_rx_main(void *arg) {
+    SIMNET_t *net = (SIMNET_t *) arg;
+    struct mq_attr attr;
+    // already expired, mq_timedreceive() does not wait
+    const struct timespec ts_zero = {0, 0};
+
+    if (mq_getattr(net->mq, &attr) == -1) {
+        perror("CANNOT get mq attr");
+        exit(EXIT_FAILURE);
+    }
+    if ((attr.mq_flags & O_NONBLOCK) != 0) {
+        attr.mq_flags &= ~O_NONBLOCK;
+        mq_setattr(net->mq, &attr, NULL);
+    }
+    // mq_receive() wants room for the largest message of the queue, allocated once
+    uint8_t *buff = (uint8_t *) malloc((size_t) attr.mq_msgsize);
+    if (buff == NULL) {
+        printf("CANNOT allocate RX buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        uint32_t wait_us = (net->link != NULL) ? simlink_wait_us(net->link) : UINT32_MAX;
+        ssize_t nb_rx;
+        int cnt = 0;
+
+        if (net->rx.full(net->rx.arg)) {
+            // leave the messages in the queue until the receiver catches up
+            net->rx.wake(net->rx.arg);
+            usleep(P_SIM_FULL_US);
+            continue;
+        }
+        if (wait_us == UINT32_MAX) {
+            nb_rx = mq_receive(net->mq, (char *) buff, (size_t) attr.mq_msgsize, NULL);
+        } else {
+            // wake up for the delayed frames and the events of the link model
+            struct timespec ts;
+            simnet_timeout(CLOCK_REALTIME, wait_us, &ts);
+            nb_rx = mq_timedreceive(net->mq, (char *) buff, (size_t) attr.mq_msgsize, NULL, &ts);
+        }
+        if (net->link != NULL) {
+            cnt += simlink_flush(net->link, &net->rx);
+        }
+
+        while (nb_rx >= 0) {
+            if (p_sim_rx_msg(net, buff, nb_rx) == 0) {
+                cnt ++;
+            }
+            if ((cnt >= net->rx.batch) || net->rx.full(net->rx.arg)) {
+                break;
+            }
+            nb_rx = mq_timedreceive(net->mq, (char *) buff, (size_t) attr.mq_msgsize, NULL, &ts_zero);
+        }
+        if ((nb_rx == -1) && (errno != ETIMEDOUT) && (errno != EINTR)) {
+            perror("RX failure");
+        }
+        if (cnt != 0) {
+            net->rx.wake(net->rx.arg);
+        }
+    }
+    return arg;
+}
+
+/**
+ * @brief RX thread of the shared-memory transport, same role as p_sim_rx_main()
+ */
+static void *p_shm_rx_main(void *arg) {
+    SIMNET_t *net = (SIMNET_t *) arg;
+    uint8_t buff[SIMNET_MSG_MAX];
+
+    while (1) {
+        uint32_t wake = simshm_wake_seq(net->shm);
+        int cnt = (net->link != NULL) ? simlink_flush(net->link, &net->rx) : 0;
+        int got = 0;
+
+        while (1) {
+            if (net->rx.full(net->rx.arg)) {
+                // leave the frames in shared memory until the receiver catches up
+                net->rx.wake(net->rx.arg);
+                usleep(P_SIM_FULL_US);
+                continue;
+            }
+            ssize_t nb = simshm_rx(net->shm, buff);
+            if (nb == 0) {
+                break;
+            }
+            got ++;
+            if (p_sim_rx_msg(net, buff, nb) == 0) {
+                cnt ++;
+            }
+            if (cnt >= net->rx.batch) {
+                net->rx.wake(net->rx.arg);
+                cnt = 0;
+            }
+        }
+        if (cnt != 0) {
+            net->rx.wake(net->rx.arg);
+        }
+        if (got == 0) {
+            simshm_sleep(net->shm, wake, (net->link != NULL) ? simlink_wait_us(net->link) : UINT32_MAX);
+        }
+    }
+    return arg;
+}
+
+/**
+ * @brief absolute timeout wait_us from now on clock
+ */
+void simnet_timeout(clockid_t clock, uint32_t wait_us, struct timespec *ts) {
+    clock_gettime(clock, ts);
+    ts->tv_sec += (time_t) (wait_us / 1000000);
+    ts->tv_nsec += (long) (wait_us % 1000000) * 1000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec ++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * @brief bring up the simulated radio of sim id and its RX thread
+ *
+ * The transport is the mqueue of the sim, or shared memory with AG_SIM_TRANSPORT=shm,
+ * the link model is loaded from the file named by AG_SIM_LINK. Exits on failure.
+ * @param mq own queue, read by the RX thread
+ * @param rx receiver of the frames, copied
+ */
+SIMNET_t *simnet_start(int id, HW_MAC_t mac, mqd_t mq, const SIMNET_RX_t *rx) {
+    SIMNET_t *net = (SIMNET_t *) calloc(1, sizeof (SIMNET_t));
+    if (net == NULL) {
+        printf("CANNOT allocate sim state\n");
+        exit(EXIT_FAILURE);
+    }
+    net->id = id;
+    net->mac = mac;
+    net->mq = mq;
+    net->rx = *rx;
+    pthread_mutex_init(&net->mux, NULL);
+
+    const char *link_path = getenv("AG_SIM_LINK");
+    if (link_path != NULL) {
+        net->link = simlink_init(id, link_path);
+        if (net->link == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    void *(*rx_main)(void *) = p_sim_rx_main;
+    const char *transport = getenv("AG_SIM_TRANSPORT");
+    if ((transport != NULL) && (strcmp(transport, "shm") == 0)) {
+        net->shm = simshm_attach(id, mac);
+        if (net->shm == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        rx_main = p_shm_rx_main;
+    }
+    pthread_t rx_thread;
+    if (pthread_create(&rx_thread, NULL, rx_main, net) != 0) {
+        perror("CANNOT start RX thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(rx_thread);
+    return net;
+}
+
+/**
+ * @return 0 if the frame was handed to every destination
+ */
+int simnet_tx(SIMNET_t *net, HW_MAC_t dst_mac, HW_MAC_t src_mac, const uint8_t *data, size_t len) {
+    uint8_t buff[SIMNET_MSG_MAX];
+
+    if (len > SIMNET_DATA_MAX) {
+        return -1;
+    }
+    hw_mac_to_bytes(dst_mac, &buff[0]);
+    hw_mac_to_bytes(src_mac, &buff[HW_MAC_LEN]);
+    buff[12] = (uint8_t) (net->id & 0xFF);
+    buff[13] = (uint8_t) (net->id >> 8);
+    memcpy(&buff[SIMNET_HDR_NB], data, len);
+
+    if (net->shm != NULL) {
+        return simshm_tx(net->shm, dst_mac, buff, SIMNET_HDR_NB + len);
+    }
+    return p_sim_tx(net, dst_mac, buff, SIMNET_HDR_NB + len);
+}
+
+void simnet_get_stats(SIMNET_t *net, SIMNET_STATS_t *stats) {
+    if (net->shm != NULL) {
+        simshm_get_stats(net->shm, stats);
+        return;
+    }
+    P_SIM_LOCK(net);
+    stats->hit = net->cnt_hit;
+    stats->fallback = net->cnt_fallback;
+    stats->lost = 0;
+    P_SIM_UNLOCK(net);
+}
+
+/**
+ * @return 0 if the link model is on and mac sent frames to this MC
+ */
+int simnet_get_link_stats(SIMNET_t *net, HW_MAC_t mac, SIMNET_LINK_STATS_t *stats) {
+    if (net->link == NULL) {
+        return -1;
+    }
+    return simlink_get_stats(net->link, mac, stats);
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SIMNET_QFFORNQSJ1SJYQIW
+#define SIMNET_QFFORNQSJ1SJYQIW
+
+#include <mqueue.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../misc.h"
+
+#define SIMNET_DATA_MAX     250     /**< max frame length, same as ESP-NOW */
+#define SIMNET_HDR_NB       14      /**< [0..5] dst MAC, [6..11] src MAC, [12..13] sender sim id, then the frame */
+#define SIMNET_MSG_MAX      (SIMNET_HDR_NB + SIMNET_DATA_MAX)
+#define SIMNET_ID_MAX       1000    /**< queue names end with a 3-digit sim id */
+
+/**
+ * @brief receiver of the frames, the functions are called from the RX thread
+ */
+typedef struct {
+    void *arg;
+    /** @return 0 if the frame was queued */
+    int (*rx)(void *arg, HW_MAC_t dst_mac, HW_MAC_t src_mac, const uint8_t *data, int len);
+    /** @return 1 if rx() would drop the next frame, the frames wait in the transport meanwhile */
+    int (*full)(void *arg);
+    /** @brief called after a batch of rx() */
+    void (*wake)(void *arg);
+    int batch;  /**< rx() calls before wake() is called */
+} SIMNET_RX_t;
+
+/**
+ * @brief transport counters
+ */
+typedef struct {
+    uint32_t hit;       /**< unicast frames sent to the destination only */
+    uint32_t fallback;  /**< unicast frames sent to all, MAC not learned yet */
+    uint32_t lost;      /**< shared memory: frames dropped on a full inbox or overwritten before read */
+} SIMNET_STATS_t;
+
+/**
+ * @brief link from another MC as seen by the link model, see AG_SIM_LINK
+ */
+typedef struct {
+    uint32_t rx;            /**< frames sent on the link */
+    uint32_t delivered;
+    uint32_t lost;          /**< dropped by the loss rate */
+    uint32_t cut;           /**< dropped by a partition */
+    uint32_t full;          /**< dropped over the rate backlog or the delay queue */
+    uint32_t delay_avg;     /**< in us */
+    uint32_t delay_max;     /**< in us */
+} SIMNET_LINK_STATS_t;
+
+typedef struct simnet SIMNET_t;
+
+SIMNET_t *simnet_start(int id, HW_MAC_t mac, mqd_t mq, const SIMNET_RX_t *rx);
+
+int simnet_tx(SIMNET_t *net, HW_MAC_t dst_mac, HW_MAC_t src_mac, const uint8_t *data, size_t len);
+
+void simnet_get_stats(SIMNET_t *net, SIMNET_STATS_t *stats);
+
+int simnet_get_link_stats(SIMNET_t *net, HW_MAC_t mac, SIMNET_LINK_STATS_t *stats);
+
+void simnet_timeout(clockid_t clock, uint32_t wait_us, struct timespec *ts);
+
+#endif /* SIMNET_QFFORNQSJ1SJYQIW */
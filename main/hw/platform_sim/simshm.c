@@ -0,0 +1,429 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "simshm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Shared-memory transport, used instead of the mqueues when the environment has
+ * AG_SIM_TRANSPORT=shm (every simulated MC of the chain must use the same one).
+ *
+ * One segment holds a record per sim id with its inbox, and one broadcast ring.
+ * An inbox is a bounded multi-producer queue with a sequence number per slot,
+ * a full inbox drops the frame like a lost radio frame. A broadcast frame is
+ * written once and each MC reads it with its own cursor, one that falls a ring
+ * behind loses the overwritten frames. The readers sleep on a single futex word,
+ * unicast only wakes the ones with the bit of the destination (id modulo 32).
+ */
+#define P_SHM_NAME          "/agathis_shm"
+#define P_SHM_MAGIC         0x41475348U     /**< "AGSH" */
+#define P_SHM_VER           1
+#define P_SHM_INBOX_LEN     64      /**< unicast frames waiting per MC, power of 2 */
+#define P_SHM_BCAST_LEN     4096    /**< broadcast frames kept, power of 2 */
+#define P_SHM_MAP_LEN       2048    /**< MAC to sim id map, power of 2 larger than SIMNET_ID_MAX */
+#define P_SHM_WAIT_MS       100     /**< max sleep of the RX thread, covers a writer that died mid-frame */
+#define P_SHM_ATTACH_MS     1000    /**< max wait for the MC creating the segment */
+#define P_SHM_STALL_MS      (2 * P_SHM_WAIT_MS) /**< broadcast slot claimed and not written, the writer died */
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the shared-memory transport needs lock-free 64-bit atomics");
+
+typedef struct {
+    _Atomic uint64_t seq;   /**< inbox: position + 1 when written; broadcast: 2 * position + 2 when written */
+    uint16_t len;
+    uint8_t data[SIMNET_MSG_MAX];
+} P_SHM_SLOT_t;
+
+typedef struct {
+    _Atomic HW_MAC_t mac;   /**< MC attached with this sim id, HW_MAC_NONE if none yet */
+    _Atomic uint64_t tail;  /**< next inbox slot for the writers */
+    _Atomic uint64_t head;  /**< next inbox slot for the reader, survives a restart */
+    P_SHM_SLOT_t inbox[P_SHM_INBOX_LEN];
+} P_SHM_NODE_t;
+
+typedef struct {
+    _Atomic uint32_t magic;     /**< set last by the MC creating the segment */
+    uint32_t ver;
+    uint64_t size;
+    _Atomic uint32_t wake;      /**< futex word, bumped by every frame */
+    _Atomic uint32_t sleepers;  /**< readers waiting on wake */
+    _Atomic uint64_t bcast_head;
+    P_SHM_SLOT_t bcast[P_SHM_BCAST_LEN];
+    P_SHM_NODE_t node[SIMNET_ID_MAX];
+} P_SHM_SEG_t;
+
+struct simshm {
+    P_SHM_SEG_t *seg;
+    int id;                     /**< own sim id */
+    uint64_t bcast_rd;          /**< own broadcast cursor, RX thread only */
+    uint64_t stall_pos;         /**< claimed broadcast slot waited for + 1, 0 = none, RX thread only */
+    uint32_t ts_stall;          /**< start of the wait for stall_pos */
+    int16_t map[P_SHM_MAP_LEN]; /**< sim id + 1 by MAC, 0 = empty, linear probing */
+    int map_cnt;
+    uint32_t cnt_hit;           /**< unicast frames written to the inbox of the destination */
+    uint32_t cnt_fallback;      /**< unicast frames broadcast, MAC not learned yet */
+    uint32_t cnt_lost;          /**< frames dropped on a full inbox or overwritten before read */
+    pthread_mutex_t mux;        /**< TX from task_rf, MACs learned by the RX thread */
+};
+
+#define P_SHM_LOCK(shm)     pthread_mutex_lock(&(shm)->mux)
+#define P_SHM_UNLOCK(shm)   pthread_mutex_unlock(&(shm)->mux)
+
+static P_SHM_SEG_t *p_shm_seg;  /**< mapped once per process */
+static pthread_mutex_t p_shm_seg_mux = PTHREAD_MUTEX_INITIALIZER;
+
+static void p_shm_wake(SIMSHM_t *shm, uint32_t mask) {
+    atomic_fetch_add(&shm->seg->wake, 1);
+    if (atomic_load(&shm->seg->sleepers) != 0) {
+        syscall(SYS_futex, &shm->seg->wake, FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL, mask);
+    }
+}
+
+/**
+ * @return value to pass to simshm_sleep(), read before looking for frames
+ */
+uint32_t simshm_wake_seq(SIMSHM_t *shm) {
+    return atomic_load(&shm->seg->wake);
+}
+
+/**
+ * @brief wait for a frame to this MC written after simshm_wake_seq() returned wake
+ */
+void simshm_sleep(SIMSHM_t *shm, uint32_t wake, uint32_t wait_us) {
+    struct timespec ts;
+
+    if (wait_us > (P_SHM_WAIT_MS * 1000)) {
+        wait_us = P_SHM_WAIT_MS * 1000;
+    }
+    simnet_timeout(CLOCK_MONOTONIC, wait_us, &ts);
+    atomic_fetch_add(&shm->seg->sleepers, 1);
+    // returns at once if a frame was written since wake was read
+    syscall(SYS_futex, &shm->seg->wake, FUTEX_WAIT_BITSET, wake, &ts, NULL,
+            1U << (shm->id % 32));
+    atomic_fetch_sub(&shm->seg->sleepers, 1);
+}
+
+/**
+ * @return sim id of the MC with this MAC or -1, call with P_SHM_LOCK
+ */
+static int p_shm_map_find(SIMSHM_t *shm, HW_MAC_t mac) {
+    uint32_t pos = hw_mac_hash(mac) & (P_SHM_MAP_LEN - 1);
+
+    while (shm->map[pos] != 0) {
+        int id = shm->map[pos] - 1;
+        // entries of restarted MCs stay, they no longer match
+        if (atomic_load_explicit(&shm->seg->node[id].mac, memory_order_relaxed) == mac) {
+            return id;
+        }
+        pos = (pos + 1) & (P_SHM_MAP_LEN - 1);
+    }
+    return -1;
+}
+
+/**
+ * @brief remember the MAC of the MC that attached as sim id
+ */
+void simshm_learn(SIMSHM_t *shm, int id, HW_MAC_t mac) {
+    if ((id < 0) || (id >= SIMNET_ID_MAX)
+            || (atomic_load_explicit(&shm->seg->node[id].mac, memory_order_relaxed) != mac)) {
+        return;
+    }
+
+    P_SHM_LOCK(shm);
+    if (p_shm_map_find(shm, mac) < 0) {
+        if (shm->map_cnt >= ((P_SHM_MAP_LEN * 3) / 4)) {
+            // mostly stale entries, learn again from scratch
+            memset(shm->map, 0, sizeof (shm->map));
+            shm->map_cnt = 0;
+        }
+        uint32_t pos = hw_mac_hash(mac) & (P_SHM_MAP_LEN - 1);
+        while (shm->map[pos] != 0) {
+            pos = (pos + 1) & (P_SHM_MAP_LEN - 1);
+        }
+        shm->map[pos] = (int16_t) (id + 1);
+        shm->map_cnt ++;
+    }
+    P_SHM_UNLOCK(shm);
+}
+
+static int p_shm_inbox_put(SIMSHM_t *shm, int id, const uint8_t *buff, size_t nb) {
+    P_SHM_NODE_t *node = &shm->seg->node[id];
+    uint64_t pos = atomic_load_explicit(&node->tail, memory_order_relaxed);
+    P_SHM_SLOT_t *slot;
+
+    while (1) {
+        slot = &node->inbox[pos & (P_SHM_INBOX_LEN - 1)];
+        int64_t dif = (int64_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&node->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // full
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&node->tail, memory_order_relaxed);
+        }
+    }
+    slot->len = (uint16_t) nb;
+    memcpy(slot->data, buff, nb);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    p_shm_wake(shm, 1U << (id % 32));
+    return 0;
+}
+
+static void p_shm_bcast_put(SIMSHM_t *shm, const uint8_t *buff, size_t nb) {
+    uint64_t pos = atomic_fetch_add(&shm->seg->bcast_head, 1);
+    P_SHM_SLOT_t *slot = &shm->seg->bcast[pos & (P_SHM_BCAST_LEN - 1)];
+
+    // odd while written, the readers check it did not change under them
+    atomic_store_explicit(&slot->seq, (2 * pos) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->len = (uint16_t) nb;
+    memcpy(slot->data, buff, nb);
+    atomic_store_explicit(&slot->seq, (2 * pos) + 2, memory_order_release);
+    p_shm_wake(shm, FUTEX_BITSET_MATCH_ANY);
+}
+
+/**
+ * @brief write a sim message, see SIMNET_HDR_NB
+ *
+ * @return 0 if the message was written
+ */
+int simshm_tx(SIMSHM_t *shm, HW_MAC_t dst_mac, const uint8_t *msg, size_t nb) {
+    int id = -1;
+
+    if (dst_mac != HW_MAC_BCAST) {
+        P_SHM_LOCK(shm);
+        id = p_shm_map_find(shm, dst_mac);
+        if (id >= 0) {
+            shm->cnt_hit ++;
+        } else {
+            shm->cnt_fallback ++;
+        }
+        P_SHM_UNLOCK(shm);
+    }
+
+    if (id < 0) {
+        p_shm_bcast_put(shm, msg, nb);
+    } else if (p_shm_inbox_put(shm, id, msg, nb) != 0) {
+        P_SHM_LOCK(shm);
+        shm->cnt_lost ++;
+        P_SHM_UNLOCK(shm);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief next frame of the own inbox
+ *
+ * @return length or 0 if the inbox is empty
+ */
+static ssize_t p_shm_inbox_get(SIMSHM_t *shm, uint8_t *buff) {
+    P_SHM_NODE_t *node = &shm->seg->node[shm->id];
+    uint64_t pos = atomic_load_explicit(&node->head, memory_order_relaxed);
+    P_SHM_SLOT_t *slot = &node->inbox[pos & (P_SHM_INBOX_LEN - 1)];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != (pos + 1)) {
+        return 0;
+    }
+    size_t nb = (slot->len <= SIMNET_MSG_MAX) ? slot->len : 0;
+    memcpy(buff, slot->data, nb);
+    atomic_store_explicit(&slot->seq, pos + P_SHM_INBOX_LEN, memory_order_release);
+    atomic_store_explicit(&node->head, pos + 1, memory_order_relaxed);
+    return (ssize_t) nb;
+}
+
+/**
+ * @brief next broadcast frame of another MC
+ *
+ * @return length or 0 if there is nothing new
+ */
+static ssize_t p_shm_bcast_get(SIMSHM_t *shm, uint8_t *buff) {
+    while (1) {
+        uint64_t head = atomic_load(&shm->seg->bcast_head);
+        uint64_t pos = shm->bcast_rd;
+
+        if (pos == head) {
+            return 0;
+        }
+        P_SHM_SLOT_t *slot = &shm->seg->bcast[pos & (P_SHM_BCAST_LEN - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if ((seq < ((2 * pos) + 2)) && ((head - pos) <= P_SHM_BCAST_LEN)) {
+            // claimed, not written yet
+            if (shm->stall_pos != (pos + 1)) {
+                shm->stall_pos = pos + 1;
+                shm->ts_stall = get_ts_ms();
+                return 0;
+            }
+            if ((int32_t) (get_ts_ms() - shm->ts_stall) < P_SHM_STALL_MS) {
+                return 0;
+            }
+            // the writer died between the claim and the publish
+            shm->stall_pos = 0;
+            P_SHM_LOCK(shm);
+            shm->cnt_lost ++;
+            P_SHM_UNLOCK(shm);
+            shm->bcast_rd = pos + 1;
+            continue;
+        }
+        if (seq != ((2 * pos) + 2)) {
+            // overwritten: skip to the middle of the ring
+            uint64_t pos_new = ((head - pos) > (P_SHM_BCAST_LEN / 2)) ? (head - (P_SHM_BCAST_LEN / 2)) : (pos + 1);
+            P_SHM_LOCK(shm);
+            shm->cnt_lost += (uint32_t) (pos_new - pos);
+            P_SHM_UNLOCK(shm);
+            shm->bcast_rd = pos_new;
+            continue;
+        }
+
+        size_t nb = (slot->len <= SIMNET_MSG_MAX) ? slot->len : 0;
+        memcpy(buff, slot->data, nb);
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t seq_end = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        shm->bcast_rd = pos + 1;
+        if (seq_end != seq) {
+            P_SHM_LOCK(shm);
+            shm->cnt_lost ++;
+            P_SHM_UNLOCK(shm);
+            continue;
+        }
+        if ((nb < SIMNET_HDR_NB) || ((buff[12] | (buff[13] << 8)) == shm->id)) {
+            // own frame
+            continue;
+        }
+        return (ssize_t) nb;
+    }
+}
+
+/**
+ * @brief map the segment, create it if this is the first MC
+ *
+ * @return NULL on failure
+ */
+static P_SHM_SEG_t *p_shm_map(void) {
+    int created = 1;
+    int fd = shm_open(P_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ((fd == -1) && (errno == EEXIST)) {
+        created = 0;
+        fd = shm_open(P_SHM_NAME, O_RDWR, 0);
+    }
+    if (fd == -1) {
+        perror("CANNOT open shm");
+        return NULL;
+    }
+    if (created && (ftruncate(fd, sizeof (P_SHM_SEG_t)) == -1)) {
+        perror("CANNOT size shm");
+        close(fd);
+        return NULL;
+    }
+
+    uint32_t ts_start = get_ts_ms();
+    struct stat st;
+    while ((fstat(fd, &st) == 0) && ((size_t) st.st_size < sizeof (P_SHM_SEG_t))) {
+        if ((get_ts_ms() - ts_start) >= P_SHM_ATTACH_MS) {
+            printf("%s - shm TOO SMALL, remove /dev/shm%s\n", __func__, P_SHM_NAME);
+            close(fd);
+            return NULL;
+        }
+        usleep(1000);
+    }
+    P_SHM_SEG_t *seg = (P_SHM_SEG_t *) mmap(NULL, sizeof (P_SHM_SEG_t), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("CANNOT map shm");
+        return NULL;
+    }
+
+    if (created) {
+        // the rest is zero after ftruncate()
+        seg->ver = P_SHM_VER;
+        seg->size = sizeof (P_SHM_SEG_t);
+        for (int i = 0; i < SIMNET_ID_MAX; i++) {
+            for (uint64_t j = 0; j < P_SHM_INBOX_LEN; j++) {
+                atomic_init(&seg->node[i].inbox[j].seq, j);
+            }
+        }
+        atomic_store_explicit(&seg->magic, P_SHM_MAGIC, memory_order_release);
+    }
+    while (atomic_load_explicit(&seg->magic, memory_order_acquire) != P_SHM_MAGIC) {
+        if ((get_ts_ms() - ts_start) >= P_SHM_ATTACH_MS) {
+            printf("%s - shm NOT initialized, remove /dev/shm%s\n", __func__, P_SHM_NAME);
+            munmap(seg, sizeof (P_SHM_SEG_t));
+            return NULL;
+        }
+        usleep(1000);
+    }
+    if ((seg->ver != P_SHM_VER) || (seg->size != sizeof (P_SHM_SEG_t))) {
+        printf("%s - shm of ANOTHER version, remove /dev/shm%s\n", __func__, P_SHM_NAME);
+        munmap(seg, sizeof (P_SHM_SEG_t));
+        return NULL;
+    }
+
+    return seg;
+}
+
+/**
+ * @brief next message to this MC, unicast first
+ *
+ * @return length or 0 if there is nothing new, RX thread only
+ */
+ssize_t simshm_rx(SIMSHM_t *shm, uint8_t *buff) {
+    ssize_t nb = p_shm_inbox_get(shm, buff);
+
+    if (nb == 0) {
+        nb = p_shm_bcast_get(shm, buff);
+    }
+    return nb;
+}
+
+/**
+ * @brief join the segment as sim id of the MC
+ *
+ * @return NULL on failure
+ */
+SIMSHM_t *simshm_attach(int id, HW_MAC_t mac) {
+    pthread_mutex_lock(&p_shm_seg_mux);
+    if (p_shm_seg == NULL) {
+        p_shm_seg = p_shm_map();
+    }
+    P_SHM_SEG_t *seg = p_shm_seg;
+    pthread_mutex_unlock(&p_shm_seg_mux);
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    SIMSHM_t *shm = (SIMSHM_t *) calloc(1, sizeof (SIMSHM_t));
+    if (shm == NULL) {
+        printf("CANNOT allocate shm state\n");
+        return NULL;
+    }
+    shm->seg = seg;
+    shm->id = id;
+    pthread_mutex_init(&shm->mux, NULL);
+    atomic_store(&seg->node[id].mac, mac);
+    shm->bcast_rd = atomic_load(&seg->bcast_head);
+    return shm;
+}
+
+void simshm_get_stats(SIMSHM_t *shm, SIMNET_STATS_t *stats) {
+    P_SHM_LOCK(shm);
+    stats->hit = shm->cnt_hit;
+    stats->fallback = shm->cnt_fallback;
+    stats->lost = shm->cnt_lost;
+    P_SHM_UNLOCK(shm);
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SIMSHM_T2XOZKPQYQKGHOJC
+#define SIMSHM_T2XOZKPQYQKGHOJC
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "simnet.h"
+
+typedef struct simshm SIMSHM_t;
+
+SIMSHM_t *simshm_attach(int id, HW_MAC_t mac);
+
+int simshm_tx(SIMSHM_t *shm, HW_MAC_t dst_mac, const uint8_t *msg, size_t nb);
+
+ssize_t simshm_rx(SIMSHM_t *shm, uint8_t *buff);
+
+void simshm_learn(SIMSHM_t *shm, int id, HW_MAC_t mac);
+
+uint32_t simshm_wake_seq(SIMSHM_t *shm);
+
+void simshm_sleep(SIMSHM_t *shm, uint32_t wake, uint32_t wait_us);
+
+void simshm_get_stats(SIMSHM_t *shm, SIMNET_STATS_t *stats);
+
+#endif /* SIMSHM_T2XOZKPQYQKGHOJC */
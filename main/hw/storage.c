@@ -13,13 +13,14 @@
 #endif
 
 #include "../agathis/base.h"
+#include "../agathis/ctx.h"
 
 #if defined(ESP_PLATFORM)
 #define NVS_NAMESPACE "pinus"
 #define NVS_KEY "MOD_STATE"
 #endif
 
-void stor_restore_state(void) {
+void stor_restore_state(AG_CTX_t *ctx) {
 #if defined(ESP_PLATFORM)
     nvs_handle_t hndl_nvs;
     esp_err_t err;
@@ -59,12 +60,12 @@ void stor_restore_state(void) {
         free(buff);
         return;
     }
-    if (MOD_STATE.ver != buff[0]) {
+    if (ctx->mod_state.ver != buff[0]) {
         printf("W (%s) OLD state detected\n", __func__);
         free(buff);
         return;
     }
-    memcpy(((uint8_t *) &MOD_STATE), buff, bin_size);
+    memcpy(((uint8_t *) &ctx->mod_state), buff, bin_size);
     free(buff);
     nvs_close(hndl_nvs);
 #else
@@ -76,7 +77,7 @@ void stor_restore_state(void) {
     }
     memset(buff, 0, AG_STORAGE_SIZE);
 
-    const char *fName = SIM_STATE.eeprom_path;
+    const char *fName = ctx->sim->eeprom_path;
     FILE *fp;
 
     fp = fopen(fName, "rb");
@@ -94,23 +95,23 @@ void stor_restore_state(void) {
         return;
     }
 
-    if (MOD_STATE.ver != buff[0]) {
+    if (ctx->mod_state.ver != buff[0]) {
         printf("W (%s) OLD state detected\n", __func__);
         free(buff);
         return;
     }
-    memcpy(((uint8_t *) &MOD_STATE), buff, (sizeof (MOD_STATE) / sizeof (uint8_t)));
+    memcpy(((uint8_t *) &ctx->mod_state), buff, (sizeof (ctx->mod_state) / sizeof (uint8_t)));
     free(buff);
 
-    MOD_STATE.mfr_name[15] = 0x00;
-    MOD_STATE.mfr_pn[15] = 0x00;
-    MOD_STATE.mfr_sn[15] = 0x00;
+    ctx->mod_state.mfr_name[15] = 0x00;
+    ctx->mod_state.mfr_pn[15] = 0x00;
+    ctx->mod_state.mfr_sn[15] = 0x00;
 #endif
     printf("I (%d) state restored\n", __LINE__);
 }
 
-void stor_save_state(void) {
-    size_t state_size = sizeof (MOD_STATE) / sizeof (uint8_t);
+void stor_save_state(AG_CTX_t *ctx) {
+    size_t state_size = sizeof (ctx->mod_state) / sizeof (uint8_t);
     if (state_size > AG_STORAGE_SIZE) {
         printf("E (%s) state size TOO BIG\n", __func__);
         return;
@@ -132,7 +133,7 @@ void stor_save_state(void) {
     }
 
     memset(buff, 0xFF, AG_STORAGE_SIZE);
-    memcpy(buff, ((uint8_t *) &MOD_STATE), state_size);
+    memcpy(buff, ((uint8_t *) &ctx->mod_state), state_size);
     err = nvs_set_blob(hndl_nvs, NVS_KEY, buff, state_size);
     if (err != ESP_OK) {
         printf("E (%s) CANNOT save state\n", __func__);
@@ -149,9 +150,9 @@ void stor_save_state(void) {
         return;
     }
     memset(buff, 0, AG_STORAGE_SIZE);
-    memcpy(buff, ((uint8_t *) &MOD_STATE), state_size);
+    memcpy(buff, ((uint8_t *) &ctx->mod_state), state_size);
 
-    const char *fName = SIM_STATE.eeprom_path;
+    const char *fName = ctx->sim->eeprom_path;
     FILE *fp;
 
     fp = fopen(fName, "wb");
@@ -175,6 +176,6 @@ void stor_save_state(void) {
     printf("I (%d) state saved\n", __LINE__);
 }
 
-void stor_erase_state(void) {
+void stor_erase_state(AG_CTX_t *ctx) {
 
 }
@@ -6,10 +6,12 @@
 
 #include <stdint.h>
 
-void stor_restore_state(void);
+#include "../agathis/defs.h"
 
-void stor_save_state(void);
+void stor_restore_state(AG_CTX_t *ctx);
 
-void stor_erase_state(void);
+void stor_save_state(AG_CTX_t *ctx);
+
+void stor_erase_state(AG_CTX_t *ctx);
 
 #endif /* STORAGE_WJQAWZ7F2E5SSJEN */
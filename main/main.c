@@ -9,21 +9,25 @@
 
 #include "tasks.h"
 #include "agathis/base.h"
+#include "agathis/ctx.h"
 #include "cli/cli.h"
 #include "hw/platform_esp/base.h"
 #include "hw/platform_esp/espnow.h"
 
+static AG_CTX_t p_ctx;
+static CLI_CTX_t p_cli;
+
 void app_main(void) {
     char *appName = pcTaskGetName(NULL);
     ESP_LOGI(appName, "start");
 
     nvs_init();
     gpio_init();
-    ag_init();
-    CLI_init();
+    ag_init(&p_ctx);
+    CLI_init(&p_cli, &p_ctx);
 
-    xTaskCreate(task_cli, "task_CLI", 2048, NULL, tskIDLE_PRIORITY, NULL);
-    xTaskCreate(task_rf, "task_RF", 4096, NULL, (tskIDLE_PRIORITY + 2), NULL);
+    xTaskCreate(task_cli, "task_CLI", 2048, &p_cli, tskIDLE_PRIORITY, NULL);
+    xTaskCreate(task_rf, "task_RF", 4096, &p_ctx, (tskIDLE_PRIORITY + 2), NULL);
 
 //    vTaskDelay(10 / portTICK_PERIOD_MS);
 //    while (1) {
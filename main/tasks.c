@@ -16,38 +16,95 @@
 #include "sim/state.h"
 #endif
 
+#include "agathis/alarm.h"
 #include "agathis/base.h"
 #include "agathis/comm.h"
+#include "agathis/ctx.h"
+#include "agathis/frag.h"
+#include "agathis/ping.h"
+#include "agathis/rcmd.h"
 #include "cli/cli.h"
 #include "hw/misc.h"
 
-static void p_CLI_init_prompt(void) {
+#define RF_HK_PERIOD_MS 1000    /**< period of the RF housekeeping (ID LED) */
+
+/**
+ * @brief process RX frames, run housekeeping when due, send what is pending
+ *
+ * @return time in ms until the next housekeeping pass
+ */
+static uint32_t p_rf_loop(AG_CTX_t *ctx, uint32_t *ts_hk) {
+    uint32_t ts_now = get_ts_ms();
+
+    ag_upd_set(ctx);
+    ag_comm_rx_main(ctx);
+    if ((int32_t) (ts_now - *ts_hk) >= 0) {
+        ag_upd_hw(ctx);
+        *ts_hk += RF_HK_PERIOD_MS;
+        // do not try to catch up if we fell behind
+        if ((int32_t) (ts_now - *ts_hk) >= 0) {
+            *ts_hk = ts_now + RF_HK_PERIOD_MS;
+        }
+    }
+    uint32_t wait_tx = ag_upd_remote_mods(ctx);
+    uint32_t wait_tmp = ag_upd_tmc(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+    wait_tmp = ag_alarm_main(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+    wait_tmp = ag_rcmd_main(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+    wait_tmp = ag_comm_hb_main(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+    wait_tmp = ag_frag_main(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+    wait_tmp = ag_ping_main(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+    wait_tmp = ag_comm_tx_main(ctx);
+    if (wait_tmp < wait_tx) {
+        wait_tx = wait_tmp;
+    }
+
+    ts_now = get_ts_ms();
+    if ((int32_t) (*ts_hk - ts_now) <= 0) {
+        return 0;
+    }
+    return ((*ts_hk - ts_now) < wait_tx) ? (*ts_hk - ts_now) : wait_tx;
+}
+
+static void p_CLI_init_prompt(CLI_CTX_t *cli) {
     char prompt[CLI_PROMPT_SIZE];
-    uint32_t mac[2];
 
-    get_HW_ID_compact(mac);
-#if defined(ESP_PLATFORM)
-    snprintf(prompt, CLI_PROMPT_SIZE, "[%06lx:%06lx]$ ", mac[1], mac[0]);
-#elif defined(__linux__)
-    snprintf(prompt, CLI_PROMPT_SIZE, "[%06x:%06x]$ ", mac[1], mac[0]);
-#endif
+    snprintf(prompt, CLI_PROMPT_SIZE, "[" HW_MAC_FMT "]$ ", HW_MAC_ARG(cli->ag->hw_id));
     printf("press ? for help\n");
-    CLI_setPrompt(prompt);
+    CLI_setPrompt(cli, prompt);
 
     gpio_RGB_send(0);
 }
 
 #if defined(ESP_PLATFORM)
 void task_cli(void *pvParameter) {
+    CLI_CTX_t *cli = (CLI_CTX_t *) pvParameter;
     uint8_t parseSts;
 
-    p_CLI_init_prompt();
+    p_CLI_init_prompt(cli);
     while (1) {
-        printf("%s", CLI_getPrompt());
-        CLI_getCmd();
-        parseSts = CLI_parseCmd();
+        printf("%s", CLI_getPrompt(cli));
+        CLI_getCmd(cli);
+        parseSts = CLI_parseCmd(cli);
         if (parseSts == 0) {
-            CLI_execute();
+            CLI_execute(cli);
         }
         vTaskDelay(100 / portTICK_PERIOD_MS);
     }
@@ -55,20 +112,21 @@ void task_cli(void *pvParameter) {
 }
 #elif defined(__linux__)
 void *task_cli (void *vargp) {
+    CLI_CTX_t *cli = (CLI_CTX_t *) vargp;
     uint8_t parseSts = 1;
 
-    if ((SIM_STATE.sim_flags & SIM_FLAG_NO_CONSOLE) != 0) {
+    if ((cli->ag->sim->sim_flags & SIM_FLAG_NO_CONSOLE) != 0) {
         while (1) {
             sleep(1);
         }
     } else {
-        p_CLI_init_prompt();
+        p_CLI_init_prompt(cli);
         while (1) {
-            printf("%s", CLI_getPrompt());
-            CLI_getCmd();
-            parseSts = CLI_parseCmd();
+            printf("%s", CLI_getPrompt(cli));
+            CLI_getCmd(cli);
+            parseSts = CLI_parseCmd(cli);
             if (parseSts == 0) {
-                CLI_execute();
+                CLI_execute(cli);
             }
         }
     }
@@ -78,28 +136,28 @@ void *task_cli (void *vargp) {
 #if defined(ESP_PLATFORM)
 void task_rf(void *pvParameter) {
     //char *appName = pcTaskGetName(NULL);
-    ag_comm_init();
+    AG_CTX_t *ctx = (AG_CTX_t *) pvParameter;
+
+    ag_comm_start(ctx);
     vTaskDelay(100 / portTICK_PERIOD_MS);
 
+    uint32_t ts_hk = get_ts_ms();
     while (1) {
-        ag_comm_main();
-        ag_upd_remote_mods();
-        ag_upd_alarm();
-        ag_upd_hw();
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        // RX wakes us up early, housekeeping keeps its own period
+        ag_comm_wait(ctx, p_rf_loop(ctx, &ts_hk));
     }
     vTaskDelete(NULL);
 }
 #elif defined(__linux__)
 void *task_rf (void *vargp) {
-    ag_comm_init();
+    AG_CTX_t *ctx = (AG_CTX_t *) vargp;
+
+    ag_comm_start(ctx);
 
+    uint32_t ts_hk = get_ts_ms();
     while (1) {
-        ag_comm_main();
-        ag_upd_remote_mods();
-        ag_upd_alarm();
-        ag_upd_hw();
-        sleep(1);
+        // RX wakes us up early, housekeeping keeps its own period
+        ag_comm_wait(ctx, p_rf_loop(ctx, &ts_hk));
     }
 }
 #endif